@@ -0,0 +1,226 @@
+/**
+ * Startup calibration of the kernel parameters
+ *
+ * The best tiling and prefetch distances depend on the cache sizes of the machine.
+ * Every candidate is run a few times on scratch buffers with the geometry of a single TAB,
+ * and the fastest is used. The result is cached per host, science case, and mode in a text file,
+ * so later starts skip the calibration. One line per configuration:
+ *
+ *   <hostname> <science case> <science mode> <deinterleave block> <deinterleave prefetch> <downsample prefetch> <synthesize time outer>
+ *
+ * Without --autotune, the defaults from kernels.h are used.
+ */
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <errno.h>
+
+#include "dadafits_internal.h"
+#include "kernels.h"
+
+// times every candidate is run, the fastest run counts
+#define AUTOTUNE_REPEAT 3
+
+kernel_tuning_t kernel_tuning = {
+  DEINTERLEAVE_BLOCK_DEFAULT,
+  DEINTERLEAVE_PREFETCH_DEFAULT,
+  DOWNSAMPLE_PREFETCH_DEFAULT,
+  SYNTHESIZE_TIME_OUTER_DEFAULT
+};
+
+// candidates; blocks must divide NCHANNELS / 4
+static const int deinterleave_blocks[] = {1, 2, 4, 8, 16};
+static const int deinterleave_prefetches[] = {0, 512, 2048, 8192};
+static const int downsample_prefetches[] = {0, 256, 1024, 4096};
+
+#define NCANDIDATES(c) (sizeof(c) / sizeof(c[0]))
+
+static double now() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + 1e-9 * ts.tv_nsec;
+}
+
+/**
+ * Look up the parameters for this host and configuration
+ *
+ * @returns {int} 1 when found, 0 otherwise
+ */
+static int autotune_read_cache(const char *fname, const char *host, const int science_case, const int science_mode, kernel_tuning_t *tuning) {
+  char line[512];
+  char name[256];
+  int cached_case, cached_mode;
+  kernel_tuning_t cached;
+  int found = 0;
+
+  FILE *file = fopen(fname, "r");
+  if (! file) {
+    return 0;
+  }
+
+  // the last matching line wins
+  while (fgets(line, 512, file)) {
+    if (sscanf(line, "%255s %i %i %i %i %i %i", name, &cached_case, &cached_mode,
+          &cached.deinterleave_block, &cached.deinterleave_prefetch,
+          &cached.downsample_prefetch, &cached.synthesize_time_outer) == 7 &&
+        strcmp(name, host) == 0 && cached_case == science_case && cached_mode == science_mode &&
+        cached.deinterleave_block > 0 && (NCHANNELS / 4) % cached.deinterleave_block == 0) {
+      *tuning = cached;
+      found = 1;
+    }
+  }
+  fclose(file);
+
+  return found;
+}
+
+/**
+ * Calibrate the Stokes I kernels
+ */
+static void autotune_stokes_i(const dadafits_context_t *ctx, kernel_tuning_t *tuning) {
+  unsigned char *buffer = malloc(NCHANNELS * ctx->padded_size);
+  unsigned int *downsampled = malloc(NCHANNELS_LOW * NTIMES_LOW * sizeof(unsigned int));
+  if (! buffer || ! downsampled) {
+    LOG("Warning: cannot allocate buffers for autotuning, using defaults\n");
+    free(buffer);
+    free(downsampled);
+    return;
+  }
+
+  long i;
+  for (i = 0; i < NCHANNELS * ctx->padded_size; i++) {
+    buffer[i] = i * 7;
+  }
+
+  double best = -1;
+  int p, r;
+  for (p = 0; p < NCANDIDATES(downsample_prefetches); p++) {
+    for (r = 0; r < AUTOTUNE_REPEAT; r++) {
+      double start = now();
+      if (ctx->science_case == 3) {
+        downsample_sc3(buffer, ctx->padded_size, downsampled, downsample_prefetches[p]);
+      } else {
+        downsample_sc4(buffer, ctx->padded_size, downsampled, downsample_prefetches[p]);
+      }
+      double elapsed = now() - start;
+
+      if (best < 0 || elapsed < best) {
+        best = elapsed;
+        tuning->downsample_prefetch = downsample_prefetches[p];
+      }
+    }
+  }
+  LOG("Autotune: downsampling a TAB takes %.2f ms\n", 1e3 * best);
+
+  free(buffer);
+  free(downsampled);
+}
+
+/**
+ * Calibrate the Stokes IQUV kernels
+ */
+static void autotune_stokes_iquv(const dadafits_context_t *ctx, const int synthesize, kernel_tuning_t *tuning) {
+  const long size = (long) NCHANNELS * NPOLS * ctx->ntimes;
+  unsigned char *page = malloc(size);
+  unsigned char *transposed = malloc(size);
+  unsigned char *synthesized = synthesize ? malloc(size) : NULL;
+  if (! page || ! transposed || (synthesize && ! synthesized)) {
+    LOG("Warning: cannot allocate buffers for autotuning, using defaults\n");
+    free(page);
+    free(transposed);
+    free(synthesized);
+    return;
+  }
+
+  long i;
+  for (i = 0; i < size; i++) {
+    page[i] = i * 7;
+  }
+
+  double best = -1;
+  int b, p, r;
+  for (b = 0; b < NCANDIDATES(deinterleave_blocks); b++) {
+    for (p = 0; p < NCANDIDATES(deinterleave_prefetches); p++) {
+      for (r = 0; r < AUTOTUNE_REPEAT; r++) {
+        double start = now();
+        deinterleave_page(page, transposed, 1, ctx->ntimes, deinterleave_blocks[b], deinterleave_prefetches[p]);
+        double elapsed = now() - start;
+
+        if (best < 0 || elapsed < best) {
+          best = elapsed;
+          tuning->deinterleave_block = deinterleave_blocks[b];
+          tuning->deinterleave_prefetch = deinterleave_prefetches[p];
+        }
+      }
+    }
+  }
+  LOG("Autotune: deinterleaving a TAB takes %.2f ms\n", 1e3 * best);
+
+  if (synthesize) {
+    // all subbands from the single scratch TAB
+    int subband_tabs[NSUBBANDS];
+    memset(subband_tabs, 0, sizeof(subband_tabs));
+
+    best = -1;
+    int order;
+    for (order = 0; order < 2; order++) {
+      for (r = 0; r < AUTOTUNE_REPEAT; r++) {
+        double start = now();
+        synthesize_beam(transposed, subband_tabs, synthesized, ctx->ntimes, order);
+        double elapsed = now() - start;
+
+        if (best < 0 || elapsed < best) {
+          best = elapsed;
+          tuning->synthesize_time_outer = order;
+        }
+      }
+    }
+    LOG("Autotune: synthesizing a beam takes %.2f ms\n", 1e3 * best);
+  }
+
+  free(page);
+  free(transposed);
+  free(synthesized);
+}
+
+/**
+ * Choose the kernel parameters for this machine: from the cache file, or by calibration
+ *
+ * @param {char *} cache_file           File with the parameters per host; appended to after calibration
+ * @param {dadafits_context_t *} ctx    Kernel context with the geometry
+ * @param {int} synthesize              Synthesized beams will be made
+ */
+void autotune_init(const char *cache_file, const dadafits_context_t *ctx, const int synthesize) {
+  char host[256];
+
+  if (gethostname(host, 256)) {
+    strcpy(host, "unknown");
+  }
+  host[255] = '\0';
+
+  if (autotune_read_cache(cache_file, host, ctx->science_case, ctx->science_mode, &kernel_tuning)) {
+    LOG("Using kernel parameters for %s from %s\n", host, cache_file);
+  } else {
+    LOG("Calibrating kernel parameters for %s\n", host);
+    if (ctx->science_mode == 0 || ctx->science_mode == 2) {
+      autotune_stokes_i(ctx, &kernel_tuning);
+    } else {
+      autotune_stokes_iquv(ctx, synthesize, &kernel_tuning);
+    }
+
+    FILE *file = fopen(cache_file, "a");
+    if (file) {
+      fprintf(file, "%s %i %i %i %i %i %i\n", host, ctx->science_case, ctx->science_mode,
+          kernel_tuning.deinterleave_block, kernel_tuning.deinterleave_prefetch,
+          kernel_tuning.downsample_prefetch, kernel_tuning.synthesize_time_outer);
+      fclose(file);
+    } else {
+      LOG("Warning: cannot write kernel parameters to %s: %s\n", cache_file, strerror(errno));
+    }
+  }
+
+  LOG("Kernel parameters: deinterleave block %i, prefetch %i; downsample prefetch %i; synthesize %s\n",
+      kernel_tuning.deinterleave_block, kernel_tuning.deinterleave_prefetch,
+      kernel_tuning.downsample_prefetch, kernel_tuning.synthesize_time_outer ? "time outer" : "subband outer");
+}
@@ -0,0 +1,433 @@
+/**
+ * Batch reprocessing of recorded observations
+ *
+ * All .dada files below a directory are grouped per observation (UTC_START), and every
+ * observation is processed by a child dadafits reading the files with --input.
+ * The pipeline keeps its state in globals, so jobs run as separate processes; the batch
+ * runner keeps as many of them going as the limits on jobs and memory allow, and divides
+ * the worker threads and the write budget over the running jobs.
+ *
+ * Progress is kept in a state file in the output directory. A rerun skips finished
+ * observations, and continues unfinished ones with --resume.
+ */
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <ftw.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+
+#include "ascii_header.h"
+#include "dadafits_internal.h"
+
+#define BATCH_STATE_FILE "dadafits_batch.state"
+#define BATCH_HEADER_SIZE 4096
+#define BATCH_JOBS_MAX 4096
+#define BATCH_FILES_MAX 64
+
+typedef struct {
+  char name[256];                     // UTC_START of the observation
+  char *files[BATCH_FILES_MAX];       // in order of OBS_OFFSET
+  long offsets[BATCH_FILES_MAX];
+  int nfiles;
+  long long bytes;                    // total size of the files
+  long long memory;                   // estimated memory use of the child
+  int resume;                         // an earlier run did not finish this job
+  int done;
+
+  // while running
+  pid_t pid;
+  int file;                           // index of the file being processed
+  double start;
+} batch_job_t;
+
+static batch_job_t *jobs = NULL;
+static int njobs = 0;
+static int nskipped = 0;
+
+// per job paths are derived from these, so concurrent jobs do not share files
+static const char *batch_staging = NULL;
+static const char *batch_monitor = NULL;
+static const char *batch_perf = NULL;
+
+static double now() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + 1e-9 * ts.tv_nsec;
+}
+
+/**
+ * Estimate the memory used by dadafits for one page of the given geometry
+ * This follows the allocations in main: the page, and for Stokes IQUV the transpose and synthesized beam buffers
+ */
+static long long batch_memory(const int science_case, const int science_mode, const int padded_size) {
+  dadafits_context_t ctx;
+
+  if (dadafits_context_init(&ctx, science_case, science_mode, padded_size)) {
+    return -1;
+  }
+
+  if (science_mode == 0 || science_mode == 2) {
+    return (long long) ctx.ntabs * NCHANNELS * padded_size;
+  }
+  long long tabs = (long long) ctx.ntabs * NCHANNELS * NPOLS * ctx.ntimes;
+  return 2 * tabs + (long long) NCHANNELS * NPOLS * ctx.ntimes;
+}
+
+/**
+ * Add a .dada file to the job for its observation, called by nftw
+ */
+static int batch_add_file(const char *fname, const struct stat *st, int type, struct FTW *ftw) {
+  char header[BATCH_HEADER_SIZE + 1];
+  char name[256];
+  int science_case, science_mode, padded_size;
+  long obs_offset = 0;
+  int j, f;
+
+  const char *extension = rindex(fname, '.');
+  if (type != FTW_F || ! extension || strcmp(extension, ".dada")) {
+    return 0;
+  }
+
+  int fd = open(fname, O_RDONLY);
+  if (fd < 0 || read(fd, header, BATCH_HEADER_SIZE) != BATCH_HEADER_SIZE) {
+    LOG("Batch: skipping unreadable file '%s'\n", fname);
+    if (fd >= 0) close(fd);
+    nskipped++;
+    return 0;
+  }
+  close(fd);
+  header[BATCH_HEADER_SIZE] = '\0';
+
+  if (ascii_header_get(header, "UTC_START", "%255s", name) == -1 ||
+      ascii_header_get(header, "SCIENCE_CASE", "%i", &science_case) == -1 ||
+      ascii_header_get(header, "SCIENCE_MODE", "%i", &science_mode) == -1 ||
+      ascii_header_get(header, "PADDED_SIZE", "%i", &padded_size) == -1) {
+    LOG("Batch: skipping '%s', header incomplete\n", fname);
+    nskipped++;
+    return 0;
+  }
+  ascii_header_get(header, "OBS_OFFSET", "%li", &obs_offset);
+
+  long long memory = batch_memory(science_case, science_mode, padded_size);
+  if (memory < 0) {
+    LOG("Batch: skipping '%s', unsupported science case %i or mode %i\n", fname, science_case, science_mode);
+    nskipped++;
+    return 0;
+  }
+
+  for (j = 0; j < njobs && strcmp(jobs[j].name, name); j++);
+  if (j == njobs) {
+    if (njobs == BATCH_JOBS_MAX) {
+      LOG("Batch: too many observations (more than %i)\n", BATCH_JOBS_MAX);
+      return 1;
+    }
+    memset(&jobs[j], 0, sizeof(batch_job_t));
+    strcpy(jobs[j].name, name);
+    njobs++;
+  }
+
+  batch_job_t *job = &jobs[j];
+  if (job->nfiles == BATCH_FILES_MAX) {
+    LOG("Batch: too many files for observation %s (more than %i)\n", name, BATCH_FILES_MAX);
+    return 1;
+  }
+
+  // insert sorted by OBS_OFFSET
+  for (f = job->nfiles; f > 0 && job->offsets[f - 1] > obs_offset; f--) {
+    job->files[f] = job->files[f - 1];
+    job->offsets[f] = job->offsets[f - 1];
+  }
+  job->files[f] = strdup(fname);
+  job->offsets[f] = obs_offset;
+  job->nfiles++;
+  job->bytes += st->st_size;
+  job->memory = memory;
+
+  return 0;
+}
+
+/**
+ * Read the state file of an earlier run: the last state per observation counts
+ */
+static void batch_read_state(const char *fname) {
+  char line[512], name[256], state[32];
+  int j;
+
+  FILE *file = fopen(fname, "r");
+  if (! file) {
+    return;
+  }
+
+  while (fgets(line, 512, file)) {
+    if (sscanf(line, "%255s %31s", name, state) != 2) {
+      continue;
+    }
+    for (j = 0; j < njobs; j++) {
+      if (strcmp(jobs[j].name, name) == 0) {
+        jobs[j].done = strcmp(state, "done") == 0;
+        jobs[j].resume = ! jobs[j].done;
+      }
+    }
+  }
+  fclose(file);
+}
+
+/**
+ * Append a line to the state file, and make sure it is on disk
+ */
+static void batch_write_state(FILE *state, batch_job_t *job, const char *what) {
+  double seconds = job->start > 0 ? now() - job->start : 0;
+
+  fprintf(state, "%s %s files: %i bytes: %lli seconds: %.1f throughput: %.1f MB/s\n", job->name, what,
+      job->nfiles, job->bytes, seconds, seconds > 0 ? job->bytes / seconds / 1e6 : 0.0);
+  fflush(state);
+  fsync(fileno(state));
+}
+
+/**
+ * Is this commandline argument one of the options set by the batch runner per job
+ *
+ * @returns {int} 0 if not, otherwise the number of arguments to drop (1 or 2)
+ */
+static int batch_own_option(const char *arg) {
+  // options that take an argument
+  const char *with_argument[] = {"-d", "-l", "-k", "--batch", "--batch-jobs", "--batch-memory", "--threads", "--write-rate", "--input",
+    "--staging", "--monitor", "--perf-file", NULL};
+  int o;
+
+  if (strcmp(arg, "--resume") == 0) {
+    return 1;
+  }
+  for (o = 0; with_argument[o]; o++) {
+    int len = strlen(with_argument[o]);
+    if (strcmp(arg, with_argument[o]) == 0) {
+      return 2; // option and its argument
+    }
+    if (strncmp(arg, with_argument[o], len) == 0 && (len == 2 || arg[len] == '=')) {
+      return 1; // option with attached argument: -dvalue or --option=value
+    }
+  }
+  return 0;
+}
+
+/**
+ * Start the child process for the current file of a job
+ */
+static void batch_start(batch_job_t *job, int argc, char *argv[], const char *output_directory, const int threads, const float rate) {
+  char outdir[1024], logfile[1100], threads_arg[32], rate_arg[32];
+  char staging[1024], monitor[1024], perf[1100];
+  char *args[argc + 26];
+  int a, n = 0;
+
+  snprintf(outdir, 1024, "%s/%s", output_directory, job->name);
+  snprintf(logfile, 1100, "%s/dadafits.%i.log", outdir, job->file);
+  snprintf(threads_arg, 32, "%i", threads);
+  snprintf(rate_arg, 32, "%f", rate);
+
+  if (mkdir(outdir, 0755) < 0 && errno != EEXIST) {
+    LOG("Batch: cannot create '%s': %s\n", outdir, strerror(errno));
+    exit(EXIT_FAILURE);
+  }
+  if (batch_staging) {
+    snprintf(staging, 1024, "%s/%s", batch_staging, job->name);
+    if (mkdir(staging, 0755) < 0 && errno != EEXIST) {
+      LOG("Batch: cannot create '%s': %s\n", staging, strerror(errno));
+      exit(EXIT_FAILURE);
+    }
+  }
+  // all files of an observation append to the same monitor stream
+  snprintf(monitor, 1024, "%s.%s", batch_monitor ? batch_monitor : "", job->name);
+  snprintf(perf, 1100, "%s.%s.%i", batch_perf ? batch_perf : "", job->name, job->file);
+
+  // pass on the options shared by all jobs
+  args[n++] = argv[0];
+  for (a = 1; a < argc; a++) {
+    int drop = batch_own_option(argv[a]);
+    if (drop) {
+      a += drop - 1;
+    } else {
+      args[n++] = argv[a];
+    }
+  }
+  args[n++] = "--input";
+  args[n++] = job->files[job->file];
+  args[n++] = "-d";
+  args[n++] = outdir;
+  args[n++] = "-l";
+  args[n++] = logfile;
+  args[n++] = "--threads";
+  args[n++] = threads_arg;
+  if (batch_staging) {
+    args[n++] = "--staging";
+    args[n++] = staging;
+  }
+  if (batch_monitor) {
+    args[n++] = "--monitor";
+    args[n++] = monitor;
+  }
+  if (batch_perf) {
+    args[n++] = "--perf-file";
+    args[n++] = perf;
+  }
+  if (rate > 0) {
+    args[n++] = "--write-rate";
+    args[n++] = rate_arg;
+  }
+  if (job->file > 0 || job->resume) {
+    // later files of an observation, or an interrupted earlier run, append to the same output
+    args[n++] = "--resume";
+  }
+  args[n] = NULL;
+
+  job->pid = fork();
+  if (job->pid < 0) {
+    LOG("Batch: cannot fork: %s\n", strerror(errno));
+    exit(EXIT_FAILURE);
+  }
+  if (job->pid == 0) {
+    execv("/proc/self/exe", args);
+    fprintf(stderr, "Batch: cannot start dadafits: %s\n", strerror(errno));
+    _exit(EXIT_FAILURE);
+  }
+
+  LOG("Batch: started %s file %i/%i '%s' (pid %i)\n", job->name, job->file + 1, job->nfiles, job->files[job->file], job->pid);
+}
+
+/**
+ * Process all observations below a directory
+ *
+ * @param {char *} directory          Directory tree to search for .dada files
+ * @param {char *} output_directory   Output goes to a subdirectory per observation
+ * @param {int} max_jobs              Maximum number of concurrent jobs, 0 for one per 4 processors
+ * @param {float} memory_mb           Memory budget in MB for all jobs together, 0 for half the physical memory
+ * @param {int} threads               Worker threads for all jobs together, 0 for all processors
+ * @param {float} rate                Write budget in MB/s for all jobs together, 0 for unlimited
+ * @param {char *} staging            Staging directory, or NULL; jobs stage in a subdirectory per observation
+ * @param {char *} monitor            Monitor file, or NULL; jobs write to <monitor>.<UTC_START>
+ * @param {char *} perf               Performance counter file, or NULL; jobs write to <perf>.<UTC_START>.<file>
+ * @param {int} argc, argv            Commandline, the shared options are passed on to the jobs
+ * @returns {int}                     Number of failed jobs
+ */
+int batch_run(const char *directory, const char *output_directory, int max_jobs, float memory_mb,
+    int threads, const float rate, const char *staging, const char *monitor, const char *perf, int argc, char *argv[]) {
+  char state_name[1024];
+  int j, running = 0, failed = 0, finished = 0;
+  long long memory_used = 0;
+
+  if (! output_directory) {
+    output_directory = ".";
+  }
+  batch_staging = staging;
+  batch_monitor = monitor;
+  batch_perf = perf;
+  if (threads <= 0) {
+    threads = sysconf(_SC_NPROCESSORS_ONLN);
+  }
+  if (max_jobs <= 0) {
+    max_jobs = threads / 4 > 0 ? threads / 4 : 1;
+  }
+  long long memory_budget = memory_mb > 0 ? (long long) (memory_mb * 1e6) :
+    (long long) sysconf(_SC_PHYS_PAGES) * sysconf(_SC_PAGESIZE) / 2;
+
+  jobs = calloc(BATCH_JOBS_MAX, sizeof(batch_job_t));
+  if (nftw(directory, batch_add_file, 32, FTW_PHYS) < 0) {
+    LOG("Batch: cannot search '%s': %s\n", directory, strerror(errno));
+    return 1;
+  }
+
+  snprintf(state_name, 1024, "%s/" BATCH_STATE_FILE, output_directory);
+  batch_read_state(state_name);
+  FILE *state = fopen(state_name, "a");
+  if (! state) {
+    LOG("Batch: cannot open state file '%s': %s\n", state_name, strerror(errno));
+    return 1;
+  }
+
+  int todo = 0;
+  for (j = 0; j < njobs; j++) {
+    todo += jobs[j].done ? 0 : 1;
+  }
+  LOG("Batch: %i observations in '%s', %i to do, %i files skipped\n", njobs, directory, todo, nskipped);
+  LOG("Batch: at most %i jobs, %.0f MB memory, %i threads, %s%.1f MB/s writes\n",
+      max_jobs, memory_budget / 1e6, threads, rate > 0 ? "" : "unlimited ", rate);
+
+  // threads and write rate are divided over the maximum number of concurrent jobs
+  int job_threads = threads / max_jobs > 0 ? threads / max_jobs : 1;
+  float job_rate = rate / max_jobs;
+
+  int next = 0;
+  while (1) {
+    // start jobs while the limits allow; a job too large for the budget runs on its own
+    while (next < njobs && running < max_jobs) {
+      batch_job_t *job = &jobs[next];
+      if (job->done) {
+        next++;
+        continue;
+      }
+      if (running > 0 && memory_used + job->memory > memory_budget) {
+        break;
+      }
+      if (job->memory > memory_budget) {
+        LOG("Batch: %s needs %.0f MB, more than the memory budget\n", job->name, job->memory / 1e6);
+      }
+
+      job->file = 0;
+      job->start = 0;
+      batch_write_state(state, job, "started");
+      job->start = now();
+      batch_start(job, argc, argv, output_directory, job_threads, job_rate);
+      memory_used += job->memory;
+      running++;
+      next++;
+    }
+
+    if (running == 0) {
+      break;
+    }
+
+    int status;
+    pid_t pid = waitpid(-1, &status, 0);
+    if (pid < 0) {
+      if (errno == EINTR) continue;
+      LOG("Batch: waitpid failed: %s\n", strerror(errno));
+      break;
+    }
+    for (j = 0; j < njobs && jobs[j].pid != pid; j++);
+    if (j == njobs) {
+      continue;
+    }
+
+    batch_job_t *job = &jobs[j];
+    job->pid = 0;
+    int ok = WIFEXITED(status) && WEXITSTATUS(status) == 0;
+
+    if (ok && job->file + 1 < job->nfiles) {
+      // continue with the next file of the same observation, in the same slot
+      job->file++;
+      batch_start(job, argc, argv, output_directory, job_threads, job_rate);
+      continue;
+    }
+
+    running--;
+    memory_used -= job->memory;
+    if (ok) {
+      job->done = 1;
+      finished++;
+      batch_write_state(state, job, "done");
+      LOG("Batch: finished %s in %.1f s, %.1f MB/s\n", job->name, now() - job->start, job->bytes / (now() - job->start) / 1e6);
+    } else {
+      failed++;
+      batch_write_state(state, job, "failed");
+      LOG("Batch: %s failed on file '%s', see its log file\n", job->name, job->files[job->file]);
+    }
+  }
+
+  fclose(state);
+  LOG("Batch: %i observations done, %i failed\n", finished, failed);
+  return failed;
+}
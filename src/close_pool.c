@@ -0,0 +1,192 @@
+/**
+ * Finish output files on a pool of threads
+ *
+ * Closing a file flushes the library buffers and rewrites the headers, which takes a while for
+ * every file; one after another, the end of an observation takes the sum of all of them.
+ * The files are handed out to closer threads, while the calling thread logs the progress
+ * and waits at most the time budget set with close_pool_init.
+ *
+ * When the budget runs out, the remaining files are not started, and the call returns;
+ * files still being closed are left to their threads, and are lost when the process exits.
+ * Neither are migrated from the staging directory; see close_pool_pending and migrate_finish.
+ */
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "dadafits_internal.h"
+
+// seconds between progress messages
+#define CLOSE_PROGRESS_INTERVAL 5
+
+typedef struct {
+  close_func_t close_one;
+  int count;
+  int next;        // next file to hand out
+  int finished;    // files closed
+  int threads;     // closer threads still running
+  int abandoned;   // the caller stopped waiting; the last thread frees the pool
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+  int items[];
+} close_pool_t;
+
+static float pool_timeout = 0; // seconds, 0 for unlimited
+static int pool_pending = 0;   // files being closed by the threads of all pools, also abandoned ones
+
+static double now() {
+  struct timespec ts;
+  clock_gettime(CLOCK_REALTIME, &ts);
+  return ts.tv_sec + 1e-9 * ts.tv_nsec;
+}
+
+static void *closer_main(void *arg) {
+  close_pool_t *pool = (close_pool_t *) arg;
+
+  pthread_mutex_lock(&pool->lock);
+  while (! pool->abandoned && pool->next < pool->count) {
+    int item = pool->items[pool->next++];
+    __atomic_add_fetch(&pool_pending, 1, __ATOMIC_ACQ_REL);
+    pthread_mutex_unlock(&pool->lock);
+
+    pool->close_one(item);
+
+    pthread_mutex_lock(&pool->lock);
+    __atomic_sub_fetch(&pool_pending, 1, __ATOMIC_ACQ_REL);
+    pool->finished++;
+    pthread_cond_signal(&pool->cond);
+  }
+  pool->threads--;
+  int cleanup = pool->abandoned && pool->threads == 0;
+  pthread_cond_signal(&pool->cond);
+  pthread_mutex_unlock(&pool->lock);
+
+  if (cleanup) {
+    pthread_mutex_destroy(&pool->lock);
+    pthread_cond_destroy(&pool->cond);
+    free(pool);
+  }
+  return NULL;
+}
+
+/**
+ * Set the time budget for closing files
+ *
+ * @param {float} timeout     Seconds to wait for all files of one close_files call, 0 for unlimited
+ */
+void close_pool_init(const float timeout) {
+  pool_timeout = timeout;
+}
+
+/**
+ * Number of files still being closed, by threads left behind after a timeout
+ *
+ * @returns {int} Files being closed
+ */
+int close_pool_pending() {
+  return __atomic_load_n(&pool_pending, __ATOMIC_ACQUIRE);
+}
+
+/**
+ * Close files on a pool of threads, and wait until done or until the time budget runs out
+ *
+ * @param {char *} what             Kind of files, for the log
+ * @param {close_func_t} close_one  Function that closes a single file, given its item
+ * @param {int *} items             Items to close, passed to close_one
+ * @param {int} count               Number of items
+ * @param {int} nthreads            Maximum number of closer threads; 1 when the library is not reentrant
+ * @returns {int}                   Number of files not closed within the budget
+ */
+int close_files(const char *what, close_func_t close_one, const int *items, const int count, int nthreads) {
+  if (count == 0) {
+    return 0;
+  }
+  if (nthreads > count) {
+    nthreads = count;
+  }
+  if (nthreads < 1) {
+    nthreads = 1;
+  }
+
+  close_pool_t *pool = malloc(sizeof(close_pool_t) + count * sizeof(int));
+  if (! pool) {
+    LOG("Error: cannot allocate the close pool\n");
+    exit(EXIT_FAILURE);
+  }
+  pool->close_one = close_one;
+  pool->count = count;
+  pool->next = 0;
+  pool->finished = 0;
+  pool->threads = 0;
+  pool->abandoned = 0;
+  pthread_mutex_init(&pool->lock, NULL);
+  pthread_cond_init(&pool->cond, NULL);
+  memcpy(pool->items, items, count * sizeof(int));
+
+  double start = now();
+  LOG("Closing %i %s on %i threads\n", count, what, nthreads);
+
+  pthread_attr_t attr;
+  pthread_attr_init(&attr);
+  pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+
+  int t;
+  pthread_mutex_lock(&pool->lock);
+  for (t = 0; t < nthreads; t++) {
+    pthread_t thread;
+    pool->threads++;
+    if (pthread_create(&thread, &attr, closer_main, pool)) {
+      pool->threads--;
+      break;
+    }
+  }
+  pthread_attr_destroy(&attr);
+
+  if (pool->threads == 0) {
+    // no threads available: close the files here, without a time budget
+    LOG("Warning: cannot start closer threads, closing %s one by one\n", what);
+    pool->threads = 1;
+    pthread_mutex_unlock(&pool->lock);
+    closer_main(pool);
+    pthread_mutex_lock(&pool->lock);
+  }
+
+  double progress = start + CLOSE_PROGRESS_INTERVAL;
+  double deadline = pool_timeout > 0 ? start + pool_timeout : 0;
+  while (pool->threads > 0) {
+    double wakeup = deadline > 0 && deadline < progress ? deadline : progress;
+    struct timespec ts;
+    ts.tv_sec = (time_t) wakeup;
+    ts.tv_nsec = (long) ((wakeup - ts.tv_sec) * 1e9);
+
+    if (pthread_cond_timedwait(&pool->cond, &pool->lock, &ts) != ETIMEDOUT || pool->threads == 0) {
+      continue;
+    }
+
+    double current = now();
+    if (deadline > 0 && current >= deadline) {
+      int missing = count - pool->finished;
+      LOG("Warning: closing %s timed out after %.1f s, %i of %i not finished\n", what, current - start, missing, count);
+      if (migrate_active()) {
+        LOG("Warning: %i %s not closed are left in the staging directory, and are not migrated\n", missing, what);
+      }
+      pool->abandoned = 1;
+      pthread_mutex_unlock(&pool->lock);
+      return missing;
+    }
+    if (current >= progress) {
+      LOG("Closing %s: %i of %i done after %.0f s\n", what, pool->finished, count, current - start);
+      progress += CLOSE_PROGRESS_INTERVAL;
+    }
+  }
+  pthread_mutex_unlock(&pool->lock);
+
+  LOG("Closed %i %s in %.1f s\n", count, what, now() - start);
+
+  pthread_mutex_destroy(&pool->lock);
+  pthread_cond_destroy(&pool->cond);
+  free(pool);
+  return 0;
+}
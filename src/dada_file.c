@@ -0,0 +1,130 @@
+/**
+ * Read recorded observations directly from .dada files, as written by dada_dbdisk
+ *
+ * A .dada file is an ASCII header of HDR_SIZE bytes (normally 4096), followed by the
+ * contents of the ringbuffer pages. Reading the file directly allows seeking to a page,
+ * instead of streaming all pages through a ringbuffer.
+ */
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "ascii_header.h"
+#include "dadafits_internal.h"
+
+#define DADA_DEFAULT_HEADER_SIZE 4096
+
+static int dada_fd = -1;
+static long dada_header_size = 0;
+static long dada_page_size = 0;
+static char *dada_page = NULL;
+
+/**
+ * Open a .dada file and read its header
+ *
+ * @param {char *} fname   File to open
+ * @returns {char *}       Zero terminated header, to be freed by the caller
+ */
+char *dada_file_open(const char *fname) {
+  dada_fd = open(fname, O_RDONLY);
+  if (dada_fd < 0) {
+    LOG("Error: cannot open input file '%s': %s\n", fname, strerror(errno));
+    exit(EXIT_FAILURE);
+  }
+
+  char *header = malloc(DADA_DEFAULT_HEADER_SIZE + 1);
+  if (read(dada_fd, header, DADA_DEFAULT_HEADER_SIZE) != DADA_DEFAULT_HEADER_SIZE) {
+    LOG("Error: cannot read header from '%s'\n", fname);
+    exit(EXIT_FAILURE);
+  }
+  header[DADA_DEFAULT_HEADER_SIZE] = '\0';
+
+  if (ascii_header_get(header, "HDR_SIZE", "%li", &dada_header_size) == -1) {
+    dada_header_size = DADA_DEFAULT_HEADER_SIZE;
+  }
+
+  if (dada_header_size > DADA_DEFAULT_HEADER_SIZE) {
+    // header is larger than the default, read the remainder
+    header = realloc(header, dada_header_size + 1);
+    long remaining = dada_header_size - DADA_DEFAULT_HEADER_SIZE;
+    if (read(dada_fd, &header[DADA_DEFAULT_HEADER_SIZE], remaining) != remaining) {
+      LOG("Error: cannot read header from '%s'\n", fname);
+      exit(EXIT_FAILURE);
+    }
+    header[dada_header_size] = '\0';
+  } else if (dada_header_size < DADA_DEFAULT_HEADER_SIZE) {
+    // the first page starts within the bytes read so far
+    header[dada_header_size] = '\0';
+    if (lseek(dada_fd, dada_header_size, SEEK_SET) < 0) {
+      LOG("Error: cannot seek to the first page in '%s': %s\n", fname, strerror(errno));
+      exit(EXIT_FAILURE);
+    }
+  }
+
+  LOG("Reading from file '%s', header size %li\n", fname, dada_header_size);
+  return header;
+}
+
+/**
+ * Set the size of a page, and allocate the page buffer
+ *
+ * @param {long} page_size   Size in bytes of a ringbuffer page
+ */
+void dada_file_set_page_size(const long page_size) {
+  dada_page_size = page_size;
+  dada_page = malloc(page_size);
+  if (! dada_page) {
+    LOG("Error: cannot allocate page buffer of %li bytes\n", page_size);
+    exit(EXIT_FAILURE);
+  }
+}
+
+/**
+ * Position the file at the given page (counting from the first page in the file),
+ * without reading the pages in between
+ */
+void dada_file_seek_page(const long page) {
+  if (lseek(dada_fd, dada_header_size + page * dada_page_size, SEEK_SET) < 0) {
+    LOG("Error: cannot seek to page %li: %s\n", page, strerror(errno));
+    exit(EXIT_FAILURE);
+  }
+}
+
+/**
+ * Read the next page
+ *
+ * @returns {char *} Pointer to the page, or NULL at the end of the file. Valid until the next call.
+ */
+char *dada_file_read_page() {
+  long done = 0;
+
+  while (done < dada_page_size) {
+    ssize_t n = read(dada_fd, &dada_page[done], dada_page_size - done);
+    if (n < 0 && errno == EINTR) {
+      continue;
+    }
+    if (n <= 0) {
+      if (done) {
+        LOG("Warning: ignoring incomplete last page (%li of %li bytes)\n", done, dada_page_size);
+      }
+      return NULL;
+    }
+    done += n;
+  }
+
+  return dada_page;
+}
+
+/**
+ * Close the input file
+ */
+void dada_file_close() {
+  if (dada_fd >= 0) {
+    close(dada_fd);
+    dada_fd = -1;
+  }
+  free(dada_page);
+  dada_page = NULL;
+}
@@ -0,0 +1,193 @@
+/**
+ * Publish the reduced data into a second psrdada ringbuffer
+ *
+ * The header block describes the product, see the README. Each page of the output ringbuffer
+ * holds one input page for all beams, as consecutive records of:
+ *   float DAT_OFFS[NCHAN * NPOL]
+ *   float DAT_SCL[NCHAN * NPOL]
+ *   uchar DATA[row length]
+ * Beams are in the order listed in the BEAMS header key.
+ */
+#include <stdlib.h>
+#include <string.h>
+
+#include "dada_hdu.h"
+#include "ascii_header.h"
+#include "dadafits_internal.h"
+
+static dada_hdu_t *sink_hdu = NULL;
+static ipcbuf_t *sink_block = NULL;
+static char *sink_page = NULL;
+
+static int *sink_slot = NULL; // record index per beam, -1 when not written
+static int sink_beams = 0;    // size of sink_slot
+static long sink_record_size;
+static long sink_page_size;
+static long sink_pages = 0;
+
+/**
+ * Connect to the output ringbuffer as writer, and write its header
+ *
+ * @param {char *} key          Hexadecimal shared memory key of the output ringbuffer
+ * @param {int} ntabs           Number of TABs
+ * @param {int} mode            0: one record per TAB, 1: one record per selected synthesized beam
+ * @param {int} nchannels       Number of channels
+ * @param {int} npols           Number of polarizations
+ * @param {int} ntimes          Number of samples per page
+ * @param {int} nbits           Number of bits per sample
+ * @param {float} min_frequency Center of the lowest channel
+ * @param {float} channelwidth  Width of a channel
+ * @param {char *} header       The input header, copied into the output header
+ */
+void dada_sink_init(char *key, const int ntabs, const int mode, const int nchannels, const int npols, const int ntimes, const int nbits,
+    const float min_frequency, const float channelwidth, char *header) {
+  int beam, index, nbeams = mode == 0 ? ntabs : synthesized_beam_nselected;
+
+  // beam numbers of the records, comma separated
+  char *beams = malloc(12 * nbeams + 1);
+  sink_beams = mode == 0 ? ntabs : synthesized_beam_count;
+  sink_slot = malloc((sink_beams + 1) * sizeof(int));
+  if (! beams || ! sink_slot) {
+    LOG("Error: cannot allocate the output ringbuffer records\n");
+    exit(EXIT_FAILURE);
+  }
+  beams[0] = '\0';
+
+  for (beam = 0; beam < sink_beams; beam++) {
+    sink_slot[beam] = -1;
+  }
+  char *end = beams;
+  for (index = 0; index < nbeams; index++) {
+    beam = mode == 0 ? index : synthesized_beam_list[index];
+    end += sprintf(end, index ? ",%i" : "%i", beam);
+    sink_slot[beam] = index;
+  }
+
+  sink_record_size = 2 * nchannels * npols * sizeof(float) + (long) nchannels * npols * ntimes * nbits / 8;
+  sink_page_size = nbeams * sink_record_size;
+
+  sink_hdu = dada_hdu_create(NULL);
+  key_t shmkey;
+  sscanf(key, "%x", &shmkey);
+  dada_hdu_set_key(sink_hdu, shmkey);
+  LOG("Output ringbuffer SHMKEY: %s\n", key);
+
+  if (dada_hdu_connect(sink_hdu) < 0) {
+    LOG("ERROR in dada_hdu_connect for output ringbuffer\n");
+    exit(EXIT_FAILURE);
+  }
+  if (dada_hdu_lock_write(sink_hdu) < 0) {
+    LOG("ERROR in dada_hdu_lock_write for output ringbuffer\n");
+    exit(EXIT_FAILURE);
+  }
+  sink_block = (ipcbuf_t *) sink_hdu->data_block;
+
+  uint64_t bufsz = ipcbuf_get_bufsz(sink_block);
+  if (bufsz < sink_page_size) {
+    LOG("Error: output ringbuffer pages are too small: %lu bytes, need %li\n", bufsz, sink_page_size);
+    exit(EXIT_FAILURE);
+  }
+
+  // header: copy of the input header, with the description of the product
+  uint64_t header_size = ipcbuf_get_bufsz(sink_hdu->header_block);
+  char *out = ipcbuf_get_next_write(sink_hdu->header_block);
+  if (! out) {
+    LOG("Error: cannot get output header block\n");
+    exit(EXIT_FAILURE);
+  }
+  strncpy(out, header, header_size - 1);
+  out[header_size - 1] = '\0';
+
+  if (ascii_header_set(out, "NBEAMS", "%i", nbeams) < 0 ||
+      ascii_header_set(out, "BEAMS", "%s", beams) < 0 ||
+      ascii_header_set(out, "NCHAN", "%i", nchannels) < 0 ||
+      ascii_header_set(out, "NPOL", "%i", npols) < 0 ||
+      ascii_header_set(out, "NBIT", "%i", nbits) < 0 ||
+      ascii_header_set(out, "NSBLK", "%i", ntimes) < 0 ||
+      ascii_header_set(out, "TSAMP", "%.10f", PAGE_DURATION / ntimes) < 0 ||
+      ascii_header_set(out, "MIN_FREQUENCY", "%f", min_frequency) < 0 ||
+      ascii_header_set(out, "CHAN_BW", "%f", -channelwidth) < 0 ||
+      ascii_header_set(out, "RECORD_SIZE", "%li", sink_record_size) < 0 ||
+      ascii_header_set(out, "RECORD_LAYOUT", "%s", "DAT_OFFS,DAT_SCL,DATA") < 0) {
+    LOG("Error: output header block too small\n");
+    exit(EXIT_FAILURE);
+  }
+  free(beams);
+
+  if (ipcbuf_mark_filled(sink_hdu->header_block, header_size) < 0) {
+    LOG("Error: cannot mark the output header as filled\n");
+    exit(EXIT_FAILURE);
+  }
+
+  LOG("Publishing %i beams to output ringbuffer, %li bytes per page\n", nbeams, sink_page_size);
+}
+
+/**
+ * Is the output ringbuffer enabled
+ */
+int dada_sink_active() {
+  return sink_hdu != NULL;
+}
+
+/**
+ * Start a new page in the output ringbuffer
+ */
+void dada_sink_begin_page() {
+  if (! sink_hdu) {
+    return;
+  }
+
+  sink_page = ipcbuf_get_next_write(sink_block);
+  if (! sink_page) {
+    LOG("Error: cannot get next page of the output ringbuffer\n");
+    exit(EXIT_FAILURE);
+  }
+}
+
+/**
+ * Copy a row, and the current scale and offset arrays, to the output page
+ * Parameters as for write_fits.
+ */
+void dada_sink_write(const int beam, const int channels, const int pols, const int rowlength, unsigned char *data) {
+  if (! sink_page || beam >= sink_beams || sink_slot[beam] < 0) {
+    return;
+  }
+
+  char *record = &sink_page[sink_slot[beam] * sink_record_size];
+  long nscale = channels * pols * sizeof(float);
+
+  memcpy(record, fits_offset, nscale);
+  memcpy(&record[nscale], fits_scale, nscale);
+  memcpy(&record[2 * nscale], data, rowlength);
+}
+
+/**
+ * Hand the current page to the readers of the output ringbuffer
+ */
+void dada_sink_end_page() {
+  if (! sink_page) {
+    return;
+  }
+
+  if (ipcbuf_mark_filled(sink_block, sink_page_size) < 0) {
+    LOG("Error: cannot mark output page as filled\n");
+    exit(EXIT_FAILURE);
+  }
+  sink_page = NULL;
+  sink_pages++;
+}
+
+/**
+ * Signal end-of-data, and disconnect from the output ringbuffer
+ */
+void dada_sink_close() {
+  if (! sink_hdu) {
+    return;
+  }
+
+  dada_hdu_unlock_write(sink_hdu);
+  dada_hdu_disconnect(sink_hdu);
+  sink_hdu = NULL;
+
+  LOG("Published %li pages to output ringbuffer\n", sink_pages);
+}
@@ -0,0 +1,105 @@
+/**
+ * libdadafits: the data reduction kernels of dadafits
+ *
+ * Downsampling, 1-bit packing, deinterleaving of Stokes IQUV pages, and
+ * assembly of synthesized beams, for use by other programs in the pipeline.
+ *
+ * All state is passed explicitly through a dadafits_context_t;
+ * the library has no global variables, so separate contexts can be used from separate threads.
+ *
+ * Author: Jisk Attema, Netherlands eScience Center
+ * Licencse: Apache v2.0
+ */
+#ifndef __HAVE_DADAFITS_H__
+#define __HAVE_DADAFITS_H__
+
+#include <stdio.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Version of this API, incremented on incompatible changes
+// Compatible changes follow the library version, see dadafits_library_version:
+//   1.1  adds dadafits_pack_monitor
+//   1.2  dadafits_pack returns the number of channels without variance (was void);
+//        callers ignoring the result are not affected
+#define DADAFITS_API_VERSION 1
+
+// Data layout
+#define DADAFITS_NCHANNELS 1536
+#define DADAFITS_NPOLS 4
+#define DADAFITS_NTIMES_LOW 1250
+#define DADAFITS_NCHANNELS_LOW (DADAFITS_NCHANNELS / 2)
+#define DADAFITS_NSUBBANDS 32
+#define DADAFITS_FREQS_PER_SUBBAND 48
+
+// Monitoring: number of total power samples per page, see dadafits_pack_monitor
+#define DADAFITS_MONITOR_NPOWER 10
+
+typedef struct {
+  int science_case;    // 3 or 4, determines the data rate
+  int science_mode;    // 0..3, determines the data layout
+  int padded_size;     // length of the fastest dimension of a Stokes I page
+  int ntabs;           // number of TABs in a page
+  int ntimes;          // number of samples per page, before downsampling
+  int sequence_length; // number of packets per channel per page, for Stokes IQUV
+
+  float *offset;       // output of dadafits_pack: DAT_OFFS, [DADAFITS_NCHANNELS_LOW]
+  float *scale;        // output of dadafits_pack: DAT_SCL, [DADAFITS_NCHANNELS_LOW]
+
+  FILE *log;           // reserved, not used by the library; kept for binary compatibility
+} dadafits_context_t;
+
+typedef struct {
+  float bandpass[DADAFITS_NCHANNELS_LOW]; // mean per channel, high to low frequency as DAT_OFFS
+  float rms[DADAFITS_NCHANNELS_LOW];      // standard deviation per channel, high to low frequency
+  float power[DADAFITS_MONITOR_NPOWER];   // total power: mean over channels and DADAFITS_NTIMES_LOW / DADAFITS_MONITOR_NPOWER samples
+  float bits_set;                         // fraction of bits set in the packed data
+} dadafits_monitor_t;
+
+/**
+ * Set up a context for the given observation; offset and scale are left untouched
+ * @returns {int} 0 on success, -1 for an unsupported science case or mode
+ */
+extern int dadafits_context_init(dadafits_context_t *ctx, const int science_case, const int science_mode, const int padded_size);
+
+/**
+ * Version of the library, as "major.minor"
+ */
+extern const char *dadafits_library_version();
+
+/**
+ * Downsample one TAB of a Stokes I page to [DADAFITS_NCHANNELS_LOW, DADAFITS_NTIMES_LOW]
+ */
+extern void dadafits_downsample(const dadafits_context_t *ctx, const unsigned char *buffer, unsigned int *downsampled);
+
+/**
+ * Pack downsampled data to 1 bit, [DADAFITS_NTIMES_LOW, DADAFITS_NCHANNELS_LOW / 8], and set ctx->offset and ctx->scale
+ * Note that downsampled is overwritten
+ * The threshold is computed with integer arithmetic, so the result is the same on every platform
+ * @returns {int} Number of channels without variance, these have scale 0
+ */
+extern int dadafits_pack(const dadafits_context_t *ctx, unsigned int *downsampled, unsigned char *packed);
+
+/**
+ * As dadafits_pack, and also fill in the monitoring data for this TAB
+ */
+extern int dadafits_pack_monitor(const dadafits_context_t *ctx, unsigned int *downsampled, unsigned char *packed, dadafits_monitor_t *monitor);
+
+/**
+ * Deinterleave a Stokes IQUV page to [ntabs, ntimes, DADAFITS_NPOLS, DADAFITS_NCHANNELS]
+ */
+extern void dadafits_deinterleave(const dadafits_context_t *ctx, const unsigned char *page, unsigned char *transposed);
+
+/**
+ * Assemble a synthesized beam [ntimes, DADAFITS_NPOLS, DADAFITS_NCHANNELS] from deinterleaved TABs
+ * subband_tabs lists for each of the DADAFITS_NSUBBANDS subbands the TAB to use
+ */
+extern void dadafits_synthesize(const dadafits_context_t *ctx, const unsigned char *transposed, const int *subband_tabs, unsigned char *synthesized);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
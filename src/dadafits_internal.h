@@ -2,13 +2,15 @@
 #define __HAVE_DADAFITS_INTERNAL_H__
 
 #include <stdio.h>
+#include <signal.h>
+#include "dadafits.h"
 
 extern FILE *runlog;
 #define LOG(...) {fprintf(stdout, __VA_ARGS__); fprintf(runlog, __VA_ARGS__); fflush(stdout);}
 
 #define NTABS_MAX 12
-#define NCHANNELS 1536
-#define NPOLS 4
+#define NCHANNELS DADAFITS_NCHANNELS
+#define NPOLS DADAFITS_NPOLS
 
 // 80 microsecond -> .8 milisecond
 #define SC3_NTIMES 12500
@@ -18,53 +20,212 @@ extern FILE *runlog;
 #define SC4_NTIMES 12500
 #define SC4_DOWNSAMPLE_TIME 10
 
+// duration of a ringbuffer page, and of a row in the FITS file, in seconds
+#define PAGE_DURATION 1.024
+
 // the same for both science case 3 and 4
-#define NTIMES_LOW 1250
-#define NCHANNELS_LOW (NCHANNELS / 2)
+#define NTIMES_LOW DADAFITS_NTIMES_LOW
+#define NCHANNELS_LOW DADAFITS_NCHANNELS_LOW
+
+// Stokes IQUV pages are made of UDP packets of 500 times, 4 channels, 4 polarizations
+#define PACKET_NTIMES 500
 
 // The synthesized beams table
-#define NSYNS_MAX 256
-#define NSUBBANDS 32
-#define SUBBAND_UNSET 9999
-#define FREQS_PER_SUBBAND 48
+#define NSUBBANDS DADAFITS_NSUBBANDS
+#define FREQS_PER_SUBBAND DADAFITS_FREQS_PER_SUBBAND
+
+// Weighted synthesized beams: a subband can be a weighted sum of TABs, see sb_util.c
+#define SUBBAND_TERMS_MAX 4
+#define SUBBAND_WEIGHT_ONE 256 // weights are fixed point with 8 fractional bits, the largest weight in a subband is 1
+
+typedef struct {
+  int nterms;
+  int tabs[SUBBAND_TERMS_MAX];
+  unsigned short weights[SUBBAND_TERMS_MAX]; // relative to the largest
+  float scale;                               // sum of the weights as given in the table
+} subband_terms_t;
+
+// Output formats
+#define OUTPUT_FITS 0
+#define OUTPUT_HDF5 1
+#define OUTPUT_NONE 2
+
+// Write budget: large rows are written in chunks of this size (bytes)
+#define QOS_CHUNK (1024 * 1024)
+
+// Cooperating processes sharing one ringbuffer
+#define PARTITIONS_MAX 16
 
 // Global parameter definintions
 extern int science_case;
 extern int science_mode;
 extern int padded_size;
+extern int zero_dm;
+extern int flatten_bandpass;
 
 extern float fits_offset[NCHANNELS * NPOLS];
 extern float fits_scale[NCHANNELS * NPOLS];
 extern float fits_weights[NCHANNELS];
 extern float fits_freqs[NCHANNELS];
 
-extern int synthesized_beam_table[NSYNS_MAX][NSUBBANDS];
-extern int synthesized_beam_selected[NSYNS_MAX];
-extern int synthesized_beam_count; // number of SBs in the table
+extern int (*synthesized_beam_table)[NSUBBANDS];
+extern subband_terms_t (*synthesized_beam_terms)[NSUBBANDS];
+extern char *synthesized_beam_weighted;   // more than one TAB, or a weight, in any subband
+extern int synthesized_beam_count;        // number of SBs in the table
+extern int *synthesized_beam_list;        // the selected SBs, in increasing order
+extern int synthesized_beam_nselected;    // number of selected SBs
+
+// FITS templates compiled into the executable, generated by template2c
+typedef struct {
+  const char *name;
+  const unsigned char *data;
+  const size_t size;
+} dadafits_template_t;
+
+extern const dadafits_template_t dadafits_templates[]; // terminated by an entry with name NULL
 
 // Function definitions
 
 // from downsample.c
-extern void downsample_sc3(const unsigned char *buffer, const int padded_size, unsigned int downsampled[NCHANNELS_LOW * NTIMES_LOW]);
-extern void downsample_sc4(const unsigned char *buffer, const int padded_size, unsigned int downsampled[NCHANNELS_LOW * NTIMES_LOW]);
+extern void downsample_sc3(const unsigned char *buffer, const int padded_size, unsigned int downsampled[NCHANNELS_LOW * NTIMES_LOW], const int prefetch);
+extern void downsample_sc4(const unsigned char *buffer, const int padded_size, unsigned int downsampled[NCHANNELS_LOW * NTIMES_LOW], const int prefetch);
 
 // from sb_util.c
 extern int read_synthesized_beam_table(char *fname);
 extern void parse_synthesized_beam_selection (char *selection);
+extern int synthesized_beam_is_selected(const int sb);
+extern void synthesized_beam_deselect(const int sb);
+extern void synthesized_beam_update_list();
 
 // from fits_io.c
-extern void dadafits_fits_init (const char *template_dir, const char *template_file, const char *output_directory,
+extern long dadafits_fits_init (const char *template_dir, const char *template_file, const char *output_directory,
     const int ntabs, const int mode, float scanlen, float center_frequency, float bandwidth, const float min_frequency, const int channels, const float channelwidth, char *ra_hms, char *dec_hms,
-    char *source_name, const char *utc_start, const double mjd_start, double lst_start, char *parset);
-extern void write_fits(const int tab, const int channels, const int pols, const long rowid, const int rowlength, unsigned char *data, const float telaz, const float telza);
+    char *source_name, const char *utc_start, const double mjd_start, double lst_start, char *parset, const long first_page, const int resume);
+extern void write_fits(const int tab, const int channels, const int pols, const long page_index, const int rowlength, unsigned char *data, const float telaz, const float telza);
 extern void close_fits();
-extern void fits_error_and_exit(int status); // needed for trapping C-c
-
-// from manipulate.c
-extern void deinterleave (const unsigned char *page, const int ntimes, const int ntabs, const int sequence_length, unsigned char *transposed);
-extern void pack_sc34(unsigned int downsampled[NCHANNELS_LOW * NTIMES_LOW], unsigned char packed[NCHANNELS_LOW * NTIMES_LOW/8]);
+extern void dadafits_fix_utc_start(const char *utc_start, char *utc_start_fixed);
+extern void dadafits_init_channels(const int nchannels, const float min_frequency, const float channelwidth);
+extern const dadafits_template_t *dadafits_find_template(const char *template_file);
+extern void fits_error_and_exit(int status);
+
+// from manipulate.c: see dadafits.h
+
+// from hdf5_io.c, only when compiled with HAVE_HDF5
+extern void dadafits_hdf5_init (const char *output_directory, const int ntabs, const int mode,
+    const int nchannels, const int npols, const int ntimes, const int nbits,
+    float scanlen, float center_frequency, float bandwidth, const float min_frequency, const float channelwidth,
+    char *ra_hms, char *dec_hms, char *source_name, const char *utc_start, const double mjd_start, double lst_start, char *parset,
+    const long first_page);
+extern void write_hdf5(const int tab, const int channels, const int pols, const long page_index, const int rowlength, unsigned char *data, const float telaz, const float telza);
+extern void close_hdf5();
+
+// from workers.c
+typedef void (*worker_func_t)(void *arg, const int thread, const int nthreads);
+extern int worker_threads;
+extern void workers_init(int nthreads);
+extern void workers_close();
+extern void run_workers(worker_func_t func, void *arg, int nthreads);
+
+// from dada_sink.c
+extern void dada_sink_init(char *key, const int ntabs, const int mode, const int nchannels, const int npols, const int ntimes, const int nbits,
+    const float min_frequency, const float channelwidth, char *header);
+extern int dada_sink_active();
+extern void dada_sink_begin_page();
+extern void dada_sink_write(const int beam, const int channels, const int pols, const int rowlength, unsigned char *data);
+extern void dada_sink_end_page();
+extern void dada_sink_close();
+
+// from close_pool.c
+typedef void (*close_func_t)(const int item);
+extern void close_pool_init(const float timeout);
+extern int close_pool_pending();
+extern int close_files(const char *what, close_func_t close_one, const int *items, const int count, int nthreads);
+
+// from migrate.c
+extern void migrate_init(const char *destination, const float rate);
+extern int migrate_active();
+extern void migrate_file(const char *fname);
+extern void migrate_finish();
+
+// from write_qos.c
+extern void write_qos_init(const float rate, char *priorities, const int nbeams);
+extern int write_qos_active();
+extern void write_qos_acquire(const int beam, const long bytes);
+extern void write_qos_report();
+
+// from dada_file.c
+extern char *dada_file_open(const char *fname);
+extern void dada_file_set_page_size(const long page_size);
+extern void dada_file_seek_page(const long page);
+extern char *dada_file_read_page();
+extern void dada_file_close();
+
+// from partition.c
+extern int partition_parse(const char *spec, int *part, int *nparts);
+extern void partition_init(const char *key, const int part, const int nparts);
+extern int partition_active();
+extern void partition_select_beams();
+extern void partition_release(const long page);
+extern void partition_close();
+
+// from pipeline.c
+typedef void (*pipeline_func_t)(const unsigned char *page, const long page_index, const float telaz, const float telza);
+extern pipeline_func_t pipeline_init(const dadafits_context_t *ctx, const int make_synthesized_beams, const float running_alpha);
+extern void pipeline_report();
+
+// from monitor.c
+extern void monitor_init(const char *fname, const int ntabs, const float min_frequency, const float channelwidth);
+extern int monitor_active();
+extern void monitor_write(const long page, const int tab, const dadafits_monitor_t *monitor);
+extern void monitor_close();
+
+// from fold.c
+extern void fold_init(const char *ephemeris_file, const char *template_dir, const char *output_directory,
+    const int ntabs, const int subint_pages, float center_frequency, float bandwidth, const float min_frequency, const float channelwidth,
+    char *ra_hms, char *dec_hms, const char *utc_start, const double mjd_start, const int resume);
+extern int fold_active();
+extern void fold_page(const int tab, const long page, const unsigned int *downsampled);
+extern void fold_close();
+
+// from autotune.c
+typedef struct {
+  int deinterleave_block;     // packets of 4 channels transposed together
+  int deinterleave_prefetch;  // bytes to prefetch ahead in the page, 0 for none
+  int downsample_prefetch;    // bytes to prefetch ahead in a channel, 0 for none
+  int synthesize_time_outer;  // assemble synthesized beams one sample at a time
+} kernel_tuning_t;
+extern kernel_tuning_t kernel_tuning;
+extern void autotune_init(const char *cache_file, const dadafits_context_t *ctx, const int synthesize);
+
+// from perf.c
+enum {
+  PERF_DOWNSAMPLE,
+  PERF_CORRECT,
+  PERF_STATISTICS,
+  PERF_PACK,
+  PERF_FOLD,
+  PERF_DEINTERLEAVE,
+  PERF_SYNTHESIZE,
+  PERF_WRITE,
+  PERF_NSTAGES
+};
+#define PERF_NCOUNTERS 4
+extern void perf_init(const char *fname);
+extern int perf_active();
+extern void perf_stage(const int stage);
+extern void perf_begin(const int thread);
+extern void perf_end(const int thread);
+extern void perf_report();
+
+// from batch.c
+extern int batch_run(const char *directory, const char *output_directory, int max_jobs, float memory_mb,
+    int threads, const float rate, const char *staging, const char *monitor, const char *perf, int argc, char *argv[]);
 
 // from main.c
+extern int parse_header(char *header);
+extern void write_row(const int tab, const int channels, const int pols, const long page_index, const int rowlength, unsigned char *data, const float telaz, const float telza);
 extern long page_count;
+extern int output_format;
+extern volatile sig_atomic_t drain_expired;
 
 #endif
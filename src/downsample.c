@@ -1,4 +1,5 @@
 #include "dadafits_internal.h"
+#include "kernels.h"
 
 /**
  * Downsample timeseries by summation over time and frequency
@@ -14,53 +15,27 @@
  * @param {uchar[NCHANNELS, padded_size]} buffer        Buffer page to downsample
  * @param {int} padded_size                             Size of fastest dimension, as timeseries are padded for optimal memory layout on GPU
  * @param {uint[NCHANNELS_LOW, NTIMES_LOW]} downsampled Output array holding downsampled data
+ * @param {int} prefetch                                Bytes to prefetch ahead in each channel, 0 for none
  */
-void downsample_sc3(const unsigned char *buffer, const int padded_size, unsigned int downsampled[NCHANNELS_LOW * NTIMES_LOW]) {
-  unsigned int *temp1 = downsampled;
-  int dc; // downsampled channel
-  int dt; // downsampled time
-  int t; // full time
-
-  for (dc=0; dc < NCHANNELS_LOW; dc++) {
-    // pointer to next sample in the two channels
-    unsigned const char *s0 = &buffer[((dc << 1) + 0) * padded_size];
-    unsigned const char *s1 = &buffer[((dc << 1) + 1) * padded_size];
-
-    for (dt=0; dt < NTIMES_LOW; dt++) {
-      // partial sums (per channel)
-      unsigned int ps0 = 0;
-      unsigned int ps1 = 0;
-
-      for (t=0; t < SC3_DOWNSAMPLE_TIME; t++) {
-        ps0 += *s0++;
-        ps1 += *s1++;
-      }
-      *temp1++ = ps0 + ps1;
-    }
-  }
+void downsample_sc3(const unsigned char *buffer, const int padded_size, unsigned int downsampled[NCHANNELS_LOW * NTIMES_LOW], const int prefetch) {
+  downsample_channels(buffer, padded_size, downsampled, 0, NCHANNELS_LOW, SC3_DOWNSAMPLE_TIME, prefetch);
 }
 
-void downsample_sc4(const unsigned char *buffer, const int padded_size, unsigned int downsampled[NCHANNELS_LOW * NTIMES_LOW]) {
-  unsigned int *temp1 = downsampled;
-  int dc; // downsampled channel
-  int dt; // downsampled time
-  int t; // full time
-
-  for (dc=0; dc < NCHANNELS_LOW; dc++) {
-    // pointer to next sample in the two channels
-    unsigned const char *s0 = &buffer[((dc << 1) + 0) * padded_size];
-    unsigned const char *s1 = &buffer[((dc << 1) + 1) * padded_size];
-
-    for (dt=0; dt < NTIMES_LOW; dt++) {
-      // partial sums (per channel)
-      unsigned int ps0 = 0;
-      unsigned int ps1 = 0;
+void downsample_sc4(const unsigned char *buffer, const int padded_size, unsigned int downsampled[NCHANNELS_LOW * NTIMES_LOW], const int prefetch) {
+  downsample_channels(buffer, padded_size, downsampled, 0, NCHANNELS_LOW, SC4_DOWNSAMPLE_TIME, prefetch);
+}
 
-      for (t=0; t < SC4_DOWNSAMPLE_TIME; t++) {
-        ps0 += *s0++;
-        ps1 += *s1++;
-      }
-      *temp1++ = ps0 + ps1;
-    }
+/**
+ * Downsample one TAB of a Stokes I page, for the science case set in the context
+ *
+ * @param {dadafits_context_t *} ctx                    Context, provides science_case and padded_size
+ * @param {uchar[NCHANNELS, padded_size]} buffer        Buffer page to downsample
+ * @param {uint[NCHANNELS_LOW, NTIMES_LOW]} downsampled Output array holding downsampled data
+ */
+void dadafits_downsample(const dadafits_context_t *ctx, const unsigned char *buffer, unsigned int *downsampled) {
+  if (ctx->science_case == 3) {
+    downsample_sc3(buffer, ctx->padded_size, downsampled, DOWNSAMPLE_PREFETCH_DEFAULT);
+  } else {
+    downsample_sc4(buffer, ctx->padded_size, downsampled, DOWNSAMPLE_PREFETCH_DEFAULT);
   }
 }
@@ -1,24 +1,53 @@
 #include <math.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
 #include <fitsio.h>
 #include "dadafits_internal.h"
 
-fitsfile *output[NSYNS_MAX];
+// Output files, indexed by TAB or synthesized beam number; allocated by dadafits_fits_init
+fitsfile **output = NULL;
+char **output_names = NULL; // file names without template, for migration
+static long *output_first_page = NULL; // page in the first row of every file, the NSUBOFFS key
+static int output_count = 0;
 
 float fits_offset[NCHANNELS * NPOLS];
 float fits_scale[NCHANNELS * NPOLS];
 float fits_weights[NCHANNELS];
 float fits_freqs[NCHANNELS];
 
-// Fit column ID's, looked up from the template.
-// If not present in the template, it set it to '-1' and it is not written
-int col_data = 17;
-int col_freqs = 13;
-int col_offset = 15;
-int col_scale = 16;
-int col_weights = 14;
-int col_offs_sub = 2;
-int col_telaz = 11;
-int col_telza = 12;
+// The write plan: where the values go in a row of the SUBINT table.
+// Columns are looked up by name in the template, see dadafits_make_write_plan;
+// columns not present in the template do not get a step, and are not written.
+enum {
+  VALUE_OFFS_SUB,
+  VALUE_TEL_AZ,
+  VALUE_TEL_ZEN,
+  VALUE_DAT_FREQ,
+  VALUE_DAT_WTS,
+  VALUE_DAT_OFFS,
+  VALUE_DAT_SCL,
+  NVALUES
+};
+
+static char *value_columns[NVALUES] = {"OFFS_SUB", "TEL_AZ", "TEL_ZEN", "DAT_FREQ", "DAT_WTS", "DAT_OFFS", "DAT_SCL"};
+
+typedef struct {
+  int value;           // one of VALUE_*
+  int typecode;        // TFLOAT or TDOUBLE
+  long count;          // number of elements in the column
+  unsigned char *dst;  // position in the row prefix or suffix
+} write_step_t;
+
+static write_step_t plan_steps[NVALUES];
+static int plan_nsteps = 0;
+static long plan_data_offset;        // byte offset of the DATA column in the row
+static long plan_data_bytes;         // size of the DATA column
+static unsigned char *plan_prefix;   // row bytes before the DATA column
+static long plan_prefix_bytes;
+static unsigned char *plan_suffix;   // row bytes after the DATA column
+static long plan_suffix_bytes;
 
 /**
  * pretty print the fits error to the log, and close down cleanly
@@ -35,31 +64,52 @@ void fits_error_and_exit(int status) {
 }
 
 /**
- * Close all opened fits files
+ * Close a single fits file, on a closer thread
+ */
+static void close_fits_beam(const int beam) {
+  int status;
+  fitsfile *fptr = output[beam];
+
+  // when staging, add checksums for the data so migration can verify the copy
+  if (migrate_active()) {
+    status = 0;
+    if (fits_write_chksum(fptr, &status)) {
+      if (runlog) fits_report_error(runlog, status);
+      fits_report_error(stdout, status);
+    }
+  }
+
+  // ignore errors on closing files; cfitsio 3.37 reports junk error codes
+  // however, do reset the error state, otherwise fitsio will crash
+  status = 0;
+  fits_close_file(fptr, &status);
+
+  // FUTURE VERSION:
+  // if (fits_close_file (output[beam], &status)) {
+  //   if (runlog) fits_report_error(runlog, status);
+  //   fits_report_error(stdout, status);
+  // }
+  output[beam] = NULL;
+
+  migrate_file(output_names[beam]);
+  free(output_names[beam]);
+  output_names[beam] = NULL;
+}
+
+/**
+ * Close all opened fits files, in parallel when cfitsio is reentrant
  */
 void close_fits() {
-  int beam, status;
-  char comm[1024];
-  long numrows;
-  long long naxis2;
-
-  for (beam=0; beam<NSYNS_MAX; beam++) {
-    fitsfile *fptr = output[beam];
-
-    if (fptr) {
-
-      // ignore errors on closing files; cfitsio 3.37 reports junk error codes
-      // however, do reset the error state, otherwise fitsio will crash
-      status = 0;
-      fits_close_file(fptr, &status);
-
-      // FUTURE VERSION:
-      // if (fits_close_file (output[beam], &status)) {
-      //   if (runlog) fits_report_error(runlog, status);
-      //   fits_report_error(stdout, status);
-      // }
+  int beams[output_count + 1];
+  int beam, count = 0;
+
+  for (beam=0; beam<output_count; beam++) {
+    if (output[beam]) {
+      beams[count++] = beam;
     }
   }
+
+  close_files("FITS files", close_fits_beam, beams, count, fits_is_reentrant() ? worker_threads : 1);
 }
 
 /**
@@ -84,94 +134,393 @@ int dadafits_find_column(char *name, fitsfile *file) {
   return column;
 }
 
+/**
+ * Size in bytes of a column in a row of a binary table
+ */
+static long dadafits_column_bytes(fitsfile *file, const int column, int *typecode, long *repeat) {
+  long width;
+  int status = 0;
+
+  if (fits_get_coltype(file, column, typecode, repeat, &width, &status)) {
+    fits_error_and_exit(status);
+  }
+  if (*typecode < 0) {
+    LOG("Error: variable length column %i is not supported\n", column);
+    exit(EXIT_FAILURE);
+  }
+  if (*typecode == TBIT) {
+    return (*repeat + 7) / 8;
+  }
+  if (*typecode == TSTRING) {
+    return *repeat;
+  }
+  return *repeat * width;
+}
+
+/**
+ * Look up all columns by name, and compile the write plan for the SUBINT table
+ *
+ * @param {fitsfile *} file  A file created from the template, at the SUBINT table
+ */
+void dadafits_make_write_plan(fitsfile *file) {
+  int ncols, column, typecode, v;
+  long repeat, naxis1;
+  int status = 0;
+
+  if (fits_get_num_cols(file, &ncols, &status)) fits_error_and_exit(status);
+  if (fits_read_key(file, TLONG, "NAXIS1", &naxis1, NULL, &status)) fits_error_and_exit(status);
+
+  // byte offset of every column in the row
+  long offsets[ncols + 1];
+  offsets[0] = 0;
+  for (column = 1; column <= ncols; column++) {
+    offsets[column] = offsets[column - 1] + dadafits_column_bytes(file, column, &typecode, &repeat);
+  }
+  if (offsets[ncols] != naxis1) {
+    LOG("Error: columns take %li bytes, but NAXIS1 is %li\n", offsets[ncols], naxis1);
+    exit(EXIT_FAILURE);
+  }
+
+  column = dadafits_find_column("DATA", file);
+  if (column < 0) {
+    LOG("Error: template has no DATA column\n");
+    exit(EXIT_FAILURE);
+  }
+  plan_data_offset = offsets[column - 1];
+  plan_data_bytes = dadafits_column_bytes(file, column, &typecode, &repeat);
+  if (typecode != TBYTE && typecode != TBIT) {
+    LOG("Error: DATA column must be bytes (B) or bits (X)\n");
+    exit(EXIT_FAILURE);
+  }
+
+  plan_prefix_bytes = plan_data_offset;
+  plan_suffix_bytes = naxis1 - plan_data_offset - plan_data_bytes;
+  plan_prefix = calloc(plan_prefix_bytes + 1, 1);
+  plan_suffix = calloc(plan_suffix_bytes + 1, 1);
+
+  plan_nsteps = 0;
+  for (v = 0; v < NVALUES; v++) {
+    column = dadafits_find_column(value_columns[v], file);
+    if (column < 0) {
+      continue;
+    }
+
+    write_step_t *step = &plan_steps[plan_nsteps++];
+    dadafits_column_bytes(file, column, &typecode, &repeat);
+    if (typecode != TFLOAT && typecode != TDOUBLE) {
+      LOG("Error: column %s must be float (E) or double (D)\n", value_columns[v]);
+      exit(EXIT_FAILURE);
+    }
+    step->value = v;
+    step->typecode = typecode;
+    step->count = repeat;
+    step->dst = offsets[column - 1] < plan_data_offset ?
+      &plan_prefix[offsets[column - 1]] :
+      &plan_suffix[offsets[column - 1] - plan_data_offset - plan_data_bytes];
+  }
+
+  LOG("Write plan: %li bytes before DATA, %li bytes of DATA, %li bytes after DATA, %i columns\n",
+      plan_prefix_bytes, plan_data_bytes, plan_suffix_bytes, plan_nsteps + 1);
+}
+
+/**
+ * Store a value in FITS (big endian) byte order, as float (E) or double (D)
+ */
+static void put_value(unsigned char *dst, const int typecode, const double value) {
+  int b;
+
+  if (typecode == TFLOAT) {
+    float single = value;
+    uint32_t bits;
+    memcpy(&bits, &single, 4);
+    for (b = 0; b < 4; b++) {
+      dst[b] = bits >> (24 - 8 * b);
+    }
+  } else {
+    uint64_t bits;
+    memcpy(&bits, &value, 8);
+    for (b = 0; b < 8; b++) {
+      dst[b] = bits >> (56 - 8 * b);
+    }
+  }
+}
+
 /**
  * Write a row of data to a FITS BINTABLE.SUBINT
  *
  * Optionally uses the global arrays: 'weights', 'scale', 'offset', and 'packed'
+ * The row is written as three blocks of bytes, following the write plan:
+ * the columns before DATA, DATA, and the columns after DATA.
  *
  * @param {const int} tab                Tied array beam index used to select output file
  * @param {const int} channels           The number of channels to use
  * @param {const int} pols               The number of polarizations to use
- * @param {const int} rowid              Row number in the SUBINT table, corresponds to ringbuffer page number + 1
+ * @param {const long} page_index       Page number since the start of the observation; the row is counted from the first page in the file
  * @param {const int} rowlength          Size of a data row
  * @param {const unsigned char *} data   Row to write
  * @param {const float} telaz
  * @param {const float} telza
  */
-void write_fits(const int tab, const int channels, const int pols, const long rowid, const int rowlength, unsigned char *data, float telaz, float telza) {
-  int status;
+void write_fits(const int tab, const int channels, const int pols, const long page_index, const int rowlength, unsigned char *data, float telaz, float telza) {
+  int status, s;
   fitsfile *fptr = output[tab];
+  const long rowid = page_index - output_first_page[tab] + 1;
+
+  if (rowid < 1) {
+    // before the start of a resumed file
+    return;
+  }
 
   // From the cfitsio documentation:
   // Note that it is *not* necessary to insert rows in a table before writing data to those rows (indeed, it
   // would be inefficient to do so). Instead, one may simply write data to any row of the table, whether
   // that row of data already exists or not.
-  //
-  // status = 0;
-  // if (fits_insert_rows(fptr, rowid, 1, &status)) {
-  //   fits_error_and_exit(status);
-  // }
 
-  double offs_sub = (double) rowid * 1.024 - 0.512; // OFFS_SUB is subint centre in seconds since start of run, but may not be zero
+  double offs_sub = (page_index + 0.5) * PAGE_DURATION; // OFFS_SUB is subint centre in seconds since start of run, but may not be zero
+
+  for (s = 0; s < plan_nsteps; s++) {
+    write_step_t *step = &plan_steps[s];
+    int size = step->typecode == TFLOAT ? 4 : 8;
+    const float *values;
+    long i, n;
+
+    switch (step->value) {
+      case VALUE_OFFS_SUB: put_value(step->dst, step->typecode, offs_sub); continue;
+      case VALUE_TEL_AZ:   put_value(step->dst, step->typecode, telaz); continue;
+      case VALUE_TEL_ZEN:  put_value(step->dst, step->typecode, telza); continue;
+      case VALUE_DAT_FREQ: values = fits_freqs; n = channels; break;
+      case VALUE_DAT_WTS:  values = fits_weights; n = channels; break;
+      case VALUE_DAT_OFFS: values = fits_offset; n = channels * pols; break;
+      default:             values = fits_scale; n = channels * pols; break;
+    }
 
-  if (col_offs_sub >= 0) {
-    status = 0;
-    if (fits_write_col(fptr, TDOUBLE, col_offs_sub, rowid, 1, 1, &offs_sub, &status)) {
-      fits_error_and_exit(status);
+    n = n < step->count ? n : step->count;
+    for (i = 0; i < n; i++) {
+      put_value(&step->dst[i * size], step->typecode, values[i]);
     }
   }
 
-  if (col_telaz >= 0) {
-    status = 0;
-    if (fits_write_col(fptr, TFLOAT, col_telaz, rowid, 1, 1, &telaz, &status)) {
-      fits_error_and_exit(status);
-    }
+  // account for the metadata columns
+  write_qos_acquire(tab, plan_prefix_bytes + plan_suffix_bytes);
+
+  status = 0;
+  if (plan_prefix_bytes && fits_write_tblbytes(fptr, rowid, 1, plan_prefix_bytes, plan_prefix, &status)) {
+    fits_error_and_exit(status);
+  }
+  if (plan_suffix_bytes && fits_write_tblbytes(fptr, rowid, plan_data_offset + plan_data_bytes + 1, plan_suffix_bytes, plan_suffix, &status)) {
+    fits_error_and_exit(status);
   }
 
-  if (col_telza >= 0) {
-    status = 0;
-    if (fits_write_col(fptr, TFLOAT, col_telza, rowid, 1, 1, &telza, &status)) {
+  // the DATA column may be larger than the row, eg. for the reduced template
+  long nbytes = rowlength < plan_data_bytes ? rowlength : plan_data_bytes;
+  long chunk = write_qos_active() ? QOS_CHUNK : nbytes;
+
+  // With a write budget, write the data in chunks so the writes are spread out
+  long first;
+  for (first = 0; first < nbytes; first += chunk) {
+    long n = nbytes - first < chunk ? nbytes - first : chunk;
+    write_qos_acquire(tab, n);
+
+    if (fits_write_tblbytes(fptr, rowid, plan_data_offset + first + 1, n, &data[first], &status)) {
       fits_error_and_exit(status);
     }
   }
+}
 
-  if (col_freqs >= 0) {
-    status = 0;
-    if (fits_write_col(fptr, TFLOAT, col_freqs, rowid, 1, channels, fits_freqs, &status)) {
-      fits_error_and_exit(status);
-    }
+/**
+ * Fix the field separators of a timestamp to YYYY-MM-DDThh:mm:ss
+ *
+ * @param {const char *} utc_start   Timestamp with any separators
+ * @param {char *} utc_start_fixed   Output, at least 20 characters
+ */
+void dadafits_fix_utc_start(const char *utc_start, char *utc_start_fixed) {
+  utc_start_fixed[ 0] = utc_start[0];
+  utc_start_fixed[ 1] = utc_start[1];
+  utc_start_fixed[ 2] = utc_start[2];
+  utc_start_fixed[ 3] = utc_start[3];
+  utc_start_fixed[ 4] = '-';
+  utc_start_fixed[ 5] = utc_start[5];
+  utc_start_fixed[ 6] = utc_start[6];
+  utc_start_fixed[ 7] = '-';
+  utc_start_fixed[ 8] = utc_start[8];
+  utc_start_fixed[ 9] = utc_start[9];
+  utc_start_fixed[10] = 'T';
+  utc_start_fixed[11] = utc_start[11];
+  utc_start_fixed[12] = utc_start[12];
+  utc_start_fixed[13] = ':';
+  utc_start_fixed[14] = utc_start[14];
+  utc_start_fixed[15] = utc_start[15];
+  utc_start_fixed[16] = ':';
+  utc_start_fixed[17] = utc_start[17];
+  utc_start_fixed[18] = utc_start[18];
+  utc_start_fixed[19] = '\0';
+}
+
+/**
+ * Set scaling, weights, and offsets to neutral values, and set the channel frequencies
+ *
+ * @param {int} nchannels          Number of channels
+ * @param {float} min_frequency    Center of lowest frequency band of observation
+ * @param {float} channelwidth     Width per channel, after optional downsampling
+ */
+void dadafits_init_channels(const int nchannels, const float min_frequency, const float channelwidth) {
+  int i;
+  for (i=0; i<NCHANNELS * NPOLS; i++) {
+    fits_offset[i] = 0.0;
+    fits_scale[i] = 1.0;
   }
 
-  if (col_weights >= 0) {
-    status = 0;
-    if (fits_write_col(fptr, TFLOAT, col_weights, rowid, 1, channels, fits_weights, &status)) {
-      fits_error_and_exit(status);
-    }
+  for (i=0; i<nchannels; i++) {
+    fits_weights[i] = 1.0;
+    // data should be ordered from high to low frequency
+    fits_freqs[nchannels - 1 - i] = min_frequency + i * channelwidth;
   }
+}
 
-  if (col_offset >= 0) {
-    status = 0;
-    if (fits_write_col(fptr, TFLOAT, col_offset, rowid, 1, channels * pols, fits_offset, &status)) {
-      fits_error_and_exit(status);
-    }
+/**
+ * Compare an integer keyword in the current HDU of two files
+ *
+ * @returns {int} 1 when equal, 0 otherwise
+ */
+int dadafits_same_key(fitsfile *file, fitsfile *reference, char *keyname) {
+  long value, expected;
+  int status = 0;
+
+  fits_read_key(file, TLONG, keyname, &value, NULL, &status);
+  fits_read_key(reference, TLONG, keyname, &expected, NULL, &status);
+  if (status) {
+    LOG("Cannot read keyword %s for resume\n", keyname);
+    return 0;
+  }
+  if (value != expected) {
+    LOG("Keyword %s is %li, expected %li\n", keyname, value, expected);
+    return 0;
   }
+  return 1;
+}
 
-  if (col_scale >= 0) {
-    status = 0;
-    if (fits_write_col(fptr, TFLOAT, col_scale, rowid, 1, channels * pols, fits_scale, &status)) {
-      fits_error_and_exit(status);
+/**
+ * Open an existing output file to continue writing to it
+ *
+ * The header must match the current observation (DATE-OBS, STT_IMJD, STT_SMJD),
+ * and the geometry of the SUBINT table must match the template.
+ *
+ * @param {fitsfile **} fptr        Opened file, moved to the SUBINT table
+ * @param {char *} fname            File name, without template
+ * @param {fitsfile *} reference    File created from the template, at the SUBINT table
+ * @param {long *} first_page       Set to the page in the first row, the NSUBOFFS key
+ * @returns {long} Number of complete rows in the file
+ */
+long dadafits_resume_file(fitsfile **fptr, const char *fname, fitsfile *reference, const char *date_obs, unsigned long stt_imjd, int stt_smjd,
+    long *first_page) {
+  char value[FLEN_VALUE];
+  unsigned long imjd;
+  int smjd;
+  int status;
+
+  status = 0; if (fits_open_file(fptr, fname, READWRITE, &status)) fits_error_and_exit(status);
+  status = 0; if (fits_movabs_hdu(*fptr, 1, NULL, &status)) fits_error_and_exit(status);
+  status = 0; if (fits_read_key(*fptr, TSTRING, "DATE-OBS", value, NULL, &status)) fits_error_and_exit(status);
+  status = 0; if (fits_read_key(*fptr, TULONG, "STT_IMJD", &imjd, NULL, &status)) fits_error_and_exit(status);
+  status = 0; if (fits_read_key(*fptr, TINT, "STT_SMJD", &smjd, NULL, &status)) fits_error_and_exit(status);
+
+  if (strcmp(value, date_obs) || imjd != stt_imjd || smjd != stt_smjd) {
+    LOG("Error: cannot resume %s, it is from a different observation (DATE-OBS %s, STT_IMJD %lu, STT_SMJD %i)\n", fname, value, imjd, smjd);
+    exit(EXIT_FAILURE);
+  }
+
+  status = 0; if (fits_movabs_hdu(*fptr, 2, NULL, &status)) fits_error_and_exit(status);
+  if (! dadafits_same_key(*fptr, reference, "NAXIS1") ||
+      ! dadafits_same_key(*fptr, reference, "TFIELDS") ||
+      ! dadafits_same_key(*fptr, reference, "NCHAN") ||
+      ! dadafits_same_key(*fptr, reference, "NPOL") ||
+      ! dadafits_same_key(*fptr, reference, "NSBLK")) {
+    LOG("Error: cannot resume %s, the table does not match the template\n", fname);
+    exit(EXIT_FAILURE);
+  }
+
+  // After a crash NAXIS2 can be out of date, or the last row can be incomplete:
+  // only trust rows that are both in the header and on disk
+  LONGLONG nrows, headstart, datastart, dataend;
+  long rowlength;
+  struct stat st;
+
+  status = 0; if (fits_get_num_rowsll(*fptr, &nrows, &status)) fits_error_and_exit(status);
+  status = 0; if (fits_read_key(*fptr, TLONG, "NAXIS1", &rowlength, NULL, &status)) fits_error_and_exit(status);
+  status = 0; if (fits_get_hduaddrll(*fptr, &headstart, &datastart, &dataend, &status)) fits_error_and_exit(status);
+  if (stat(fname, &st) == 0 && rowlength > 0) {
+    LONGLONG ondisk = (st.st_size - datastart) / rowlength;
+    if (ondisk < nrows) {
+      nrows = ondisk < 0 ? 0 : ondisk;
     }
   }
 
+  // files written before the first page was recorded start at page 0
   status = 0;
-  if (fits_write_col(fptr, TBYTE,  col_data, rowid, 1, rowlength, data, &status)) {
-    fits_error_and_exit(status);
+  if (fits_read_key(*fptr, TLONG, "NSUBOFFS", first_page, NULL, &status)) {
+    *first_page = 0;
+  }
+
+  LOG("Resuming %s after %lli complete rows, from page %li\n", fname, nrows, *first_page);
+  return (long) nrows;
+}
+
+/**
+ * Find a template compiled into the executable, see template2c.c
+ *
+ * @param {char *} template_file      Name of the template
+ * @returns {dadafits_template_t *}   The template, or NULL when not found
+ */
+const dadafits_template_t *dadafits_find_template(const char *template_file) {
+  const dadafits_template_t *template;
+
+  for (template = dadafits_templates; template->name; template++) {
+    if (strcmp(template->name, template_file) == 0) {
+      return template;
+    }
   }
+  return NULL;
+}
+
+/**
+ * Create a new FITS file from a template
+ *
+ * @param {fitsfile **} fptr        The new file
+ * @param {char *} fname            File name, or mem:// for a file in memory
+ * @param {char *} template_dir     Directory containing FITS templates, NULL to use the templates compiled in
+ * @param {char *} template_file    Name of the template
+ */
+void dadafits_create_from_template(fitsfile **fptr, const char *fname, const char *template_dir, const char *template_file) {
+  char name[512];
+  int status = 0;
+
+  if (template_dir) {
+    // let cfitsio parse the template file
+    snprintf(name, 512, "%s(%s/%s)", fname, template_dir, template_file);
+    if (fits_create_file(fptr, name, &status)) fits_error_and_exit(status);
+    return;
+  }
+
+  const dadafits_template_t *template = dadafits_find_template(template_file);
+  if (! template) {
+    LOG("Error: template '%s' is not compiled in, use -t to read it from a directory\n", template_file);
+    exit(EXIT_FAILURE);
+  }
+
+  // copy all HDUs from the binary image of the template
+  // NOTE: cfitsio keeps pointers to buffer and size until the memory file is closed
+  fitsfile *image;
+  void *buffer = (void *) template->data;
+  size_t size = template->size;
+  if (fits_open_memfile(&image, template_file, READONLY, &buffer, &size, 0, NULL, &status)) fits_error_and_exit(status);
+  if (fits_create_file(fptr, fname, &status)) fits_error_and_exit(status);
+  if (fits_copy_file(image, *fptr, 1, 1, 1, &status)) fits_error_and_exit(status);
+  if (fits_close_file(image, &status)) fits_error_and_exit(status);
 }
 
 /**
  * Initialize the CFITSIO library
- * @param {char *} template_dir     Directory containing FITS templates
+ * @param {char *} template_dir     Directory containing FITS templates, NULL to use the templates compiled in
  * @param {char *} template_file    FITS template to use for creating initial file.
  * @param {char *} output_directory Directoy where output FITS files can be written.
  * @param {int} ntabs               Number of beams
@@ -190,37 +539,23 @@ void write_fits(const int tab, const int channels, const int pols, const long ro
  * @param (double) lst_start        Local siderial time in degrees
  * @param {char *} parset           Pointer to a NULL terminated parset string (note: this will contain illegal characters, fix that upstream
  *                                  using fe. in python parset = parset.encode('bz2').encode('hex')
+ * @param {long} first_page         First page to write; new files number their rows from it, and record it as NSUBOFFS
+ * @param {int} resume              Continue writing to existing output files
+ * @returns {long}                  When resuming, the first page not yet written to all files; 0 otherwise
  */
-void dadafits_fits_init (const char *template_dir, const char *template_file, const char *output_directory,
+long dadafits_fits_init (const char *template_dir, const char *template_file, const char *output_directory,
     const int ntabs, const int mode, float scanlen, float center_frequency, float bandwidth, const float min_frequency, const int nchannels, const float channelwidth, char *ra_hms, char *dec_hms,
-    char *source_name, const char *utc_start, const double mjd_start, double lst_start, char *parset) {
+    char *source_name, const char *utc_start, const double mjd_start, double lst_start, char *parset, const long first_page, const int resume) {
   char utc_start_fixed[256];
   int status;
+  long resume_page = -1; // minimum over all files
+  fitsfile *reference = NULL;
   float version;
   fits_get_version(&version);
   LOG("Using FITS library version %f\n", version);
 
   // fix utc_start to YYYY-MM-DDThh:mm:ss
-  utc_start_fixed[ 0] = utc_start[0];
-  utc_start_fixed[ 1] = utc_start[1];
-  utc_start_fixed[ 2] = utc_start[2];
-  utc_start_fixed[ 3] = utc_start[3];
-  utc_start_fixed[ 4] = '-';
-  utc_start_fixed[ 5] = utc_start[5];
-  utc_start_fixed[ 6] = utc_start[6];
-  utc_start_fixed[ 7] = '-';
-  utc_start_fixed[ 8] = utc_start[8];
-  utc_start_fixed[ 9] = utc_start[9];
-  utc_start_fixed[10] = 'T';
-  utc_start_fixed[11] = utc_start[11];
-  utc_start_fixed[12] = utc_start[12];
-  utc_start_fixed[13] = ':';
-  utc_start_fixed[14] = utc_start[14];
-  utc_start_fixed[15] = utc_start[15];
-  utc_start_fixed[16] = ':';
-  utc_start_fixed[17] = utc_start[17];
-  utc_start_fixed[18] = utc_start[18];
-  utc_start_fixed[19] = '\0';
+  dadafits_fix_utc_start(utc_start, utc_start_fixed);
 
   // convert START_MJD to
   // STT_IMJD [days] Start MJD (UTC days) (J - long integer)
@@ -242,18 +577,29 @@ void dadafits_fits_init (const char *template_dir, const char *template_file, co
     prefix = synthesized_beam_prefix;
   }
 
-  int t;
-  for (t=0; t<NSYNS_MAX; t++) {
+  // when resuming, compare existing files against a file created from the template
+  if (resume) {
+    dadafits_create_from_template(&reference, "mem://", template_dir, template_file);
+    status = 0; if (fits_movabs_hdu(reference, 2, NULL, &status)) fits_error_and_exit(status);
+  }
+
+  // one file per tab, or one file per selected synthesized beam
+  output_count = mode == 0 ? ntabs : synthesized_beam_count;
+  output = calloc(output_count, sizeof(fitsfile *));
+  output_names = calloc(output_count, sizeof(char *));
+  output_first_page = calloc(output_count, sizeof(long));
+  if (output_count && (! output || ! output_names || ! output_first_page)) {
+    LOG("Error: cannot allocate the output file list\n");
+    exit(EXIT_FAILURE);
+  }
+
+  const int nfiles = mode == 0 ? ntabs : synthesized_beam_nselected;
+  int t, index;
+  for (index=0; index<nfiles; index++) {
     char fname[256];
     fitsfile *fptr;
 
-    if (mode == 0 && t >= ntabs) {
-      // when one file per tab, stop after ntab files
-      break;
-    } else if (mode == 1 && ! synthesized_beam_selected[t]) {
-      // when one file per synthesized beam, skip when not selected
-      continue;
-    }
+    t = mode == 0 ? index : synthesized_beam_list[index];
 
     if (output_directory) {
       if (mode == 0) {
@@ -262,10 +608,10 @@ void dadafits_fits_init (const char *template_dir, const char *template_file, co
           LOG("TAB file index cannot be higher than 25\n")
           exit(EXIT_FAILURE);
         }
-        snprintf(fname, 256, "%s/%s%c.fits(%s/%s)", output_directory, prefix, 'A'+t, template_dir, template_file);
+        snprintf(fname, 256, "%s/%s%c.fits", output_directory, prefix, 'A'+t);
       } else{
         // one file per SB, use numbers
-        snprintf(fname, 256, "%s/%s%02d.fits(%s/%s)", output_directory, prefix, t, template_dir, template_file);
+        snprintf(fname, 256, "%s/%s%02d.fits", output_directory, prefix, t);
       }
     } else {
       if (mode == 0) {
@@ -274,15 +620,31 @@ void dadafits_fits_init (const char *template_dir, const char *template_file, co
           LOG("TAB file index cannot be higher than 25\n")
           exit(EXIT_FAILURE);
         }
-        snprintf(fname, 256, "%s%c.fits(%s/%s)", prefix, 'A'+t, template_dir, template_file);
+        snprintf(fname, 256, "%s%c.fits", prefix, 'A'+t);
       } else {
         // one file per SB, use numbers
-        snprintf(fname, 256, "%s%02d.fits(%s/%s)", prefix, t, template_dir, template_file);
+        snprintf(fname, 256, "%s%02d.fits", prefix, t);
       }
     }
     LOG("Writing %s %02i to file %s\n", prefix, t, fname);
 
-    status = 0; if (fits_create_file(&fptr, fname, &status)) fits_error_and_exit(status);
+    // remember the file name, for migration
+    output_names[t] = strdup(fname);
+
+    if (resume && access(output_names[t], F_OK) == 0) {
+      long rows = dadafits_resume_file(&fptr, output_names[t], reference, utc_start_fixed, stt_imjd, stt_smjd, &output_first_page[t]);
+      if (resume_page < 0 || output_first_page[t] + rows < resume_page) {
+        resume_page = output_first_page[t] + rows;
+      }
+      output[t] = fptr;
+      continue;
+    } else if (resume) {
+      LOG("Cannot resume %s, file does not exist; starting from page %li\n", output_names[t], first_page);
+      resume_page = first_page;
+    }
+    output_first_page[t] = first_page;
+
+    dadafits_create_from_template(&fptr, fname, template_dir, template_file);
     status = 0; if (fits_movabs_hdu(fptr, 1, NULL, &status)) fits_error_and_exit(status);
     status = 0; if (fits_write_date(fptr, &status))          fits_error_and_exit(status);
     status = 0; if (fits_update_key(fptr, TSTRING, "RA", ra_hms, NULL, &status)) fits_error_and_exit(status);
@@ -297,25 +659,41 @@ void dadafits_fits_init (const char *template_dir, const char *template_file, co
     status = 0; if (fits_update_key(fptr, TDOUBLE, "STT_OFFS", &stt_offs, NULL, &status)) fits_error_and_exit(status);
     status = 0; if (fits_update_key(fptr, TDOUBLE, "STT_LST", &lst_start, NULL, &status)) fits_error_and_exit(status);
 
+    // corrections applied to the Stokes I data before packing, see pipeline.c
+    if (zero_dm) {
+      status = 0; if (fits_update_key(fptr, TLOGICAL, "ZERODM", &zero_dm, "Mean over channels subtracted per sample", &status)) fits_error_and_exit(status);
+    }
+    if (flatten_bandpass) {
+      status = 0; if (fits_update_key(fptr, TLOGICAL, "BPFLAT", &flatten_bandpass, "Bandpass flattened per page", &status)) fits_error_and_exit(status);
+    }
+
     status = 0; if (fits_write_key_longwarn (fptr, &status)) fits_error_and_exit(status);
     status = 0; if (fits_write_key_longstr(fptr, "PARSET", parset, NULL, &status)) fits_error_and_exit(status);
 
     status = 0; if (fits_write_chksum(fptr, &status))        fits_error_and_exit(status);
     status = 0; if (fits_movabs_hdu(fptr, 2, NULL, &status)) fits_error_and_exit(status);
 
+    // rows are numbered from the first page written, not from the start of the observation
+    status = 0; if (fits_update_key(fptr, TLONG, "NSUBOFFS", &output_first_page[t], NULL, &status)) fits_error_and_exit(status);
+
     output[t] = fptr;
   }
 
   // Set scaling, weights, and offsets to neutral values
-  int i;
-  for (i=0; i<NCHANNELS * NPOLS; i++) {
-    fits_offset[i] = 0.0;
-    fits_scale[i] = 1.0;
+  dadafits_init_channels(nchannels, min_frequency, channelwidth);
+
+  // all files use the same template; make the write plan from the first one
+  for (t = 0; t < output_count; t++) {
+    if (output[t]) {
+      dadafits_make_write_plan(output[t]);
+      break;
+    }
   }
 
-  for (i=0; i<nchannels; i++) {
-    fits_weights[i] = 1.0;
-    // data should be ordered from high to low frequency
-    fits_freqs[nchannels - 1 - i] = min_frequency + i * channelwidth;
+  if (reference) {
+    status = 0;
+    fits_close_file(reference, &status);
   }
+
+  return resume_page < 0 ? 0 : resume_page;
 }
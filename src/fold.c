@@ -0,0 +1,485 @@
+/**
+ * Online folding of a known pulsar
+ *
+ * The downsampled Stokes I data of every TAB is folded with a simple ephemeris,
+ * and written as a PSRFITS fold mode file per TAB (tabA_fold.fits, ...),
+ * with one row per sub-integration of NBIN x NCHAN 16-bit samples.
+ *
+ * The ephemeris is a text file with one 'KEY value' pair per line, '#' starts a comment:
+ *   PSRJ    name of the pulsar (or PSR, PSRB)
+ *   P0      period in seconds (or F0, frequency in Hz)
+ *   P1      period derivative (or F1, frequency derivative in Hz/s), default 0
+ *   DM      dispersion measure in pc/cm^3
+ *   PEPOCH  epoch of the period, and of pulse phase 0, in MJD
+ *
+ * The period is used as observed at the telescope: there is no correction to the solar system barycenter.
+ * Channels are dedispersed to the highest frequency before folding.
+ * When resuming, existing files are reopened and new sub-integrations are appended.
+ */
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <errno.h>
+#include <unistd.h>
+
+#include "fitsio.h"
+#include "dadafits_internal.h"
+
+// from fits_io.c; not in dadafits_internal.h as it needs fitsio.h
+extern void dadafits_create_from_template(fitsfile **fptr, const char *fname, const char *template_dir, const char *template_file);
+
+#define FOLD_TEMPLATE "fold_I.txt"
+
+// dispersion delay in seconds is DISPERSION_CONSTANT * DM / f^2, f in MHz
+#define DISPERSION_CONSTANT 4.148808e3
+
+typedef struct {
+  char name[64];
+  double period;  // s
+  double pdot;    // s/s
+  double dm;      // pc/cm^3
+  double epoch;   // MJD
+} ephemeris_t;
+
+static ephemeris_t ephemeris;
+static int fold_ntabs = 0;         // 0 when not folding
+static int fold_nbin;              // phase bins, from the template
+static int fold_subint_pages;      // pages per sub-integration
+static double fold_start;          // start of the observation, in seconds since the ephemeris epoch
+
+static float fold_frequencies[NCHANNELS_LOW]; // low to high frequency, as in the downsampled array
+static double fold_delays[NCHANNELS_LOW];     // dispersion delay with respect to the highest channel
+
+static fitsfile *fold_output[NTABS_MAX];
+static double *fold_sum[NTABS_MAX];           // [NCHANNELS_LOW][fold_nbin]
+static unsigned int *fold_count[NTABS_MAX];   // [NCHANNELS_LOW][fold_nbin]
+static long fold_subint[NTABS_MAX];           // current sub-integration, -1 for none
+static int fold_pages[NTABS_MAX];             // pages folded in the current sub-integration
+static long fold_first[NTABS_MAX];            // first page folded in the current sub-integration
+static long fold_rows[NTABS_MAX];             // sub-integrations written
+
+// column numbers in the SUBINT table, the same for all files
+static int col_tsubint, col_offs_sub, col_period, col_freq, col_wts, col_offs, col_scl, col_data;
+
+// the folded data of one TAB for one page, divided over the worker threads by channel
+typedef struct {
+  const unsigned int *downsampled;
+  double *sum;
+  unsigned int *count;
+  double start; // time of the first sample, seconds since the ephemeris epoch
+} fold_args_t;
+
+/**
+ * Read the ephemeris
+ *
+ * @param {char *} fname  Ephemeris file
+ */
+static void fold_read_ephemeris(const char *fname) {
+  char line[256];
+  char key[64];
+  char value[128];
+  double frequency = 0, fdot = 0;
+
+  FILE *file = fopen(fname, "r");
+  if (! file) {
+    LOG("Error: cannot read ephemeris '%s': %s\n", fname, strerror(errno));
+    exit(EXIT_FAILURE);
+  }
+
+  memset(&ephemeris, 0, sizeof(ephemeris));
+  strcpy(ephemeris.name, "PSR");
+  ephemeris.epoch = -1;
+  ephemeris.dm = -1;
+
+  while (fgets(line, 256, file)) {
+    char *comment = strchr(line, '#');
+    if (comment) {
+      *comment = '\0';
+    }
+    if (sscanf(line, "%63s %127s", key, value) != 2) {
+      continue;
+    }
+
+    if (strcmp(key, "PSRJ") == 0 || strcmp(key, "PSR") == 0 || strcmp(key, "PSRB") == 0) {
+      strncpy(ephemeris.name, value, 63);
+    } else if (strcmp(key, "P0") == 0 || strcmp(key, "P") == 0) {
+      ephemeris.period = atof(value);
+    } else if (strcmp(key, "P1") == 0 || strcmp(key, "PDOT") == 0) {
+      ephemeris.pdot = atof(value);
+    } else if (strcmp(key, "F0") == 0) {
+      frequency = atof(value);
+    } else if (strcmp(key, "F1") == 0) {
+      fdot = atof(value);
+    } else if (strcmp(key, "DM") == 0) {
+      ephemeris.dm = atof(value);
+    } else if (strcmp(key, "PEPOCH") == 0 || strcmp(key, "EPOCH") == 0) {
+      ephemeris.epoch = atof(value);
+    }
+  }
+  fclose(file);
+
+  // par files give frequency and its derivative instead
+  if (ephemeris.period == 0 && frequency > 0) {
+    ephemeris.period = 1.0 / frequency;
+    ephemeris.pdot = -fdot / (frequency * frequency);
+  }
+
+  if (ephemeris.period <= 0 || ephemeris.dm < 0 || ephemeris.epoch < 0) {
+    LOG("Error: ephemeris '%s' needs P0 (or F0), DM, and PEPOCH\n", fname);
+    exit(EXIT_FAILURE);
+  }
+}
+
+/**
+ * Pulse phase, and the apparent spin frequency, at a given time
+ *
+ * @param {double} t             Seconds since the ephemeris epoch
+ * @param {double *} frequency   Set to the spin frequency at t, Hz
+ * @returns {double}             Phase in [0, 1)
+ */
+static double fold_phase(const double t, double *frequency) {
+  const double f0 = 1.0 / ephemeris.period;
+  const double f1 = -ephemeris.pdot / (ephemeris.period * ephemeris.period);
+
+  *frequency = f0 + f1 * t;
+
+  double phase = f0 * t + 0.5 * f1 * t * t;
+  return phase - floor(phase);
+}
+
+/**
+ * Worker: fold a range of channels of one page
+ */
+static void fold_channels(void *arg, const int thread, const int nthreads) {
+  const fold_args_t *args = (fold_args_t *) arg;
+  const double tsamp = PAGE_DURATION / NTIMES_LOW;
+  const int first = thread * NCHANNELS_LOW / nthreads;
+  const int last = (thread + 1) * NCHANNELS_LOW / nthreads;
+
+  int dc;
+  for (dc = first; dc < last; dc++) {
+    const unsigned int *samples = &args->downsampled[dc * NTIMES_LOW];
+    double *sum = &args->sum[dc * fold_nbin];
+    unsigned int *count = &args->count[dc * fold_nbin];
+
+    // the phase changes linearly over a page, as the period derivative is negligible on that time scale
+    double frequency;
+    const double phase = fold_phase(args->start - fold_delays[dc], &frequency);
+    const double step = frequency * tsamp;
+
+    int dt;
+    for (dt = 0; dt < NTIMES_LOW; dt++) {
+      double p = phase + dt * step;
+      int bin = (p - floor(p)) * fold_nbin;
+      if (bin >= fold_nbin) {
+        bin = fold_nbin - 1; // rounding
+      }
+      sum[bin] += samples[dt];
+      count[bin]++;
+    }
+  }
+}
+
+/**
+ * Write the current sub-integration of a TAB, and start a new one
+ *
+ * @param {int} tab  TAB
+ */
+static void fold_write_subint(const int tab) {
+  float freqs[NCHANNELS_LOW];
+  float weights[NCHANNELS_LOW];
+  float offsets[NCHANNELS_LOW];
+  float scales[NCHANNELS_LOW];
+  short data[NCHANNELS_LOW * fold_nbin];
+  int status;
+
+  if (fold_pages[tab] == 0) {
+    return;
+  }
+
+  double tsubint = fold_pages[tab] * PAGE_DURATION;
+  // a resumed run can start, and a stop can end, halfway a sub-integration
+  double offs_sub = (fold_first[tab] + 0.5 * fold_pages[tab]) * PAGE_DURATION;
+  double frequency;
+  fold_phase(fold_start + offs_sub, &frequency);
+  double period = 1.0 / frequency;
+
+  // channels are stored from high to low frequency, as in the other output files
+  int dc;
+  for (dc = 0; dc < NCHANNELS_LOW; dc++) {
+    const int oc = NCHANNELS_LOW - 1 - dc;
+    const double *sum = &fold_sum[tab][dc * fold_nbin];
+    const unsigned int *count = &fold_count[tab][dc * fold_nbin];
+    double min = 0, max = 0;
+    int bin, filled = 0;
+
+    for (bin = 0; bin < fold_nbin; bin++) {
+      if (count[bin]) {
+        double value = sum[bin] / count[bin];
+        if (! filled || value < min) min = value;
+        if (! filled || value > max) max = value;
+        filled++;
+      }
+    }
+
+    // value = data * scale + offset, with data a signed 16 bit integer
+    freqs[oc] = fold_frequencies[dc];
+    weights[oc] = filled ? 1.0 : 0.0;
+    offsets[oc] = 0.5 * (max + min);
+    scales[oc] = max > min ? (max - min) / 65534.0 : 1.0;
+
+    for (bin = 0; bin < fold_nbin; bin++) {
+      data[oc * fold_nbin + bin] = count[bin] ? lround((sum[bin] / count[bin] - offsets[oc]) / scales[oc]) : 0;
+    }
+  }
+
+  fitsfile *fptr = fold_output[tab];
+  long row = ++fold_rows[tab];
+  status = 0; if (fits_write_col(fptr, TDOUBLE, col_tsubint, row, 1, 1, &tsubint, &status)) fits_error_and_exit(status);
+  status = 0; if (fits_write_col(fptr, TDOUBLE, col_offs_sub, row, 1, 1, &offs_sub, &status)) fits_error_and_exit(status);
+  status = 0; if (fits_write_col(fptr, TDOUBLE, col_period, row, 1, 1, &period, &status)) fits_error_and_exit(status);
+  status = 0; if (fits_write_col(fptr, TFLOAT, col_freq, row, 1, NCHANNELS_LOW, freqs, &status)) fits_error_and_exit(status);
+  status = 0; if (fits_write_col(fptr, TFLOAT, col_wts, row, 1, NCHANNELS_LOW, weights, &status)) fits_error_and_exit(status);
+  status = 0; if (fits_write_col(fptr, TFLOAT, col_offs, row, 1, NCHANNELS_LOW, offsets, &status)) fits_error_and_exit(status);
+  status = 0; if (fits_write_col(fptr, TFLOAT, col_scl, row, 1, NCHANNELS_LOW, scales, &status)) fits_error_and_exit(status);
+  status = 0; if (fits_write_col(fptr, TSHORT, col_data, row, 1, NCHANNELS_LOW * fold_nbin, data, &status)) fits_error_and_exit(status);
+
+  memset(fold_sum[tab], 0, NCHANNELS_LOW * fold_nbin * sizeof(double));
+  memset(fold_count[tab], 0, NCHANNELS_LOW * fold_nbin * sizeof(unsigned int));
+  fold_pages[tab] = 0;
+}
+
+/**
+ * Create a fold file from the template, and fill in the observation
+ *
+ * @param {fitsfile **} fptr        Set to the created file, at the SUBINT table
+ * @param {char *} fname            File name
+ * @param {char **} param_rows      The ephemeris, as text for the PSRPARAM table
+ */
+static void fold_create(fitsfile **fptr, const char *fname, const char *template_dir, char *ra_hms, char *dec_hms,
+    float center_frequency, float bandwidth, char *date_obs, unsigned long stt_imjd, int stt_smjd, double stt_offs, char **param_rows) {
+  int status;
+
+  dadafits_create_from_template(fptr, fname, template_dir, FOLD_TEMPLATE);
+  status = 0; if (fits_movabs_hdu(*fptr, 1, NULL, &status)) fits_error_and_exit(status);
+  status = 0; if (fits_write_date(*fptr, &status))          fits_error_and_exit(status);
+  status = 0; if (fits_update_key(*fptr, TSTRING, "RA", ra_hms, NULL, &status)) fits_error_and_exit(status);
+  status = 0; if (fits_update_key(*fptr, TSTRING, "DEC", dec_hms, NULL, &status)) fits_error_and_exit(status);
+  status = 0; if (fits_update_key(*fptr, TFLOAT, "OBSFREQ", &center_frequency, NULL, &status)) fits_error_and_exit(status);
+  status = 0; if (fits_update_key(*fptr, TFLOAT, "OBSBW", &bandwidth, NULL, &status)) fits_error_and_exit(status);
+  status = 0; if (fits_update_key(*fptr, TSTRING, "SRC_NAME", ephemeris.name, NULL, &status)) fits_error_and_exit(status);
+  status = 0; if (fits_update_key(*fptr, TSTRING, "DATE-OBS", date_obs, NULL, &status)) fits_error_and_exit(status);
+  status = 0; if (fits_update_key(*fptr, TULONG, "STT_IMJD", &stt_imjd, NULL, &status)) fits_error_and_exit(status);
+  status = 0; if (fits_update_key(*fptr, TINT, "STT_SMJD", &stt_smjd, NULL, &status)) fits_error_and_exit(status);
+  status = 0; if (fits_update_key(*fptr, TDOUBLE, "STT_OFFS", &stt_offs, NULL, &status)) fits_error_and_exit(status);
+  status = 0; if (fits_write_chksum(*fptr, &status))        fits_error_and_exit(status);
+
+  status = 0; if (fits_movnam_hdu(*fptr, BINARY_TBL, "PSRPARAM", 0, &status)) fits_error_and_exit(status);
+  status = 0; if (fits_write_col(*fptr, TSTRING, 1, 1, 1, 5, param_rows, &status)) fits_error_and_exit(status);
+
+  status = 0; if (fits_movnam_hdu(*fptr, BINARY_TBL, "SUBINT", 0, &status)) fits_error_and_exit(status);
+  status = 0; if (fits_update_key(*fptr, TDOUBLE, "DM", &ephemeris.dm, NULL, &status)) fits_error_and_exit(status);
+}
+
+/**
+ * Reopen an existing fold file to append to it
+ * The file must belong to the same observation, and have the same number of phase bins
+ *
+ * @param {fitsfile **} fptr        Set to the opened file, at the SUBINT table
+ * @param {char *} fname            File name
+ * @param {char *} date_obs         DATE-OBS of the observation
+ * @returns {long}                  Number of sub-integrations in the file
+ */
+static long fold_reopen(fitsfile **fptr, const char *fname, const char *date_obs) {
+  char existing[FLEN_VALUE];
+  long rows;
+  int nbin;
+  int status;
+
+  status = 0; if (fits_open_file(fptr, fname, READWRITE, &status)) fits_error_and_exit(status);
+  status = 0; if (fits_read_key(*fptr, TSTRING, "DATE-OBS", existing, NULL, &status)) fits_error_and_exit(status);
+  if (strcmp(existing, date_obs) != 0) {
+    LOG("Error: cannot resume %s, it belongs to the observation at %s\n", fname, existing);
+    exit(EXIT_FAILURE);
+  }
+
+  status = 0; if (fits_movnam_hdu(*fptr, BINARY_TBL, "SUBINT", 0, &status)) fits_error_and_exit(status);
+  status = 0; if (fits_read_key(*fptr, TINT, "NBIN", &nbin, NULL, &status)) fits_error_and_exit(status);
+  if (fold_nbin && nbin != fold_nbin) {
+    LOG("Error: cannot resume %s, it has %i phase bins instead of %i\n", fname, nbin, fold_nbin);
+    exit(EXIT_FAILURE);
+  }
+  status = 0; if (fits_get_num_rows(*fptr, &rows, &status)) fits_error_and_exit(status);
+
+  LOG("Resuming %s after %li sub-integrations\n", fname, rows);
+  return rows;
+}
+
+/**
+ * Set up folding, and create (or when resuming, reopen) the output files
+ *
+ * @param {char *} ephemeris_file   Ephemeris of the pulsar, see above
+ * @param {char *} template_dir     Directory containing FITS templates, NULL to use the templates compiled in
+ * @param {char *} output_directory Directory for the output files, NULL for the current directory
+ * @param {int} ntabs               Number of TABs
+ * @param {int} subint_pages        Pages per sub-integration
+ * @param {float} center_frequency  Center frequency of observation
+ * @param {float} bandwidth         Bandwidth of observation
+ * @param {float} min_frequency     Center of the lowest channel, after downsampling
+ * @param {float} channelwidth      Width of a channel, after downsampling
+ * @param {char *} ra_hms           Right ascension
+ * @param {char *} dec_hms          Declination
+ * @param {char *} utc_start        Timestamp of start of the observation (UTC)
+ * @param {double} mjd_start        Start time of the observation in days
+ * @param {int} resume              Append to existing output files
+ */
+void fold_init(const char *ephemeris_file, const char *template_dir, const char *output_directory,
+    const int ntabs, const int subint_pages, float center_frequency, float bandwidth, const float min_frequency, const float channelwidth,
+    char *ra_hms, char *dec_hms, const char *utc_start, const double mjd_start, const int resume) {
+  char utc_start_fixed[256];
+  char fname[256];
+  int status;
+
+  fold_read_ephemeris(ephemeris_file);
+
+  if (subint_pages < 1) {
+    LOG("Error: a sub-integration needs at least one page\n");
+    exit(EXIT_FAILURE);
+  }
+  if (ntabs > 25) {
+    LOG("TAB file index cannot be higher than 25\n")
+    exit(EXIT_FAILURE);
+  }
+  fold_subint_pages = subint_pages;
+  fold_nbin = 0;
+  fold_start = (mjd_start - ephemeris.epoch) * 24 * 60 * 60;
+
+  // dedisperse to the highest frequency
+  const float max_frequency = min_frequency + (NCHANNELS_LOW - 1) * channelwidth;
+  int dc;
+  for (dc = 0; dc < NCHANNELS_LOW; dc++) {
+    fold_frequencies[dc] = min_frequency + dc * channelwidth;
+    fold_delays[dc] = DISPERSION_CONSTANT * ephemeris.dm *
+      (1.0 / (fold_frequencies[dc] * fold_frequencies[dc]) - 1.0 / (max_frequency * max_frequency));
+  }
+
+  dadafits_fix_utc_start(utc_start, utc_start_fixed);
+  unsigned long stt_imjd = floor(mjd_start);
+  int stt_smjd = floor((mjd_start - stt_imjd) * 24 * 60 * 60);
+  double stt_offs = ((mjd_start - stt_imjd) * 24 * 60 * 60) - stt_smjd;
+
+  // the ephemeris is stored as text in the PSRPARAM table
+  char params[5][128];
+  char *param_rows[5] = {params[0], params[1], params[2], params[3], params[4]};
+  snprintf(params[0], 128, "PSRJ     %s", ephemeris.name);
+  snprintf(params[1], 128, "P0       %.15g", ephemeris.period);
+  snprintf(params[2], 128, "P1       %.15g", ephemeris.pdot);
+  snprintf(params[3], 128, "DM       %.15g", ephemeris.dm);
+  snprintf(params[4], 128, "PEPOCH   %.15g", ephemeris.epoch);
+
+  int t;
+  for (t = 0; t < ntabs; t++) {
+    fitsfile *fptr;
+
+    if (output_directory) {
+      snprintf(fname, 256, "%s/tab%c_fold.fits", output_directory, 'A' + t);
+    } else {
+      snprintf(fname, 256, "tab%c_fold.fits", 'A' + t);
+    }
+    LOG("Folding tab %02i to file %s\n", t, fname);
+
+    long rows = 0;
+    if (resume && access(fname, F_OK) == 0) {
+      rows = fold_reopen(&fptr, fname, utc_start_fixed);
+    } else {
+      fold_create(&fptr, fname, template_dir, ra_hms, dec_hms, center_frequency, bandwidth,
+          utc_start_fixed, stt_imjd, stt_smjd, stt_offs, param_rows);
+    }
+
+    if (t == 0) {
+      // all files use the same template
+      status = 0; if (fits_read_key(fptr, TINT, "NBIN", &fold_nbin, NULL, &status)) fits_error_and_exit(status);
+      status = 0; if (fits_get_colnum(fptr, CASEINSEN, "TSUBINT", &col_tsubint, &status)) fits_error_and_exit(status);
+      status = 0; if (fits_get_colnum(fptr, CASEINSEN, "OFFS_SUB", &col_offs_sub, &status)) fits_error_and_exit(status);
+      status = 0; if (fits_get_colnum(fptr, CASEINSEN, "PERIOD", &col_period, &status)) fits_error_and_exit(status);
+      status = 0; if (fits_get_colnum(fptr, CASEINSEN, "DAT_FREQ", &col_freq, &status)) fits_error_and_exit(status);
+      status = 0; if (fits_get_colnum(fptr, CASEINSEN, "DAT_WTS", &col_wts, &status)) fits_error_and_exit(status);
+      status = 0; if (fits_get_colnum(fptr, CASEINSEN, "DAT_OFFS", &col_offs, &status)) fits_error_and_exit(status);
+      status = 0; if (fits_get_colnum(fptr, CASEINSEN, "DAT_SCL", &col_scl, &status)) fits_error_and_exit(status);
+      status = 0; if (fits_get_colnum(fptr, CASEINSEN, "DATA", &col_data, &status)) fits_error_and_exit(status);
+    }
+
+    fold_output[t] = fptr;
+    fold_sum[t] = calloc(NCHANNELS_LOW * fold_nbin, sizeof(double));
+    fold_count[t] = calloc(NCHANNELS_LOW * fold_nbin, sizeof(unsigned int));
+    if (! fold_sum[t] || ! fold_count[t]) {
+      LOG("Error: cannot allocate folding buffers\n");
+      exit(EXIT_FAILURE);
+    }
+    fold_subint[t] = -1;
+    fold_pages[t] = 0;
+    fold_rows[t] = rows;
+  }
+  fold_ntabs = ntabs;
+
+  LOG("Folding %s: period %.12g s, pdot %g, DM %g, epoch %.6f, %i bins, %i pages per sub-integration\n",
+      ephemeris.name, ephemeris.period, ephemeris.pdot, ephemeris.dm, ephemeris.epoch, fold_nbin, fold_subint_pages);
+}
+
+/**
+ * Is folding enabled
+ */
+int fold_active() {
+  return fold_ntabs > 0;
+}
+
+/**
+ * Fold the downsampled Stokes I data of one TAB, on the worker threads
+ * Must be called before packing, which overwrites the downsampled data
+ *
+ * @param {int} tab             TAB
+ * @param {long} page           Page number since the start of the observation
+ * @param {uint[]} downsampled  Downsampled data [NCHANNELS_LOW, NTIMES_LOW], low to high frequency
+ */
+void fold_page(const int tab, const long page, const unsigned int *downsampled) {
+  if (tab >= fold_ntabs) {
+    return;
+  }
+
+  long subint = page / fold_subint_pages;
+  if (subint != fold_subint[tab]) {
+    fold_write_subint(tab);
+    fold_subint[tab] = subint;
+    fold_first[tab] = page;
+  }
+
+  fold_args_t args;
+  args.downsampled = downsampled;
+  args.sum = fold_sum[tab];
+  args.count = fold_count[tab];
+  args.start = fold_start + page * PAGE_DURATION + 0.5 * PAGE_DURATION / NTIMES_LOW; // center of the first sample
+
+  run_workers(fold_channels, &args, worker_threads);
+  fold_pages[tab]++;
+}
+
+/**
+ * Write the last sub-integrations, and close the output files
+ */
+void fold_close() {
+  int t, status;
+
+  for (t = 0; t < fold_ntabs; t++) {
+    fold_write_subint(t);
+
+    status = 0; if (fits_write_chksum(fold_output[t], &status)) fits_error_and_exit(status);
+    status = 0; if (fits_close_file(fold_output[t], &status)) fits_error_and_exit(status);
+    free(fold_sum[t]);
+    free(fold_count[t]);
+  }
+
+  if (fold_ntabs) {
+    LOG("Wrote %li folded sub-integrations per TAB\n", fold_rows[0]);
+  }
+  fold_ntabs = 0;
+}
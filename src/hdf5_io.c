@@ -0,0 +1,395 @@
+/**
+ * HDF5 output, as an alternative to FITS
+ *
+ * One file per beam, with the same data and metadata as the FITS files:
+ *   /data       uint8 [rows * NSBLK, NPOL, NCHAN * NBITS / 8], chunked in time and frequency, deflate compressed
+ *   /dat_freq   float [rows, NCHAN]
+ *   /dat_wts    float [rows, NCHAN]
+ *   /dat_offs   float [rows, NCHAN * NPOL]
+ *   /dat_scl    float [rows, NCHAN * NPOL]
+ *   /offs_sub   double [rows]
+ *   /tel_az     float [rows]
+ *   /tel_zen    float [rows]
+ * and the primary header keys as attributes of the root group.
+ *
+ * The data chunks are compressed on the worker threads, and written with H5Dwrite_chunk,
+ * bypassing the (single threaded) HDF5 filter pipeline.
+ */
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <hdf5.h>
+#include <zlib.h>
+
+#include "dadafits_internal.h"
+
+#define HDF5_DEFLATE_LEVEL 1
+
+// Chunking of the data set: short enough in time to read a transient without scanning whole rows,
+// long enough, and covering enough channels, for efficient reading of the full band
+#define HDF5_CHUNK_CHANNEL_BYTES 384
+
+typedef struct {
+  hid_t file;
+  hid_t data;
+  hid_t dat_freq, dat_wts, dat_offs, dat_scl;
+  hid_t offs_sub, tel_az, tel_zen;
+  long rows;
+} hdf5_output_t;
+
+// Output files, indexed by TAB or synthesized beam number
+static hdf5_output_t **hdf5_output = NULL;
+static char **hdf5_names = NULL;
+static int hdf5_count = 0;
+static long hdf5_first_page = 0; // page in the first row of every file
+
+// Geometry of the data set
+static int hdf5_ntimes, hdf5_npols, hdf5_nbytes, hdf5_nchannels;
+static hsize_t hdf5_chunk[3];
+static int hdf5_nchunks;
+
+// Compression buffers, one per chunk of a row
+static unsigned char **hdf5_compressed;
+static uLongf *hdf5_compressed_size;
+static uLong hdf5_compressed_max;
+static unsigned char **hdf5_gathered;   // per worker thread, one chunk
+
+static void hdf5_check(herr_t err, const char *what) {
+  if (err < 0) {
+    LOG("Error: HDF5 call failed: %s\n", what);
+    exit(EXIT_FAILURE);
+  }
+}
+
+static void hdf5_attribute(hid_t loc, const char *name, hid_t type, const void *value) {
+  hid_t space = H5Screate(H5S_SCALAR);
+  hid_t attr = H5Acreate2(loc, name, type, space, H5P_DEFAULT, H5P_DEFAULT);
+  hdf5_check(H5Awrite(attr, type, value), name);
+  H5Aclose(attr);
+  H5Sclose(space);
+}
+
+static void hdf5_attribute_string(hid_t loc, const char *name, const char *value) {
+  hid_t type = H5Tcopy(H5T_C_S1);
+  H5Tset_size(type, strlen(value) + 1);
+  hdf5_attribute(loc, name, type, value);
+  H5Tclose(type);
+}
+
+/**
+ * Create an extendible data set of [rows, width], chunked per row
+ */
+static hid_t hdf5_table(hid_t file, const char *name, hid_t type, const int width) {
+  hsize_t dims[2] = {0, width};
+  hsize_t maxdims[2] = {H5S_UNLIMITED, width};
+  hsize_t chunk[2] = {1, width};
+  int rank = width ? 2 : 1;
+
+  hid_t space = H5Screate_simple(rank, dims, maxdims);
+  hid_t plist = H5Pcreate(H5P_DATASET_CREATE);
+  H5Pset_chunk(plist, rank, chunk);
+  hid_t dset = H5Dcreate2(file, name, type, space, H5P_DEFAULT, plist, H5P_DEFAULT);
+  if (dset < 0) {
+    LOG("Error: cannot create HDF5 data set %s\n", name);
+    exit(EXIT_FAILURE);
+  }
+  H5Pclose(plist);
+  H5Sclose(space);
+  return dset;
+}
+
+/**
+ * Write one row to a data set created by hdf5_table
+ */
+static void hdf5_table_row(hid_t dset, hid_t type, const long rowid, const long rows, const int width, const void *values) {
+  hsize_t dims[2] = {rows, width};
+  hsize_t start[2] = {rowid - 1, 0};
+  hsize_t count[2] = {1, width};
+  int rank = width ? 2 : 1;
+
+  hdf5_check(H5Dset_extent(dset, dims), "extend table");
+  hid_t filespace = H5Dget_space(dset);
+  H5Sselect_hyperslab(filespace, H5S_SELECT_SET, start, NULL, count, NULL);
+  hid_t memspace = H5Screate_simple(rank, count, NULL);
+  hdf5_check(H5Dwrite(dset, type, memspace, filespace, H5P_DEFAULT, values), "write table row");
+  H5Sclose(memspace);
+  H5Sclose(filespace);
+}
+
+/**
+ * Initialize HDF5 output, see dadafits_fits_init for the parameters
+ *
+ * @param {int} npols   Number of polarizations
+ * @param {int} ntimes  Number of samples per row
+ * @param {int} nbits   Number of bits per sample, 1 or 8
+ */
+void dadafits_hdf5_init (const char *output_directory, const int ntabs, const int mode,
+    const int nchannels, const int npols, const int ntimes, const int nbits,
+    float scanlen, float center_frequency, float bandwidth, const float min_frequency, const float channelwidth,
+    char *ra_hms, char *dec_hms, char *source_name, const char *utc_start, const double mjd_start, double lst_start, char *parset,
+    const long first_page) {
+  char utc_start_fixed[256];
+  unsigned int majnum, minnum, relnum;
+
+  H5get_libversion(&majnum, &minnum, &relnum);
+  LOG("Using HDF5 library version %u.%u.%u\n", majnum, minnum, relnum);
+
+  dadafits_fix_utc_start(utc_start, utc_start_fixed);
+  unsigned long stt_imjd = floor(mjd_start);
+  int stt_smjd = floor((mjd_start - stt_imjd) * 24 * 60 * 60);
+  double stt_offs = ((mjd_start - stt_imjd) * 24 * 60 * 60) - stt_smjd;
+  double tbin = PAGE_DURATION / ntimes;
+
+  hdf5_ntimes = ntimes;
+  hdf5_npols = npols;
+  hdf5_nchannels = nchannels;
+  hdf5_nbytes = nchannels * nbits / 8;
+
+  hdf5_chunk[0] = ntimes % PACKET_NTIMES ? ntimes / 5 : PACKET_NTIMES;
+  hdf5_chunk[1] = npols;
+  hdf5_chunk[2] = hdf5_nbytes > HDF5_CHUNK_CHANNEL_BYTES ? HDF5_CHUNK_CHANNEL_BYTES : hdf5_nbytes;
+  hdf5_nchunks = (ntimes / hdf5_chunk[0]) * (hdf5_nbytes / hdf5_chunk[2]);
+  LOG("HDF5 chunks of (%llu,%llu,%llu), %i chunks per row\n",
+      (unsigned long long) hdf5_chunk[0], (unsigned long long) hdf5_chunk[1], (unsigned long long) hdf5_chunk[2], hdf5_nchunks);
+
+  hdf5_first_page = first_page;
+
+  hdf5_compressed_max = compressBound(hdf5_chunk[0] * hdf5_chunk[1] * hdf5_chunk[2]);
+  hdf5_compressed = malloc(hdf5_nchunks * sizeof(unsigned char *));
+  hdf5_compressed_size = malloc(hdf5_nchunks * sizeof(uLongf));
+  int c;
+  for (c = 0; c < hdf5_nchunks; c++) {
+    hdf5_compressed[c] = malloc(hdf5_compressed_max);
+    if (! hdf5_compressed[c]) {
+      LOG("Error: cannot allocate HDF5 compression buffers\n");
+      exit(EXIT_FAILURE);
+    }
+  }
+
+  // the chunk is gathered from the row before compressing it, see hdf5_compress
+  hdf5_gathered = malloc(worker_threads * sizeof(unsigned char *));
+  if (! hdf5_gathered) {
+    LOG("Error: cannot allocate HDF5 compression buffers\n");
+    exit(EXIT_FAILURE);
+  }
+  for (c = 0; c < worker_threads; c++) {
+    hdf5_gathered[c] = malloc(hdf5_chunk[0] * hdf5_chunk[1] * hdf5_chunk[2]);
+    if (! hdf5_gathered[c]) {
+      LOG("Error: cannot allocate HDF5 compression buffers\n");
+      exit(EXIT_FAILURE);
+    }
+  }
+
+  hdf5_count = mode == 0 ? ntabs : synthesized_beam_count;
+  hdf5_output = calloc(hdf5_count, sizeof(hdf5_output_t *));
+  hdf5_names = calloc(hdf5_count, sizeof(char *));
+  if (hdf5_count && (! hdf5_output || ! hdf5_names)) {
+    LOG("Error: cannot allocate the output file list\n");
+    exit(EXIT_FAILURE);
+  }
+
+  const int nfiles = mode == 0 ? ntabs : synthesized_beam_nselected;
+  int t, index;
+  for (index=0; index<nfiles; index++) {
+    char fname[256];
+
+    t = mode == 0 ? index : synthesized_beam_list[index];
+
+    if (mode == 0) {
+      if (t > 25) {
+        LOG("TAB file index cannot be higher than 25\n")
+        exit(EXIT_FAILURE);
+      }
+      snprintf(fname, 256, "%s/tab%c.h5", output_directory ? output_directory : ".", 'A'+t);
+    } else {
+      snprintf(fname, 256, "%s/syn%02d.h5", output_directory ? output_directory : ".", t);
+    }
+    LOG("Writing beam %02i to file %s\n", t, fname);
+
+    hdf5_output_t *out = calloc(1, sizeof(hdf5_output_t));
+    out->file = H5Fcreate(fname, H5F_ACC_TRUNC, H5P_DEFAULT, H5P_DEFAULT);
+    if (out->file < 0) {
+      LOG("Error: cannot create %s\n", fname);
+      exit(EXIT_FAILURE);
+    }
+
+    // metadata, same keys as the FITS primary header
+    hdf5_attribute_string(out->file, "RA", ra_hms);
+    hdf5_attribute_string(out->file, "DEC", dec_hms);
+    hdf5_attribute(out->file, "SCANLEN", H5T_NATIVE_FLOAT, &scanlen);
+    hdf5_attribute(out->file, "OBSFREQ", H5T_NATIVE_FLOAT, &center_frequency);
+    hdf5_attribute(out->file, "OBSBW", H5T_NATIVE_FLOAT, &bandwidth);
+    hdf5_attribute_string(out->file, "SRC_NAME", source_name);
+    hdf5_attribute_string(out->file, "DATE-OBS", utc_start_fixed);
+    hdf5_attribute(out->file, "STT_IMJD", H5T_NATIVE_ULONG, &stt_imjd);
+    hdf5_attribute(out->file, "STT_SMJD", H5T_NATIVE_INT, &stt_smjd);
+    hdf5_attribute(out->file, "STT_OFFS", H5T_NATIVE_DOUBLE, &stt_offs);
+    hdf5_attribute(out->file, "STT_LST", H5T_NATIVE_DOUBLE, &lst_start);
+    hdf5_attribute(out->file, "NSUBOFFS", H5T_NATIVE_LONG, &hdf5_first_page);
+    if (zero_dm) {
+      hdf5_attribute(out->file, "ZERODM", H5T_NATIVE_INT, &zero_dm);
+    }
+    if (flatten_bandpass) {
+      hdf5_attribute(out->file, "BPFLAT", H5T_NATIVE_INT, &flatten_bandpass);
+    }
+    hdf5_attribute_string(out->file, "PARSET", parset);
+    hdf5_attribute(out->file, "NCHAN", H5T_NATIVE_INT, &nchannels);
+    hdf5_attribute(out->file, "NPOL", H5T_NATIVE_INT, &npols);
+    hdf5_attribute(out->file, "NSBLK", H5T_NATIVE_INT, &ntimes);
+    hdf5_attribute(out->file, "NBITS", H5T_NATIVE_INT, &nbits);
+    hdf5_attribute(out->file, "TBIN", H5T_NATIVE_DOUBLE, &tbin);
+
+    // the data, chunked and compressed
+    hsize_t dims[3] = {0, npols, hdf5_nbytes};
+    hsize_t maxdims[3] = {H5S_UNLIMITED, npols, hdf5_nbytes};
+    hid_t space = H5Screate_simple(3, dims, maxdims);
+    hid_t plist = H5Pcreate(H5P_DATASET_CREATE);
+    H5Pset_chunk(plist, 3, hdf5_chunk);
+    H5Pset_deflate(plist, HDF5_DEFLATE_LEVEL);
+    out->data = H5Dcreate2(out->file, "data", H5T_NATIVE_UCHAR, space, H5P_DEFAULT, plist, H5P_DEFAULT);
+    if (out->data < 0) {
+      LOG("Error: cannot create HDF5 data set in %s\n", fname);
+      exit(EXIT_FAILURE);
+    }
+    H5Pclose(plist);
+    H5Sclose(space);
+    hdf5_attribute_string(out->data, "DIMENSIONS", nbits == 1 ? "(NSBLK, NPOL, NCHAN/8), 8 channels per byte, LSB is the lowest channel" : "(NSBLK, NPOL, NCHAN)");
+
+    out->dat_freq = hdf5_table(out->file, "dat_freq", H5T_NATIVE_FLOAT, nchannels);
+    out->dat_wts = hdf5_table(out->file, "dat_wts", H5T_NATIVE_FLOAT, nchannels);
+    out->dat_offs = hdf5_table(out->file, "dat_offs", H5T_NATIVE_FLOAT, nchannels * npols);
+    out->dat_scl = hdf5_table(out->file, "dat_scl", H5T_NATIVE_FLOAT, nchannels * npols);
+    out->offs_sub = hdf5_table(out->file, "offs_sub", H5T_NATIVE_DOUBLE, 0);
+    out->tel_az = hdf5_table(out->file, "tel_az", H5T_NATIVE_FLOAT, 0);
+    out->tel_zen = hdf5_table(out->file, "tel_zen", H5T_NATIVE_FLOAT, 0);
+
+    hdf5_output[t] = out;
+    hdf5_names[t] = strdup(fname);
+  }
+
+  dadafits_init_channels(nchannels, min_frequency, channelwidth);
+}
+
+typedef struct {
+  const unsigned char *data;
+} hdf5_compress_args_t;
+
+/**
+ * Worker: compress every nthreads-th chunk of the row
+ */
+static void hdf5_compress(void *arg, const int thread, const int nthreads) {
+  const unsigned char *data = ((hdf5_compress_args_t *) arg)->data;
+  const int chunks_per_time = hdf5_nbytes / hdf5_chunk[2];
+  const long chunk_bytes = hdf5_chunk[0] * hdf5_chunk[1] * hdf5_chunk[2];
+  unsigned char *gathered = hdf5_gathered[thread];
+  int c;
+
+  for (c = thread; c < hdf5_nchunks; c += nthreads) {
+    int t0 = (c / chunks_per_time) * hdf5_chunk[0];
+    int b0 = (c % chunks_per_time) * hdf5_chunk[2];
+    unsigned char *dst = gathered;
+    int t, p;
+
+    // gather the chunk from the row [time, pol, bytes]
+    for (t = t0; t < t0 + hdf5_chunk[0]; t++) {
+      for (p = 0; p < hdf5_npols; p++) {
+        memcpy(dst, &data[((long) t * hdf5_npols + p) * hdf5_nbytes + b0], hdf5_chunk[2]);
+        dst += hdf5_chunk[2];
+      }
+    }
+
+    hdf5_compressed_size[c] = hdf5_compressed_max;
+    if (compress2(hdf5_compressed[c], &hdf5_compressed_size[c], gathered, chunk_bytes, HDF5_DEFLATE_LEVEL) != Z_OK) {
+      hdf5_compressed_size[c] = 0;
+    }
+  }
+}
+
+/**
+ * Write a row of data to the HDF5 file, see write_fits for the parameters
+ */
+void write_hdf5(const int tab, const int channels, const int pols, const long page_index, const int rowlength, unsigned char *data, float telaz, float telza) {
+  hdf5_output_t *out = hdf5_output[tab];
+  const long rowid = page_index - hdf5_first_page + 1;
+  double offs_sub = (page_index + 0.5) * PAGE_DURATION;
+
+  if (rowid > out->rows) {
+    out->rows = rowid;
+  }
+
+  write_qos_acquire(tab, (3 * channels + 2 * channels * pols) * sizeof(float) + 32);
+  hdf5_table_row(out->offs_sub, H5T_NATIVE_DOUBLE, rowid, out->rows, 0, &offs_sub);
+  hdf5_table_row(out->tel_az, H5T_NATIVE_FLOAT, rowid, out->rows, 0, &telaz);
+  hdf5_table_row(out->tel_zen, H5T_NATIVE_FLOAT, rowid, out->rows, 0, &telza);
+  hdf5_table_row(out->dat_freq, H5T_NATIVE_FLOAT, rowid, out->rows, channels, fits_freqs);
+  hdf5_table_row(out->dat_wts, H5T_NATIVE_FLOAT, rowid, out->rows, channels, fits_weights);
+  hdf5_table_row(out->dat_offs, H5T_NATIVE_FLOAT, rowid, out->rows, channels * pols, fits_offset);
+  hdf5_table_row(out->dat_scl, H5T_NATIVE_FLOAT, rowid, out->rows, channels * pols, fits_scale);
+
+  // compress all chunks of the row in parallel
+  hdf5_compress_args_t args;
+  args.data = data;
+  run_workers(hdf5_compress, &args, hdf5_nchunks);
+
+  // and write them in order
+  hsize_t dims[3] = {out->rows * hdf5_ntimes, hdf5_npols, hdf5_nbytes};
+  hdf5_check(H5Dset_extent(out->data, dims), "extend data");
+
+  const int chunks_per_time = hdf5_nbytes / hdf5_chunk[2];
+  int c;
+  for (c = 0; c < hdf5_nchunks; c++) {
+    hsize_t offset[3];
+    offset[0] = (rowid - 1) * hdf5_ntimes + (c / chunks_per_time) * hdf5_chunk[0];
+    offset[1] = 0;
+    offset[2] = (c % chunks_per_time) * hdf5_chunk[2];
+
+    if (! hdf5_compressed_size[c]) {
+      LOG("Error: compression failed for chunk %i of row %li\n", c, rowid);
+      exit(EXIT_FAILURE);
+    }
+    write_qos_acquire(tab, hdf5_compressed_size[c]);
+    hdf5_check(H5Dwrite_chunk(out->data, H5P_DEFAULT, 0, offset, hdf5_compressed_size[c], hdf5_compressed[c]), "write chunk");
+  }
+}
+
+/**
+ * Close a single HDF5 file, on a closer thread
+ */
+static void close_hdf5_beam(const int beam) {
+  hdf5_output_t *out = hdf5_output[beam];
+
+  H5Dclose(out->data);
+  H5Dclose(out->dat_freq);
+  H5Dclose(out->dat_wts);
+  H5Dclose(out->dat_offs);
+  H5Dclose(out->dat_scl);
+  H5Dclose(out->offs_sub);
+  H5Dclose(out->tel_az);
+  H5Dclose(out->tel_zen);
+  H5Fclose(out->file);
+  free(out);
+  hdf5_output[beam] = NULL;
+
+  migrate_file(hdf5_names[beam]);
+  free(hdf5_names[beam]);
+  hdf5_names[beam] = NULL;
+}
+
+/**
+ * Close all opened HDF5 files
+ */
+void close_hdf5() {
+  int beams[hdf5_count + 1];
+  int beam, count = 0;
+  hbool_t threadsafe = 0;
+
+  for (beam=0; beam<hdf5_count; beam++) {
+    if (hdf5_output[beam]) {
+      beams[count++] = beam;
+    }
+  }
+
+  // the HDF5 library serializes all calls unless built thread-safe; then closing in parallel does not help
+  H5is_library_threadsafe(&threadsafe);
+  close_files("HDF5 files", close_hdf5_beam, beams, count, threadsafe ? worker_threads : 1);
+}
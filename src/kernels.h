@@ -0,0 +1,557 @@
+/**
+ * Inline kernel templates
+ *
+ * The geometry is passed as arguments; when called with constants, as from the
+ * specialized pipelines in pipeline.c, the compiler can unroll and vectorize the loops.
+ * The library functions in manipulate.c call the same templates with the geometry from the context.
+ */
+#ifndef __HAVE_DADAFITS_KERNELS_H__
+#define __HAVE_DADAFITS_KERNELS_H__
+
+#include <string.h>
+#include <math.h>
+#include "dadafits_internal.h"
+
+#define DADAFITS_INLINE static inline __attribute__((always_inline))
+
+// Kernel parameters that reproduce the original loops; the library always uses these,
+// dadafits can choose others at startup, see autotune.c
+#define DEINTERLEAVE_BLOCK_DEFAULT 1
+#define DEINTERLEAVE_PREFETCH_DEFAULT 0
+#define DOWNSAMPLE_PREFETCH_DEFAULT 0
+#define SYNTHESIZE_TIME_OUTER_DEFAULT 0
+
+/**
+ * Deinterleave (transpose) a range of channels of an IQUV ring buffer page to the ordering needed for FITS files
+ * See dadafits_deinterleave for the layout of the page and the transposed buffer.
+ *
+ *  @param {const uchar[]} page         Ringbuffer page with interleaved data
+ *  @param {uchar[]}       transposed   Output buffer. Size: ntabs*NCHANNELS*NPOLS*ntimes
+ *  @param {int}           ntabs        Number of TABs in the page
+ *  @param {int}           ntimes       Number of samples per page, a multiple of PACKET_NTIMES
+ *  @param {int}           first        First channel, a multiple of 4 * block
+ *  @param {int}           last         Last channel, exclusive, a multiple of 4 * block
+ *  @param {int}           block        Number of packets (of 4 channels) processed together, must divide NCHANNELS / 4;
+ *                                      1 processes the page linearly
+ *  @param {int}           prefetch     Bytes to prefetch ahead in each packet, 0 for none
+ */
+DADAFITS_INLINE void deinterleave_channels(const unsigned char *page, unsigned char *transposed, const int ntabs, const int ntimes,
+    const int first, const int last, const int block, const int prefetch) {
+  const int sequence_length = ntimes / PACKET_NTIMES;
+  const long packet_size = PACKET_NTIMES * 4 * NPOLS;
+
+  // Tranpose by processing a block of original packets from the page at a time,
+  // so consecutive writes in the transposed buffer are close together
+  int tab;
+  for (tab = 0; tab < ntabs; tab++) {
+    int channel_offset;
+    for (channel_offset = first; channel_offset < last; channel_offset += 4 * block) {
+      int sequence_number;
+      for (sequence_number = 0; sequence_number < sequence_length; sequence_number++) {
+        int tn,b,cn,pn;
+        for (tn = 0; tn < PACKET_NTIMES; tn++) { // 500 samples per packet
+          // find the matching address in the transposed buffer
+          unsigned char *sample = &transposed[(tab * ntimes + sequence_number * PACKET_NTIMES + tn) * NPOLS * NCHANNELS];
+
+          for (b = 0; b < block; b++) {
+            const int channel = channel_offset + 4 * b;
+            const unsigned char *packet = &page[
+              (((long) tab * (NCHANNELS / 4) + channel / 4) * sequence_length + sequence_number) * packet_size +
+              tn * 4 * NPOLS];
+            if (prefetch) {
+              __builtin_prefetch(packet + prefetch);
+            }
+
+            for (cn = 0; cn < 4; cn++) { // 4 channels per packet
+              for (pn = 0; pn < NPOLS; pn++) {
+                sample[(NPOLS - 1 - pn) * NCHANNELS + NCHANNELS - 1 - (channel + cn)] = *packet++;
+              }
+            }
+          }
+        }
+      }
+    }
+  }
+}
+
+/**
+ * Deinterleave (transpose) an IQUV ring buffer page to the ordering needed for FITS files
+ * See deinterleave_channels.
+ */
+DADAFITS_INLINE void deinterleave_page(const unsigned char *page, unsigned char *transposed, const int ntabs, const int ntimes,
+    const int block, const int prefetch) {
+  deinterleave_channels(page, transposed, ntabs, ntimes, 0, NCHANNELS, block, prefetch);
+}
+
+/**
+ * Assemble a synthesized beam from subbands of the deinterleaved TABs
+ * See dadafits_synthesize.
+ *
+ *  @param {const uchar[]} transposed     Deinterleaved TABs
+ *  @param {const int[]}   subband_tabs   For each subband the TAB to use, must be valid
+ *  @param {uchar[]}       synthesized    Output buffer for one beam. Size: NCHANNELS*NPOLS*ntimes
+ *  @param {int}           ntimes         Number of samples per page
+ *  @param {int}           time_outer     0: copy one subband at a time, 1: one sample at a time, writing the output sequentially
+ */
+DADAFITS_INLINE void synthesize_beam(const unsigned char *transposed, const int *subband_tabs, unsigned char *synthesized, const int ntimes,
+    const int time_outer) {
+  int tn; // current time
+  int pn; // current pol
+  int band; // current subband
+
+// copy the 48 frequencies of a subband to output
+#define SYNTHESIZE_COPY(tab, tn, pn, band) \
+  memcpy( \
+    &synthesized[ \
+      tn * NPOLS * NCHANNELS + pn * NCHANNELS + \
+      (NSUBBANDS - 1 - band) * FREQS_PER_SUBBAND \
+    ], \
+    &transposed[ \
+      tab * ntimes * NPOLS * NCHANNELS + tn * NPOLS * NCHANNELS + \
+      pn * NCHANNELS + (NSUBBANDS - 1 - band) * FREQS_PER_SUBBAND \
+    ], \
+    FREQS_PER_SUBBAND \
+  )
+
+  if (time_outer) {
+    for (tn = 0; tn < ntimes; tn++) {
+      for (pn = 0; pn < NPOLS; pn++ ) {
+        for (band = 0; band < NSUBBANDS; band++) {
+          SYNTHESIZE_COPY(subband_tabs[band], tn, pn, band);
+        }
+      }
+    }
+    return;
+  }
+
+  // a subband contains 1536/32=48 frequencies from a TAB
+  for (band = 0; band < NSUBBANDS; band++) {
+    int tab = subband_tabs[band];
+
+    // for each time and polarisation, copy the 48 frequencies of this subband to output
+    for (tn = 0; tn < ntimes; tn++) {
+      for (pn = 0; pn < NPOLS; pn++ ) {
+        SYNTHESIZE_COPY(tab, tn, pn, band);
+      }
+    }
+  }
+#undef SYNTHESIZE_COPY
+}
+
+/**
+ * Assemble a range of samples of a weighted synthesized beam from the deinterleaved TABs
+ *
+ * Every output sample is the weighted mean of the TABs of its subband, rounded; the sum of
+ * the weights is written as the scale, see synthesized_beam_terms. The products are
+ * accumulated in 32 bits, and divided by multiplication with a 40 bit reciprocal, which is
+ * exact as the sum of the (relative) weights is at most SUBBAND_TERMS_MAX * SUBBAND_WEIGHT_ONE.
+ * Subbands from a single TAB are copied.
+ *
+ *  @param {const uchar[]} transposed         Deinterleaved TABs
+ *  @param {const subband_terms_t[]} terms    For each subband the TABs and weights, TABs must be valid
+ *  @param {uchar[]}       synthesized        Output buffer for one beam. Size: NCHANNELS*NPOLS*ntimes
+ *  @param {int}           ntimes             Number of samples per page
+ *  @param {int}           first              First sample
+ *  @param {int}           last               Last sample, exclusive
+ */
+DADAFITS_INLINE void synthesize_weighted_beam(const unsigned char *transposed, const subband_terms_t *terms, unsigned char *synthesized,
+    const int ntimes, const int first, const int last) {
+  unsigned int acc[FREQS_PER_SUBBAND];
+  int tn, pn, band, k, f;
+
+  for (band = 0; band < NSUBBANDS; band++) {
+    const subband_terms_t *subband = &terms[band];
+    const int channel = (NSUBBANDS - 1 - band) * FREQS_PER_SUBBAND;
+
+    if (subband->nterms == 1) {
+      for (tn = first; tn < last; tn++) {
+        for (pn = 0; pn < NPOLS; pn++) {
+          const long sample = tn * NPOLS * NCHANNELS + pn * NCHANNELS + channel;
+          memcpy(&synthesized[sample], &transposed[subband->tabs[0] * ntimes * NPOLS * NCHANNELS + sample], FREQS_PER_SUBBAND);
+        }
+      }
+      continue;
+    }
+
+    unsigned int total = 0;
+    for (k = 0; k < subband->nterms; k++) {
+      total += subband->weights[k];
+    }
+    const unsigned long long reciprocal = (1ULL << 40) / total + 1;
+
+    for (tn = first; tn < last; tn++) {
+      for (pn = 0; pn < NPOLS; pn++) {
+        const long sample = tn * NPOLS * NCHANNELS + pn * NCHANNELS + channel;
+
+        for (f = 0; f < FREQS_PER_SUBBAND; f++) {
+          acc[f] = total / 2;
+        }
+        for (k = 0; k < subband->nterms; k++) {
+          const unsigned char *tab = &transposed[subband->tabs[k] * ntimes * NPOLS * NCHANNELS + sample];
+          const unsigned int weight = subband->weights[k];
+          for (f = 0; f < FREQS_PER_SUBBAND; f++) {
+            acc[f] += weight * tab[f];
+          }
+        }
+
+        // the mean cannot exceed 255; the saturating narrow keeps it that way for any rounding
+        unsigned char *out = &synthesized[sample];
+        for (f = 0; f < FREQS_PER_SUBBAND; f++) {
+          const unsigned long long value = (acc[f] * reciprocal) >> 40;
+          out[f] = value > 255 ? 255 : value;
+        }
+      }
+    }
+  }
+}
+
+/**
+ * Downsample a range of channels of one TAB of a Stokes I page, by summation over time and frequency
+ * See downsample_sc3 and downsample_sc4.
+ *
+ * @param {uchar[NCHANNELS, padded_size]} buffer        Buffer page to downsample
+ * @param {int} padded_size                             Size of fastest dimension
+ * @param {uint[NCHANNELS_LOW, NTIMES_LOW]} downsampled Output array, only the channels first .. last-1 are set
+ * @param {int} first                                   First downsampled channel
+ * @param {int} last                                    Last downsampled channel, exclusive
+ * @param {int} downsample_time                         Number of samples summed in time
+ * @param {int} prefetch                                Bytes to prefetch ahead in each channel, 0 for none
+ */
+DADAFITS_INLINE void downsample_channels(const unsigned char *buffer, const int padded_size, unsigned int *downsampled,
+    const int first, const int last, const int downsample_time, const int prefetch) {
+  unsigned int *temp1 = &downsampled[first * NTIMES_LOW];
+  int dc; // downsampled channel
+  int dt; // downsampled time
+  int t; // full time
+
+  for (dc=first; dc < last; dc++) {
+    // pointer to next sample in the two channels
+    unsigned const char *s0 = &buffer[((dc << 1) + 0) * padded_size];
+    unsigned const char *s1 = &buffer[((dc << 1) + 1) * padded_size];
+
+    for (dt=0; dt < NTIMES_LOW; dt++) {
+      // partial sums (per channel)
+      unsigned int ps0 = 0;
+      unsigned int ps1 = 0;
+
+      if (prefetch) {
+        __builtin_prefetch(s0 + prefetch);
+        __builtin_prefetch(s1 + prefetch);
+      }
+
+      for (t=0; t < downsample_time; t++) {
+        ps0 += *s0++;
+        ps1 += *s1++;
+      }
+      *temp1++ = ps0 + ps1;
+    }
+  }
+}
+
+// Corrections on the downsampled data keep values within 16 bits, so squares fit in an unsigned int
+#define DOWNSAMPLED_MAX 65535
+
+// Level of every channel after bandpass flattening
+#define FLATTEN_LEVEL 1024
+
+/**
+ * Flatten the bandpass: scale a range of downsampled channels to the same average, FLATTEN_LEVEL
+ * Channels without signal are left as they are.
+ *
+ * @param {uint[NCHANNELS_LOW, NTIMES_LOW]} downsampled Downsampled data, changed in place
+ * @param {int} first                                   First downsampled channel
+ * @param {int} last                                    Last downsampled channel, exclusive
+ */
+DADAFITS_INLINE void flatten_channels(unsigned int *downsampled, const int first, const int last) {
+  int dc, dt;
+
+  for (dc = first; dc < last; dc++) {
+    unsigned int *temp1 = &downsampled[dc * NTIMES_LOW];
+    unsigned long long sum = 0;
+    for (dt = 0; dt < NTIMES_LOW; dt++) {
+      sum += temp1[dt];
+    }
+    if (sum < NTIMES_LOW) {
+      continue;
+    }
+
+    // 16.16 fixed point gain
+    const unsigned long long gain = ((unsigned long long) FLATTEN_LEVEL << 16) * NTIMES_LOW / sum;
+    for (dt = 0; dt < NTIMES_LOW; dt++) {
+      const unsigned long long value = (temp1[dt] * gain) >> 16;
+      temp1[dt] = value > DOWNSAMPLED_MAX ? DOWNSAMPLED_MAX : value;
+    }
+  }
+}
+
+/**
+ * Zero-DM, first step: sum over all channels per sample, for a range of samples
+ *
+ * @param {uint[NCHANNELS_LOW, NTIMES_LOW]} downsampled Downsampled data
+ * @param {int} first                                   First sample
+ * @param {int} last                                    Last sample, exclusive
+ * @param {ulonglong[NTIMES_LOW]} level                 Output: sum over channels, for the samples in the range
+ */
+DADAFITS_INLINE void zero_dm_levels(const unsigned int *downsampled, const int first, const int last, unsigned long long *level) {
+  int dc, dt;
+
+  for (dt = first; dt < last; dt++) {
+    level[dt] = 0;
+  }
+  // channel by channel, so the inner loop is contiguous
+  for (dc = 0; dc < NCHANNELS_LOW; dc++) {
+    const unsigned int *temp1 = &downsampled[dc * NTIMES_LOW];
+    for (dt = first; dt < last; dt++) {
+      level[dt] += temp1[dt];
+    }
+  }
+}
+
+/**
+ * Zero-DM, second step: subtract the mean over channels from every sample, for a range of channels
+ * The average over the page is added back, so the values stay positive; they are clipped at 0 and DOWNSAMPLED_MAX.
+ *
+ * @param {uint[NCHANNELS_LOW, NTIMES_LOW]} downsampled Downsampled data, changed in place
+ * @param {int} first                                   First downsampled channel
+ * @param {int} last                                    Last downsampled channel, exclusive
+ * @param {ulonglong[NTIMES_LOW]} level                 Sum over channels per sample, from zero_dm_levels
+ * @param {ulonglong} average                           Sum over channels, averaged over the page
+ */
+DADAFITS_INLINE void zero_dm_channels(unsigned int *downsampled, const int first, const int last,
+    const unsigned long long *level, const unsigned long long average) {
+  int dc, dt;
+
+  for (dc = first; dc < last; dc++) {
+    unsigned int *temp1 = &downsampled[dc * NTIMES_LOW];
+    for (dt = 0; dt < NTIMES_LOW; dt++) {
+      const long long value = (long long) temp1[dt] + ((long long) average - (long long) level[dt]) / NCHANNELS_LOW;
+      temp1[dt] = value < 0 ? 0 : value > DOWNSAMPLED_MAX ? DOWNSAMPLED_MAX : value;
+    }
+  }
+}
+
+// total power samples per monitoring bin
+#define MONITOR_BIN (NTIMES_LOW / DADAFITS_MONITOR_NPOWER)
+
+/**
+ * First and second pass of the 1-bit packing, for a range of channels:
+ * set offset and scale, and replace the downsampled data by 0 (below or equal to average) or 1 (above average)
+ * See dadafits_pack.
+ *
+ * The moments are exact 64-bit integers, and the threshold is their integer quotient,
+ * so the result does not depend on how the compiler orders the sums. Only offset and scale are
+ * converted to floating point, once per channel.
+ *
+ *   @param {dadafits_context_t *} ctx      Context, offset and scale are set for each channel in the range
+ *   @param {uint[]} downsampled            [NCHANNELS_LOW * NTIMES_LOW], overwritten for the channels in the range
+ *   @param {int} first                     First downsampled channel
+ *   @param {int} last                      Last downsampled channel, exclusive
+ *   @param {dadafits_monitor_t *} monitor  Optional, bandpass and rms are set for the channels in the range
+ *   @param {ulonglong[]} power             With monitor: total power per bin is added, [DADAFITS_MONITOR_NPOWER]
+ *   @param {ulong *} ones                  With monitor: number of bits set is added
+ *   @returns {int}                         Number of channels without variance
+ */
+DADAFITS_INLINE int pack_statistics(const dadafits_context_t *ctx, unsigned int *downsampled, const int first, const int last,
+    dadafits_monitor_t *monitor, unsigned long long *power, unsigned long *ones) {
+  unsigned int *temp1;
+  int flat = 0;
+
+  int dc;
+  for (dc = first; dc < last; dc++) {
+
+    // First pass: calculate the moments
+    temp1 = &downsampled[dc * NTIMES_LOW];
+
+    // maxium value of a downsampled sample is 255 * 10 * 2 = 5,100, or DOWNSAMPLED_MAX after corrections
+    // Sum: at most 1250 * 65,535 = 81,918,750
+    // Sos: at most 1250 * 65,535 * 65,535 = 5,368,545,281,250
+    // N * sos and sum * sum are below 10^16, within an unsigned long long
+    unsigned long long sum = 0;
+    unsigned long long sos = 0;
+
+    int dt;
+    for (dt=0; dt < NTIMES_LOW; dt++) {
+      sos += (*temp1) * (*temp1);
+      sum += *temp1++;
+    }
+    if (monitor) {
+      // total power, summed over channels in coarse time bins
+      temp1 = &downsampled[dc * NTIMES_LOW];
+      for (dt=0; dt < NTIMES_LOW; dt++) {
+        power[dt / MONITOR_BIN] += *temp1++;
+      }
+    }
+
+    // N^2 times the variance, exact and never negative
+    const unsigned long long variance = NTIMES_LOW * sos - sum * sum;
+    if (variance == 0) {
+      flat++;
+    }
+
+    // average(=offset) and stdev(=scale)
+    const float avg = sum / (double) NTIMES_LOW;
+    const float std = sqrt((double) variance) / NTIMES_LOW;
+
+    // Second pass: convert to 1 bit
+    // 0: below average, represented by nummerical value avg-std
+    // 1: above average, represented by nummerical value avg+std
+    // Take care of high-to-low frequency order in packed array
+    ctx->offset[NCHANNELS_LOW-1-dc] = avg - std;
+    ctx->scale[NCHANNELS_LOW-1-dc]  = 2.0 * std;
+
+    // integer part of the average
+    const unsigned int cutoff = sum / NTIMES_LOW;
+
+    temp1 = &downsampled[dc * NTIMES_LOW];
+    for (dt=0; dt < NTIMES_LOW; dt++) {
+      *temp1 = *temp1 > cutoff ? 1 : 0;
+      if (monitor) {
+        *ones += *temp1;
+      }
+      temp1++;
+    }
+
+    if (monitor) {
+      monitor->bandpass[NCHANNELS_LOW-1-dc] = avg;
+      monitor->rms[NCHANNELS_LOW-1-dc] = std;
+    }
+  }
+
+  return flat;
+}
+
+/**
+ * Downsample a range of channels and convert to 1 bit in the same pass, with thresholds known beforehand;
+ * also sum the downsampled values, to update running statistics. See downsample_channels.
+ *
+ * @param {uchar[NCHANNELS, padded_size]} buffer        Buffer page to downsample
+ * @param {int} padded_size                             Size of fastest dimension
+ * @param {uint[NCHANNELS_LOW, NTIMES_LOW]} downsampled Output array, 0 or 1, only the channels first .. last-1 are set
+ * @param {int} first                                   First downsampled channel
+ * @param {int} last                                    Last downsampled channel, exclusive
+ * @param {int} downsample_time                         Number of samples summed in time
+ * @param {int} prefetch                                Bytes to prefetch ahead in each channel, 0 for none
+ * @param {uint[NCHANNELS_LOW]} cutoff                  Per channel: values above the cutoff become 1
+ * @param {ulonglong[NCHANNELS_LOW]} sum                Per channel: set to the sum of the downsampled values
+ * @param {ulonglong[NCHANNELS_LOW]} sos                Per channel: set to the sum of squares of the downsampled values
+ */
+DADAFITS_INLINE void downsample_threshold_channels(const unsigned char *buffer, const int padded_size, unsigned int *downsampled,
+    const int first, const int last, const int downsample_time, const int prefetch,
+    const unsigned int *cutoff, unsigned long long *sum, unsigned long long *sos) {
+  unsigned int *temp1 = &downsampled[first * NTIMES_LOW];
+  int dc; // downsampled channel
+  int dt; // downsampled time
+  int t; // full time
+
+  for (dc=first; dc < last; dc++) {
+    // pointer to next sample in the two channels
+    unsigned const char *s0 = &buffer[((dc << 1) + 0) * padded_size];
+    unsigned const char *s1 = &buffer[((dc << 1) + 1) * padded_size];
+    const unsigned int c = cutoff[dc];
+    unsigned long long channel_sum = 0;
+    unsigned long long channel_sos = 0;
+
+    for (dt=0; dt < NTIMES_LOW; dt++) {
+      // partial sums (per channel)
+      unsigned int ps0 = 0;
+      unsigned int ps1 = 0;
+
+      if (prefetch) {
+        __builtin_prefetch(s0 + prefetch);
+        __builtin_prefetch(s1 + prefetch);
+      }
+
+      for (t=0; t < downsample_time; t++) {
+        ps0 += *s0++;
+        ps1 += *s1++;
+      }
+      const unsigned int value = ps0 + ps1;
+      channel_sum += value;
+      channel_sos += value * value;
+      *temp1++ = value > c ? 1 : 0;
+    }
+    sum[dc] = channel_sum;
+    sos[dc] = channel_sos;
+  }
+}
+
+/**
+ * Convert a range of downsampled channels to 1 bit, with thresholds known beforehand;
+ * also sum the downsampled values, to update running statistics. See downsample_threshold_channels.
+ */
+DADAFITS_INLINE void threshold_channels(unsigned int *downsampled, const int first, const int last,
+    const unsigned int *cutoff, unsigned long long *sum, unsigned long long *sos) {
+  unsigned int *temp1 = &downsampled[first * NTIMES_LOW];
+  int dc, dt;
+
+  for (dc=first; dc < last; dc++) {
+    const unsigned int c = cutoff[dc];
+    unsigned long long channel_sum = 0;
+    unsigned long long channel_sos = 0;
+
+    for (dt=0; dt < NTIMES_LOW; dt++) {
+      const unsigned int value = *temp1;
+      channel_sum += value;
+      channel_sos += value * value;
+      *temp1++ = value > c ? 1 : 0;
+    }
+    sum[dc] = channel_sum;
+    sos[dc] = channel_sos;
+  }
+}
+
+/**
+ * Set the totals of the monitoring data, after pack_statistics for all channels
+ */
+DADAFITS_INLINE void pack_monitor_totals(dadafits_monitor_t *monitor, const unsigned long long *power, const unsigned long ones) {
+  int bin;
+  for (bin = 0; bin < DADAFITS_MONITOR_NPOWER; bin++) {
+    monitor->power[bin] = power[bin] / (1.0 * NCHANNELS_LOW * MONITOR_BIN);
+  }
+  monitor->bits_set = ones / (1.0 * NCHANNELS_LOW * NTIMES_LOW);
+}
+
+/**
+ * Third pass of the 1-bit packing, for a range of samples:
+ * pack bits in bytes, transpose to time-frequency order, order frequencies from high to low
+ * packing requires NCHANNELS_LOW is divisible by 8
+ *
+ *   @param {uint[]}  downsampled   [NCHANNELS_LOW * NTIMES_LOW], after pack_statistics
+ *   @param {uchar[]} packed        [NCHANNELS_LOW * NTIMES_LOW / 8], only the samples in the range are set
+ *   @param {int} first             First sample
+ *   @param {int} last              Last sample, exclusive
+ */
+DADAFITS_INLINE void pack_bits(const unsigned int *downsampled, unsigned char *packed, const int first, const int last) {
+  const unsigned int *temp1;
+  unsigned char *temp2;
+
+  int dt, dc;
+  for (dt=first; dt < last; dt++) {
+    for (dc=0; dc < NCHANNELS_LOW; dc+=8) {
+      // position in (transposed) packed array 
+      temp2 = &packed[(dt * NCHANNELS_LOW + (dc)) / 8];
+      // start point in downsampled array: the lowest of the 8 frequencies in this byte,
+      // as the downsampled array has frequencies low-to-high
+      temp1 = &downsampled[(NCHANNELS_LOW - 8 - dc) * NTIMES_LOW + dt];
+      // do the packing; jump to next channel in input array after each step
+      // LSB is lowest channel to comply with high->low frequency order in output
+      *temp2  = *temp1 ? 1     : 0;
+      temp1 += NTIMES_LOW;
+      *temp2 += *temp1 ? 1 << 1: 0;
+      temp1 += NTIMES_LOW;
+      *temp2 += *temp1 ? 1 << 2: 0;
+      temp1 += NTIMES_LOW;
+      *temp2 += *temp1 ? 1 << 3: 0;
+      temp1 += NTIMES_LOW;
+      *temp2 += *temp1 ? 1 << 4: 0;
+      temp1 += NTIMES_LOW;
+      *temp2 += *temp1 ? 1 << 5: 0;
+      temp1 += NTIMES_LOW;
+      *temp2 += *temp1 ? 1 << 6: 0;
+      temp1 += NTIMES_LOW;
+      *temp2 += *temp1 ? 1 << 7: 0;
+    }
+  }
+}
+
+#endif
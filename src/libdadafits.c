@@ -0,0 +1,48 @@
+/**
+ * libdadafits context handling
+ */
+#include "config.h"
+#include "dadafits_internal.h"
+
+/**
+ * Set up a context for the given observation
+ *
+ * @param {dadafits_context_t *} ctx  Context to initialize
+ * @param {int} science_case          3 or 4
+ * @param {int} science_mode          0: I+TAB, 1: IQUV+TAB, 2: I+IAB, 3: IQUV+IAB
+ * @param {int} padded_size           Length of the fastest dimension of a Stokes I page
+ * @returns {int}                     0 on success, -1 for an unsupported science case or mode
+ */
+int dadafits_context_init(dadafits_context_t *ctx, const int science_case, const int science_mode, const int padded_size) {
+  switch (science_case) {
+    case 3:
+      ctx->ntabs = 9;
+      ctx->ntimes = SC3_NTIMES;
+      break;
+    case 4:
+      ctx->ntabs = 12;
+      ctx->ntimes = SC4_NTIMES;
+      break;
+    default:
+      return -1;
+  }
+
+  if (science_mode < 0 || science_mode > 3) {
+    return -1;
+  }
+  if (science_mode == 2 || science_mode == 3) {
+    // IAB: only a single beam
+    ctx->ntabs = 1;
+  }
+
+  ctx->science_case = science_case;
+  ctx->science_mode = science_mode;
+  ctx->padded_size = padded_size;
+  ctx->sequence_length = ctx->ntimes / PACKET_NTIMES;
+
+  return 0;
+}
+
+const char *dadafits_library_version() {
+  return VERSION;
+}
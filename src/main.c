@@ -14,6 +14,8 @@
 #include <string.h>
 #include <getopt.h>
 #include <signal.h>
+#include <unistd.h>
+#include <math.h>
 
 #include "dada_hdu.h"
 #include "ascii_header.h"
@@ -45,18 +47,178 @@ double mjd_start;
 double lst_start;
 float az_start;
 float za_start;
+long obs_offset; // bytes
+char *input_header = NULL;
 
 // Variables set from commandline
 int make_synthesized_beams = 0;
+char *staging_directory = NULL; // write to here first, then migrate to the output directory
+float migrate_rate = 100.0;     // MB/s bandwidth budget for migration
+float write_rate = 0.0;         // MB/s write budget for all beams together, 0 for unlimited
+char *write_priority = NULL;    // beams exempt from the write budget
+int resume = 0;                 // continue writing existing output files
+char *input_file = NULL;        // read from a .dada file instead of a ringbuffer
+long first_page = 0;            // first page to process
+long last_page = -1;            // last page to process (inclusive), -1 for all
+float start_time = -1;          // alternative to first_page, in seconds
+float end_time = -1;            // alternative to last_page, in seconds
+int output_format = OUTPUT_FITS;
+int nthreads = 0;               // worker threads, 0 for all processors
+char *output_key = NULL;        // publish the product to this ringbuffer
+int view_mode = 0;              // tap the ringbuffer as passive viewer instead of reader
+int partition_index = 0;        // share the synthesized beams with other processes: this one
+int partition_count = 0;        // and the total number, 0 when not sharing
+char *batch_directory = NULL;   // process all recordings below this directory
+int batch_jobs = 0;             // concurrent batch jobs, 0 for one per 4 processors
+float batch_memory = 0;         // MB memory budget for all batch jobs, 0 for half the physical memory
+char *monitor_file = NULL;      // append bandpass and total power per page to this file
+char *fold_ephemeris = NULL;    // fold the data with this ephemeris
+int fold_subint_pages = 10;     // pages per folded sub-integration
+char *autotune_file = NULL;     // calibrate the kernels, and cache the parameters per host in this file
+float ewma_alpha = 0;           // Stokes I: weight of a new page in the running statistics, 0 for per page statistics
+int zero_dm = 0;                // Stokes I: subtract the mean over channels from every sample
+int flatten_bandpass = 0;       // Stokes I: scale all channels to the same average
+float close_timeout = 0;        // seconds to wait for the output files to be closed, 0 for unlimited
+int drain_timeout = 0;          // seconds from SIGTERM or SIGINT until a hard exit, 0 for unlimited
+int perf_counters = 0;          // count cycles, instructions, and cache misses per stage
+char *perf_output = NULL;       // write the counts per stage and thread to this file
 
-// Memory buffers
-unsigned int downsampled[NCHANNELS_LOW * NTIMES_LOW];
-unsigned char packed[NCHANNELS_LOW * NTIMES_LOW / 8];
-unsigned char *transposed = NULL; // Stokes IQUV buffer of approx 2 GB, allocated only when necessary
-unsigned char *synthesized = NULL; // Stokes IQUV for a single synthesized beam
+// Long-only commandline options
+enum {
+  OPT_STAGING = 256,
+  OPT_MIGRATE_RATE,
+  OPT_WRITE_RATE,
+  OPT_WRITE_PRIORITY,
+  OPT_RESUME,
+  OPT_INPUT,
+  OPT_FIRST_PAGE,
+  OPT_LAST_PAGE,
+  OPT_START_TIME,
+  OPT_END_TIME,
+  OPT_FORMAT,
+  OPT_THREADS,
+  OPT_OUTPUT_KEY,
+  OPT_VIEW,
+  OPT_PARTITION,
+  OPT_BATCH,
+  OPT_BATCH_JOBS,
+  OPT_BATCH_MEMORY,
+  OPT_MONITOR,
+  OPT_FOLD,
+  OPT_FOLD_SUBINT,
+  OPT_AUTOTUNE,
+  OPT_EWMA,
+  OPT_ZERO_DM,
+  OPT_FLATTEN_BANDPASS,
+  OPT_CLOSE_TIMEOUT,
+  OPT_DRAIN_TIMEOUT,
+  OPT_PERF,
+  OPT_PERF_FILE
+};
+
+static struct option long_options[] = {
+  {"staging",      required_argument, NULL, OPT_STAGING},
+  {"migrate-rate", required_argument, NULL, OPT_MIGRATE_RATE},
+  {"write-rate",   required_argument, NULL, OPT_WRITE_RATE},
+  {"write-priority", required_argument, NULL, OPT_WRITE_PRIORITY},
+  {"resume",       no_argument,       NULL, OPT_RESUME},
+  {"input",        required_argument, NULL, OPT_INPUT},
+  {"first-page",   required_argument, NULL, OPT_FIRST_PAGE},
+  {"last-page",    required_argument, NULL, OPT_LAST_PAGE},
+  {"start-time",   required_argument, NULL, OPT_START_TIME},
+  {"end-time",     required_argument, NULL, OPT_END_TIME},
+  {"format",       required_argument, NULL, OPT_FORMAT},
+  {"threads",      required_argument, NULL, OPT_THREADS},
+  {"output-key",   required_argument, NULL, OPT_OUTPUT_KEY},
+  {"view",         no_argument,       NULL, OPT_VIEW},
+  {"partition",    required_argument, NULL, OPT_PARTITION},
+  {"batch",        required_argument, NULL, OPT_BATCH},
+  {"batch-jobs",   required_argument, NULL, OPT_BATCH_JOBS},
+  {"batch-memory", required_argument, NULL, OPT_BATCH_MEMORY},
+  {"monitor",      required_argument, NULL, OPT_MONITOR},
+  {"fold",         required_argument, NULL, OPT_FOLD},
+  {"fold-subint",  required_argument, NULL, OPT_FOLD_SUBINT},
+  {"autotune",     required_argument, NULL, OPT_AUTOTUNE},
+  {"ewma",         required_argument, NULL, OPT_EWMA},
+  {"zero-dm",      no_argument,       NULL, OPT_ZERO_DM},
+  {"flatten-bandpass", no_argument,   NULL, OPT_FLATTEN_BANDPASS},
+  {"close-timeout", required_argument, NULL, OPT_CLOSE_TIMEOUT},
+  {"drain-timeout", required_argument, NULL, OPT_DRAIN_TIMEOUT},
+  {"perf",         no_argument,       NULL, OPT_PERF},
+  {"perf-file",    required_argument, NULL, OPT_PERF_FILE},
+  {NULL, 0, NULL, 0}
+};
+
+// Kernel parameters for libdadafits
+dadafits_context_t kernel_context;
 
 // Runtime counters
 long page_count = 0;
+long view_skipped = 0;     // pages missed because the writer overtook the viewer
+long view_start = -1;      // ringbuffer buffer count at start-of-data of this transfer
+long view_overwritten = 0; // pages reused by the writer while the viewer was processing them
+long pages_processed = 0;
+
+// Set by SIGTERM or SIGINT: stop reading pages, finish the current one, and close the files
+static volatile sig_atomic_t stop_signal = 0;
+
+// Set when the current page did not finish within --drain-timeout: the pipeline skips the remaining beams
+volatile sig_atomic_t drain_expired = 0;
+
+/**
+ * Signal handler: request a graceful stop
+ * Only sets a flag; a second signal terminates immediately (SA_RESETHAND).
+ * With --drain-timeout, the alarm bounds the time left to finish the current page;
+ * closing the files is bounded by --close-timeout instead.
+ */
+static void request_stop(int sig) {
+  stop_signal = sig;
+  if (drain_timeout > 0) {
+    alarm(drain_timeout);
+  }
+}
+
+/**
+ * Signal handler: the current page took too long
+ * Abandons the rest of the page, so the files can still be closed; when the pipeline is stuck
+ * and the alarm expires a second time, exits without closing the files.
+ */
+static void drain_alarm(int sig) {
+  static const char abandon[] = "Error: drain timeout expired, abandoning the current page\n";
+  static const char message[] = "Error: drain timeout expired twice, exiting without closing the output files\n";
+
+  if (! drain_expired) {
+    drain_expired = 1;
+    if (write(STDOUT_FILENO, abandon, sizeof(abandon) - 1) < 0) {
+      // nothing to do
+    }
+    alarm(drain_timeout);
+    return;
+  }
+  if (write(STDOUT_FILENO, message, sizeof(message) - 1) < 0) {
+    // nothing left to do
+  }
+  _exit(EXIT_FAILURE);
+}
+
+/**
+ * Install the handlers for a graceful stop
+ * Without SA_RESTART, so a blocking read of the ringbuffer returns when the signal arrives.
+ */
+static void trap_stop_signals() {
+  struct sigaction action;
+
+  memset(&action, 0, sizeof(action));
+  sigemptyset(&action.sa_mask);
+  action.sa_handler = request_stop;
+  action.sa_flags = SA_RESETHAND;
+  sigaction(SIGTERM, &action, NULL);
+  sigaction(SIGINT, &action, NULL);
+
+  action.sa_handler = drain_alarm;
+  action.sa_flags = 0;
+  sigaction(SIGALRM, &action, NULL);
+}
 
 /**
  * Open a connection to the ringbuffer
@@ -86,8 +248,14 @@ dada_hdu_t *init_ringbuffer(char *key) {
   }
 
   // Make data buffers readable
-  if (dada_hdu_lock_read(hdu) < 0) {
-    LOG("ERROR in dada_hdu_open_view\n");
+  if (view_mode) {
+    // passive: follow the writer without taking the read lock
+    if (dada_hdu_open_view(hdu) < 0) {
+      LOG("ERROR in dada_hdu_open_view\n");
+      exit(EXIT_FAILURE);
+    }
+  } else if (dada_hdu_lock_read(hdu) < 0) {
+    LOG("ERROR in dada_hdu_lock_read\n");
     exit(EXIT_FAILURE);
   }
 
@@ -101,7 +269,35 @@ dada_hdu_t *init_ringbuffer(char *key) {
     exit(EXIT_FAILURE);
   }
 
-  // parse header
+  header_incomplete = parse_header(header);
+
+  // tell the ringbuffer the header has been read
+  if (! view_mode && ipcbuf_mark_cleared(hdu->header_block) < 0) {
+    LOG("ERROR. Cannot mark the header as cleared\n");
+    exit(EXIT_FAILURE);
+  }
+
+  LOG("psrdada HEADER:\n%s\n", header);
+
+  if (header_incomplete) {
+    exit(EXIT_FAILURE);
+  }
+
+  return hdu;
+}
+
+/**
+ * Parse the psrdada header and set the observation parameters
+ *
+ * @param {char *} header   The header block
+ * @returns {int}           0 on success, 1 when required keys are missing
+ */
+int parse_header(char *header) {
+  int header_incomplete = 0;
+
+  // keep a copy, to pass on to the output ringbuffer
+  input_header = strdup(header);
+
   if (ascii_header_get(header, "MIN_FREQUENCY", "%f", &min_frequency) == -1) {
     LOG("ERROR. MIN_FREQUENCY not set in dada buffer\n");
     header_incomplete = 1;
@@ -166,20 +362,85 @@ dada_hdu_t *init_ringbuffer(char *key) {
     LOG("ERROR. PARSET not set in dada buffer\n");
     header_incomplete = 1;
   }
-
-  // tell the ringbuffer the header has been read
-  if (ipcbuf_mark_cleared(hdu->header_block) < 0) {
-    LOG("ERROR. Cannot mark the header as cleared\n");
-    exit(EXIT_FAILURE);
+  if (ascii_header_get(header, "OBS_OFFSET", "%li", &obs_offset) == -1) {
+    // optional, only set for recordings split over several files
+    obs_offset = 0;
   }
 
+  return header_incomplete;
+}
+
+/**
+ * Open a recorded observation
+ *
+ * @param {char *} fname  The .dada file to read
+ */
+void init_file(char *fname) {
+  char *header = dada_file_open(fname);
+
+  int header_incomplete = parse_header(header);
   LOG("psrdada HEADER:\n%s\n", header);
+  free(header);
 
   if (header_incomplete) {
     exit(EXIT_FAILURE);
   }
+}
 
-  return hdu;
+/**
+ * Tell the ringbuffer we are done with the current page
+ * Viewers leave the page to the primary reader, which waits for the other partitions
+ */
+void release_page(ipcbuf_t *data_block) {
+  partition_release(page_count);
+
+  if (! view_mode) {
+    ipcbuf_mark_cleared(data_block);
+  }
+}
+
+static void write_output(const int tab, const int channels, const int pols, const long page_index, const int rowlength, unsigned char *data, const float telaz, const float telza) {
+  dada_sink_write(tab, channels, pols, rowlength, data);
+
+  if (output_format == OUTPUT_NONE) {
+    return;
+  }
+#ifdef HAVE_HDF5
+  if (output_format == OUTPUT_HDF5) {
+    write_hdf5(tab, channels, pols, page_index, rowlength, data, telaz, telza);
+    return;
+  }
+#endif
+  write_fits(tab, channels, pols, page_index, rowlength, data, telaz, telza);
+}
+
+/**
+ * Write a row of data to the selected output format, see write_fits
+ */
+void write_row(const int tab, const int channels, const int pols, const long page_index, const int rowlength, unsigned char *data, const float telaz, const float telza) {
+  // the main loop is worker thread 0; HDF5 compression on the other workers counts as writing too
+  perf_stage(PERF_WRITE);
+  perf_begin(0);
+  write_output(tab, channels, pols, page_index, rowlength, data, telaz, telza);
+  perf_end(0);
+}
+
+/**
+ * Close all output files
+ */
+void close_output() {
+  dada_sink_close();
+
+  if (output_format == OUTPUT_NONE) {
+    return;
+  }
+#ifdef HAVE_HDF5
+  if (output_format == OUTPUT_HDF5) {
+    close_hdf5();
+    return;
+  }
+#endif
+  close_fits();
 }
 
 /**
@@ -188,6 +449,36 @@ dada_hdu_t *init_ringbuffer(char *key) {
 void printOptions() {
   printf("usage: dadafits -k <hexadecimal key> -l <logfile> -t <template> -d <output_directory> -S <synthesized beam table> -s <synthesize these beams>\n");
   printf("e.g. dadafits -k dada -l log.txt -c 3 -m 0 -b 25088 -t /full/path/template.txt -S table.txt -s 0,1,4-8 -d /output/directory\n");
+  printf("options:\n");
+  printf("  --staging <dir>        write files to <dir> first, and move them to the output directory when finished\n");
+  printf("  --migrate-rate <MB/s>  bandwidth budget for moving files out of the staging directory (default 100, 0 is unlimited)\n");
+  printf("  --write-rate <MB/s>    spread writes to the output files, and limit them to this rate (default 0, unlimited)\n");
+  printf("  --write-priority <beams>  comma separated list of beams that are not delayed by the write rate\n");
+  printf("  --resume               append to existing output files of the same observation, skipping pages already written\n");
+  printf("  --input <file.dada>    read from a recorded file instead of a ringbuffer (-k is then not needed)\n");
+  printf("  --first-page <page>    first page to process, earlier pages are skipped\n");
+  printf("  --last-page <page>     last page to process (inclusive)\n");
+  printf("  --start-time <s>       as --first-page, in seconds since the start of the observation\n");
+  printf("  --end-time <s>         as --last-page, in seconds since the start of the observation\n");
+  printf("  --format <fits|hdf5|none>  output file format (default fits), none to only publish to a ringbuffer\n");
+  printf("  --threads <n>          number of worker threads (default 0, one per processor)\n");
+  printf("  --output-key <key>     also publish the reduced data to the ringbuffer with this (hexadecimal) key\n");
+  printf("  --view                 passively view the ringbuffer instead of reading it; never blocks the writer or the primary reader\n");
+  printf("  --partition <i/N>      process part i of N of the synthesized beams, together with N-1 other processes on the same ringbuffer\n");
+  printf("  --batch <dir>          process all .dada recordings below <dir>, one subdirectory of the output directory per observation\n");
+  printf("  --batch-jobs <n>       maximum number of concurrent batch jobs (default 0, one per 4 threads)\n");
+  printf("  --batch-memory <MB>    memory budget for all batch jobs together (default 0, half the physical memory)\n");
+  printf("  --monitor <file>       append bandpass, total power, and fraction of bits set per TAB per page to <file> (Stokes I modes)\n");
+  printf("  --fold <ephemeris>     fold the data of every TAB with the ephemeris, and write PSRFITS fold mode files (Stokes I modes)\n");
+  printf("  --fold-subint <n>      pages per folded sub-integration (default 10)\n");
+  printf("  --autotune <file>      calibrate the kernels at startup, and cache the result per host in <file>\n");
+  printf("  --ewma <alpha>         normalize Stokes I with running statistics over pages, alpha (0..1] is the weight of a new page\n");
+  printf("  --zero-dm              subtract the mean over channels from every Stokes I sample before packing\n");
+  printf("  --flatten-bandpass     scale every Stokes I channel to the same average before packing\n");
+  printf("  --close-timeout <s>    maximum time to wait for the output files to be closed at the end (default 0, unlimited)\n");
+  printf("  --drain-timeout <s>    on SIGTERM or SIGINT, abandon the current page when it takes longer than this (default 0, unlimited)\n");
+  printf("  --perf                 count cycles, instructions, LLC and dTLB misses per stage and thread, and log them at exit\n");
+  printf("  --perf-file <file>     as --perf, and also write the counts per stage and thread to <file>\n");
   return;
 }
 
@@ -198,7 +489,7 @@ void parseOptions(int argc, char *argv[], char **key, char **logfile, char **tem
   int c;
 
   int setk=0, setl=0;
-  while((c=getopt(argc,argv,"k:l:t:d:s:S:"))!=-1) {
+  while((c=getopt_long(argc,argv,"k:l:t:d:s:S:",long_options,NULL))!=-1) {
     switch(c) {
       // OPTIONAL: -d <output_directory>
       // DEFAULT: CWD
@@ -207,7 +498,7 @@ void parseOptions(int argc, char *argv[], char **key, char **logfile, char **tem
         break;
 
       // OPTIONAL: -t <template_dir>
-      // DEFAULT: CWD/templates
+      // DEFAULT: use the templates compiled in
       case('t'):
         *template_dir = strdup(optarg);
         break;
@@ -234,6 +525,183 @@ void parseOptions(int argc, char *argv[], char **key, char **logfile, char **tem
         *sb_selection = strdup(optarg);
         break;
 
+      // OPTIONAL: --staging <staging_directory>
+      case(OPT_STAGING):
+        staging_directory = strdup(optarg);
+        break;
+
+      // OPTIONAL: --migrate-rate <MB/s>
+      // DEFAULT: 100
+      case(OPT_MIGRATE_RATE):
+        migrate_rate = atof(optarg);
+        break;
+
+      // OPTIONAL: --write-rate <MB/s>
+      // DEFAULT: 0, unlimited
+      case(OPT_WRITE_RATE):
+        write_rate = atof(optarg);
+        break;
+
+      // OPTIONAL: --write-priority <beam,beam,...>
+      case(OPT_WRITE_PRIORITY):
+        write_priority = strdup(optarg);
+        break;
+
+      // OPTIONAL: --resume
+      case(OPT_RESUME):
+        resume = 1;
+        break;
+
+      // OPTIONAL: --input <file.dada>
+      case(OPT_INPUT):
+        input_file = strdup(optarg);
+        break;
+
+      // OPTIONAL: --first-page <page>
+      // DEFAULT: 0
+      case(OPT_FIRST_PAGE):
+        first_page = atol(optarg);
+        break;
+
+      // OPTIONAL: --last-page <page>
+      // DEFAULT: until end of data
+      case(OPT_LAST_PAGE):
+        last_page = atol(optarg);
+        break;
+
+      // OPTIONAL: --start-time <seconds>
+      case(OPT_START_TIME):
+        start_time = atof(optarg);
+        break;
+
+      // OPTIONAL: --end-time <seconds>
+      case(OPT_END_TIME):
+        end_time = atof(optarg);
+        break;
+
+      // OPTIONAL: --format <fits|hdf5>
+      // DEFAULT: fits
+      case(OPT_FORMAT):
+        if (strcmp(optarg, "fits") == 0) {
+          output_format = OUTPUT_FITS;
+        } else if (strcmp(optarg, "none") == 0) {
+          output_format = OUTPUT_NONE;
+        } else if (strcmp(optarg, "hdf5") == 0) {
+#ifdef HAVE_HDF5
+          output_format = OUTPUT_HDF5;
+#else
+          fprintf(stderr, "HDF5 output is not available, recompile with HDF5 support\n");
+          exit(EXIT_FAILURE);
+#endif
+        } else {
+          fprintf(stderr, "Unknown output format: %s\n", optarg);
+          exit(EXIT_FAILURE);
+        }
+        break;
+
+      // OPTIONAL: --threads <n>
+      // DEFAULT: 0, one per processor
+      case(OPT_THREADS):
+        nthreads = atoi(optarg);
+        break;
+
+      // OPTIONAL: --output-key <hexadecimal_key>
+      case(OPT_OUTPUT_KEY):
+        output_key = strdup(optarg);
+        break;
+
+      // OPTIONAL: --view
+      case(OPT_VIEW):
+        view_mode = 1;
+        break;
+
+      // OPTIONAL: --partition <i/N>
+      case(OPT_PARTITION):
+        if (partition_parse(optarg, &partition_index, &partition_count)) {
+          fprintf(stderr, "Invalid partition '%s', use i/N with 0 <= i < N <= %i\n", optarg, PARTITIONS_MAX);
+          exit(EXIT_FAILURE);
+        }
+        break;
+
+      // OPTIONAL: --batch <directory>
+      case(OPT_BATCH):
+        batch_directory = strdup(optarg);
+        break;
+
+      // OPTIONAL: --batch-jobs <n>
+      // DEFAULT: 0, one job per 4 threads
+      case(OPT_BATCH_JOBS):
+        batch_jobs = atoi(optarg);
+        break;
+
+      // OPTIONAL: --batch-memory <MB>
+      // DEFAULT: 0, half the physical memory
+      case(OPT_BATCH_MEMORY):
+        batch_memory = atof(optarg);
+        break;
+
+      // OPTIONAL: --monitor <file>
+      case(OPT_MONITOR):
+        monitor_file = strdup(optarg);
+        break;
+
+      // OPTIONAL: --fold <ephemeris>
+      case(OPT_FOLD):
+        fold_ephemeris = strdup(optarg);
+        break;
+
+      // OPTIONAL: --fold-subint <pages>
+      case(OPT_FOLD_SUBINT):
+        fold_subint_pages = atoi(optarg);
+        break;
+
+      // OPTIONAL: --autotune <cache file>
+      case(OPT_AUTOTUNE):
+        autotune_file = strdup(optarg);
+        break;
+
+      // OPTIONAL: --ewma <alpha>
+      case(OPT_EWMA):
+        ewma_alpha = atof(optarg);
+        if (ewma_alpha <= 0 || ewma_alpha > 1) {
+          fprintf(stderr, "Invalid weight '%s' for --ewma, use 0 < alpha <= 1\n", optarg);
+          exit(EXIT_FAILURE);
+        }
+        break;
+
+      // OPTIONAL: --zero-dm
+      case(OPT_ZERO_DM):
+        zero_dm = 1;
+        break;
+
+      // OPTIONAL: --flatten-bandpass
+      case(OPT_FLATTEN_BANDPASS):
+        flatten_bandpass = 1;
+        break;
+
+      // OPTIONAL: --close-timeout <seconds>
+      // DEFAULT: 0, unlimited
+      case(OPT_CLOSE_TIMEOUT):
+        close_timeout = atof(optarg);
+        break;
+
+      // OPTIONAL: --drain-timeout <seconds>
+      // DEFAULT: 0, unlimited
+      case(OPT_DRAIN_TIMEOUT):
+        drain_timeout = atoi(optarg);
+        break;
+
+      // OPTIONAL: --perf
+      case(OPT_PERF):
+        perf_counters = 1;
+        break;
+
+      // OPTIONAL: --perf-file <file>
+      case(OPT_PERF_FILE):
+        perf_counters = 1;
+        perf_output = strdup(optarg);
+        break;
+
       default:
         printOptions();
         fprintf(stderr, "Unknown option: %c\n",  c);
@@ -241,18 +709,43 @@ void parseOptions(int argc, char *argv[], char **key, char **logfile, char **tem
     }
   }
 
+  // convert times to pages
+  if (start_time >= 0) {
+    first_page = floor(start_time / PAGE_DURATION);
+  }
+  if (end_time >= 0) {
+    last_page = ceil(end_time / PAGE_DURATION) - 1;
+  }
+  if (first_page < 0 || (last_page >= 0 && last_page < first_page)) {
+    fprintf(stderr, "Invalid page range %li to %li\n", first_page, last_page);
+    exit(EXIT_FAILURE);
+  }
+
   // Required arguments
-  if (!setk || !setl) {
+  if ((!setk && !input_file && !batch_directory) || !setl) {
     printOptions();
     exit(EXIT_FAILURE);
   }
+
+  if (partition_count) {
+    if (input_file || !setk) {
+      fprintf(stderr, "--partition needs a ringbuffer (-k)\n");
+      exit(EXIT_FAILURE);
+    }
+    if (partition_index == 0 && view_mode) {
+      fprintf(stderr, "Partition 0 is the reader of the ringbuffer, and cannot be a viewer\n");
+      exit(EXIT_FAILURE);
+    }
+    // all but the first partition view the ringbuffer
+    view_mode = partition_index > 0;
+  }
 }
 
 int main (int argc, char *argv[]) {
   char *key;
   char *logfile;
   const char *template_file = NULL;
-  char *template_dir = "templates";
+  char *template_dir = NULL; // use the templates compiled in
   char *table_name = NULL; // optional argument
   char *sb_selection = NULL; // optional argument, defaults to all beams
   char *output_directory = NULL; // defaults to CWD
@@ -276,20 +769,51 @@ int main (int argc, char *argv[]) {
     free (logfile);
   }
 
+  if (batch_directory) {
+    // run a child process per recording, see batch.c
+    int failed = batch_run(batch_directory, output_directory, batch_jobs, batch_memory, nthreads, write_rate,
+        staging_directory, monitor_file, perf_output, argc, argv);
+    exit(failed ? EXIT_FAILURE : EXIT_SUCCESS);
+  }
+
   // must init ringbuffer before fits, as this reads parameters
   // like bandwidth from ring buffer header
-  dada_hdu_t *ringbuffer = init_ringbuffer(key);
-  ipcbuf_t *data_block = (ipcbuf_t *) ringbuffer->data_block;
-  ipcio_t *ipc = ringbuffer->data_block;
-  uint64_t bufsz = ipc->curbufsz;
+  dada_hdu_t *ringbuffer = NULL;
+  ipcbuf_t *data_block = NULL;
+  ipcio_t *ipc = NULL;
+  uint64_t bufsz = 0;
+  if (input_file) {
+    init_file(input_file);
+  } else {
+    if (partition_count) {
+      // before attaching to the ringbuffer, so the primary does not start without the others
+      partition_init(key, partition_index, partition_count);
+    }
+    ringbuffer = init_ringbuffer(key);
+    data_block = (ipcbuf_t *) ringbuffer->data_block;
+    ipc = ringbuffer->data_block;
+    bufsz = ipc->curbufsz;
+  }
+
+  workers_init(nthreads);
+  close_pool_init(close_timeout);
+  if (perf_counters) {
+    perf_init(perf_output);
+  }
 
-  LOG("dadafits version: " VERSION "\n");
+  LOG("dadafits version: " VERSION ", libdadafits version: %s\n", dadafits_library_version());
 
   if (table_name) {
     LOG("Writing synthesized beams\n");
     make_synthesized_beams = 1;
     read_synthesized_beam_table(table_name);
     parse_synthesized_beam_selection(sb_selection);
+    if (partition_count) {
+      partition_select_beams();
+    }
+  } else if (partition_count) {
+    LOG("Error: --partition needs a synthesized beam table (-S)\n");
+    exit(EXIT_FAILURE);
   } else {
     LOG("Writing TABs (not synthesized beams)\n");
     make_synthesized_beams = 0;
@@ -373,174 +897,238 @@ int main (int argc, char *argv[]) {
       exit(EXIT_FAILURE);
   }
 
+  if (dadafits_context_init(&kernel_context, science_case, science_mode, padded_size)) {
+    LOG("Cannot set up kernels for science case %i, mode %i\n", science_case, science_mode);
+    exit(EXIT_FAILURE);
+  }
+  kernel_context.offset = fits_offset;
+  kernel_context.scale = fits_scale;
+
   LOG("Science mode: %i [ %s ]\n", science_mode, science_modes[science_mode]);
   LOG("Science case: %i\n", science_case);
-  LOG("Template: %s\n", template_file);
+  LOG("Template: %s%s%s\n", template_dir ? template_dir : "", template_dir ? "/" : "", template_file);
+  if (! template_dir && output_format == OUTPUT_FITS && ! dadafits_find_template(template_file)) {
+    LOG("Error: template %s is not compiled in, use -t to give the template directory\n", template_file);
+    exit(EXIT_FAILURE);
+  }
 
   LOG("Output to FITS tabs: %i, channels: %i, polarizations: %i, samples: %i\n", ntabs, nchannels, npols, ntimes);
-  dadafits_fits_init(template_dir, template_file, output_directory,
-      ntabs, make_synthesized_beams, scanlen, center_frequency, bandwidth, min_frequency, nchannels, 
-      bandwidth / nchannels, ra_hms, dec_hms, source_name, utc_start, mjd_start, lst_start, parset);
-
-  if (science_mode == 1 || science_mode == 3) {
-    LOG("Allocating Stokes IQUV transpose buffer (%i,%i,%i,%i)\n", ntabs, ntimes, NPOLS, NCHANNELS);
-    transposed = malloc(ntabs * NCHANNELS * NPOLS * ntimes * sizeof(char));
-    if (transposed == NULL) {
-      LOG("Could not allocate stokes IQUV transpose matrix\n");
+  if (staging_directory) {
+    LOG("Staging output files in %s\n", staging_directory);
+    migrate_init(output_directory, migrate_rate);
+  }
+  long resume_pages = 0;
+  if (output_format == OUTPUT_HDF5) {
+#ifdef HAVE_HDF5
+    if (resume) {
+      LOG("Error: cannot resume HDF5 output\n");
       exit(EXIT_FAILURE);
     }
+    dadafits_hdf5_init(staging_directory ? staging_directory : output_directory,
+        ntabs, make_synthesized_beams, nchannels, npols, ntimes, npols == 1 ? 1 : 8,
+        scanlen, center_frequency, bandwidth, min_frequency, bandwidth / nchannels,
+        ra_hms, dec_hms, source_name, utc_start, mjd_start, lst_start, parset, first_page);
+#endif
+  } else if (output_format == OUTPUT_FITS) {
+    resume_pages = dadafits_fits_init(template_dir, template_file, staging_directory ? staging_directory : output_directory,
+        ntabs, make_synthesized_beams, scanlen, center_frequency, bandwidth, min_frequency, nchannels, 
+        bandwidth / nchannels, ra_hms, dec_hms, source_name, utc_start, mjd_start, lst_start, parset, first_page, resume);
+  }
+  if (resume) {
+    LOG("Resuming at page %li\n", resume_pages);
+  }
+  if (output_format == OUTPUT_NONE) {
+    if (! output_key) {
+      LOG("Error: no output, use --output-key with --format none\n");
+      exit(EXIT_FAILURE);
+    }
+    // the file backends set these up otherwise
+    dadafits_init_channels(nchannels, min_frequency, bandwidth / nchannels);
+  }
+  if (output_key) {
+    dada_sink_init(output_key, ntabs, make_synthesized_beams, nchannels, npols, ntimes, npols == 1 ? 1 : 8,
+        min_frequency, bandwidth / nchannels, input_header);
+  }
+
+  long skip_pages = resume_pages > first_page ? resume_pages : first_page;
+  if (skip_pages) {
+    LOG("Skipping pages before page %li\n", skip_pages);
+  }
+  if (last_page >= 0) {
+    LOG("Stopping after page %li\n", last_page);
   }
 
-  if (make_synthesized_beams) {
-    LOG("Allocating Stokes IQUV synthesized beam buffer (1,%i,%i,%i)\n", ntimes, NPOLS, NCHANNELS);
-    synthesized = malloc(1 * NCHANNELS * NPOLS * ntimes * sizeof(char));
-    if (synthesized == NULL) {
-      LOG("Could not allocate stokes IQUV synthesized beam buffer\n");
+  if (input_file) {
+    // pages in the file start at OBS_OFFSET, seek directly to the first page needed
+    long page_size = science_mode == 0 || science_mode == 2 ?
+      (long) ntabs * NCHANNELS * padded_size :
+      (long) ntabs * (NCHANNELS / 4) * sequence_length * 8000;
+    dada_file_set_page_size(page_size);
+    page_count = obs_offset / page_size;
+    if (skip_pages > page_count) {
+      dada_file_seek_page(skip_pages - page_count);
+      page_count = skip_pages;
+    }
+  }
+
+  write_qos_init(write_rate, write_priority, make_synthesized_beams ? synthesized_beam_count : ntabs);
+  if (write_rate > 0) {
+    // warn when the budget cannot keep up with the data
+    float required = (make_synthesized_beams ? synthesized_beam_nselected : ntabs) * (float) nchannels * npols * ntimes / (npols == 1 ? 8 : 1) / (PAGE_DURATION * 1e6);
+    if (required > write_rate) {
+      LOG("Warning: write rate %.1f MB/s is below the data rate of up to %.1f MB/s\n", write_rate, required);
+    }
+  }
+
+  if (monitor_file) {
+    if (science_mode != 0 && science_mode != 2) {
+      LOG("Error: monitoring is only available for Stokes I (modes 0 and 2)\n");
       exit(EXIT_FAILURE);
     }
+    monitor_init(monitor_file, ntabs, min_frequency, bandwidth / nchannels);
+  }
+
+  if (fold_ephemeris) {
+    if (science_mode != 0 && science_mode != 2) {
+      LOG("Error: folding is only available for Stokes I (modes 0 and 2)\n");
+      exit(EXIT_FAILURE);
+    }
+    fold_init(fold_ephemeris, template_dir, output_directory, ntabs, fold_subint_pages,
+        center_frequency, bandwidth, min_frequency, bandwidth / nchannels, ra_hms, dec_hms, utc_start, mjd_start, resume);
+  }
+
+  if (ewma_alpha > 0) {
+    if (science_mode != 0 && science_mode != 2) {
+      LOG("Error: running statistics are only available for Stokes I (modes 0 and 2)\n");
+      exit(EXIT_FAILURE);
+    }
+    if (monitor_file) {
+      LOG("Error: --monitor needs the statistics of every page, and cannot be combined with --ewma\n");
+      exit(EXIT_FAILURE);
+    }
+  }
+
+  if ((zero_dm || flatten_bandpass) && science_mode != 0 && science_mode != 2) {
+    LOG("Error: zero-DM and bandpass flattening are only available for Stokes I (modes 0 and 2)\n");
+    exit(EXIT_FAILURE);
+  }
+
+  if (autotune_file) {
+    autotune_init(autotune_file, &kernel_context, make_synthesized_beams);
   }
 
+  // choose the specialized pipeline for this science case and mode, see pipeline.c
+  pipeline_func_t pipeline = pipeline_init(&kernel_context, make_synthesized_beams, ewma_alpha);
+
   int quit = 0;
   char *page = NULL;
 
-  // Trap Ctr-C to properly close fits files on exit
-  signal(SIGTERM, fits_error_and_exit);
+  // Trap Ctr-C and SIGTERM to finish the current page and properly close the files on exit
+  trap_stop_signals();
 
-  while(!quit && !ipcbuf_eod(data_block)) {
-    page = ipcbuf_get_next_read(data_block, &bufsz);
+  while(!quit && ! stop_signal && (input_file || !ipcbuf_eod(data_block))) {
+    if (input_file) {
+      page = last_page >= 0 && page_count > last_page ? NULL : dada_file_read_page();
+    } else {
+      page = ipcbuf_get_next_read(data_block, &bufsz);
 
-    int tab; // Tied array beam
-    int sb;  // synthesized beam
+      if (view_mode && page) {
+        // a viewer skips ahead when the writer overtakes it; keep the page count relative to the start of this transfer,
+        // as the buffer counts of the ringbuffer include earlier transfers
+        if (view_start < 0) {
+          view_start = data_block->sync->s_buf[data_block->xfer % IPCBUF_XFERS];
+        }
+        long current = data_block->viewbuf - view_start - 1;
+        if (current > page_count) {
+          LOG("Viewer fell behind, skipped pages %li to %li\n", page_count, current - 1);
+          view_skipped += current - page_count;
+          page_count = current;
+        }
+      }
+    }
 
     if (! page) {
+      // end of data, or interrupted by a signal
       quit = 1;
+    } else if (page_count < skip_pages || (last_page >= 0 && page_count > last_page)) {
+      // outside the requested range, or already written by a previous run;
+      // keep reading until end-of-data so the writer is not blocked
+      if (last_page >= 0 && page_count == last_page + 1) {
+        LOG("Last page done, discarding remaining pages\n");
+      }
+      if (! input_file) {
+        release_page(data_block);
+      }
+      page_count++;
     } else {
-      switch (science_mode) {
-        // stokesI data to compress, downsample, and write
-        case 0:
-        case 2:
-          for (tab = 0; tab < ntabs; tab++) {
-            // move data from the page to the downsampled array
-            if (science_case == 3) {
-              downsample_sc3(&page[tab * NCHANNELS * padded_size], padded_size, downsampled);
-            } else if (science_case == 4) {
-              downsample_sc4(&page[tab * NCHANNELS * padded_size], padded_size, downsampled);
-            } else {
-              exit(EXIT_FAILURE);
-            }
-            // pack data from the downsampled array to the packed array,
-            // and set scale and offset arrays with used values
-            pack_sc34(downsampled, packed);
-
-            // NOTE: Use hardcoded values instead of the variables ntimes, nchannels, npols
-            // because at this point in the program they can only have these values, and this could
-            // possibly allow some more optimizations
-            write_fits(
-              tab,
-              NCHANNELS_LOW,
-              1, // only Stokes I
-              page_count + 1, // page_count starts at 0, but FITS rowid at 1
-              NCHANNELS_LOW * NTIMES_LOW / 8,
-              packed, // write data from the packed array to file, also uses scale, weights, and offset arrays
-              az_start, za_start
-            );
-          }
-          break;
-
-        // stokesIQUV data to (optionally synthesize) and write
-        case 1:
-        case 3:
-          LOG("Page: %i\n", page_count);
-          // transpose data from page to transposed buffer
-          deinterleave(page, ntimes, ntabs, sequence_length, transposed);
-
-          if (make_synthesized_beams) {
-            // synthesize beams
-            //
-            // Input: transposed buffer   [TABS, TIMES, POLS, CHANNELS]
-            // Output: synthesized buffer [TIMES, POLS, CHANNELS]
-            
-            for (sb = 0; sb < synthesized_beam_count; sb++) {
-              if (synthesized_beam_selected[sb]) {
-                int tn; // current time
-                int pn; // current pol
-                int band; // current subband
-
-                // a subband contains 1536/32=48 frequencies from a TAB
-                for (band = 0; band < NSUBBANDS; band++) {
-                  // find the TAB for this subband, and check validity
-                  tab = synthesized_beam_table[sb][band]; // TODO: subband from table -> tab?
-                  if (tab == SUBBAND_UNSET || tab > ntabs) {
-                    LOG("Error: illegal subband index %i in synthesized beam %i\n", tab, sb);
-                    exit(EXIT_FAILURE);
-                  }
-
-                  // for each time and polarisation, copy the 48 frequencies of this subband to output 
-                  for (tn = 0; tn < ntimes; tn++) {
-                    for (pn = 0; pn < NPOLS; pn++ ) {
-                      memcpy(
-                        &synthesized[
-                          tn * NPOLS * NCHANNELS + pn * NCHANNELS + 
-                          (NSUBBANDS - 1 - band) * FREQS_PER_SUBBAND
-                        ],
-                        &transposed[
-                          tab * ntimes * NPOLS * NCHANNELS + tn * NPOLS * NCHANNELS +
-                          pn * NCHANNELS + (NSUBBANDS - 1 - band) * FREQS_PER_SUBBAND
-                        ],
-                        FREQS_PER_SUBBAND
-                      );
-                    }
-                  }
-                }
-
-                // write data from synthesized buffer
-                write_fits(
-                  sb,
-                  NCHANNELS,
-                  NPOLS, // full Stokes IQUV
-                  page_count + 1, // page_count starts at 0, but FITS rowid at 1
-                  NCHANNELS * NPOLS * ntimes,
-                  synthesized,
-                  az_start, za_start
-                );
-              }
-            }
-          } else {
-            // do not synthesize, but use TABs
-            for (tab = 0; tab < ntabs; tab++) {
-              // write data from transposed buffer, also uses scale, weights, and offset arrays (but set to neutral values)
-              write_fits(
-                tab,
-                NCHANNELS,
-                NPOLS, // full Stokes IQUV
-                page_count + 1, // page_count starts at 0, but FITS rowid at 1
-                NCHANNELS * NPOLS * ntimes,
-                &transposed[tab * NCHANNELS * NPOLS * ntimes],
-                az_start, za_start
-              );
-            }
-          }
-          break;
-
-        default:
-          // should not happen
-          LOG("Illegal science mode %i\n", science_mode);
-          quit = 1;
-          break;
+      dada_sink_begin_page();
+
+      pipeline((unsigned char *) page, page_count, az_start, za_start);
+
+      dada_sink_end_page();
+
+      if (view_mode && ipcbuf_get_write_count(data_block) >= view_start + page_count + ipcbuf_get_nbufs(data_block)) {
+        // the writer may have reused the buffer while we were reading it
+        LOG("Warning: page %li may have been overwritten while processing\n", page_count);
+        view_overwritten++;
+      }
+
+      if (! input_file) {
+        release_page(data_block);
       }
-      ipcbuf_mark_cleared((ipcbuf_t *) ipc);
       page_count++;
+      pages_processed++;
     }
   }
 
-  if (ipcbuf_eod(data_block)) {
-    LOG("End of data received\n");
+  // the page drain is over; closing the files is bounded by --close-timeout
+  alarm(0);
+
+  long pages_dropped = 0;
+  if (stop_signal) {
+    // pages the writer has put in the ringbuffer that we will not process
+    if (! input_file && ! view_mode) {
+      pages_dropped = ipcbuf_get_write_count(data_block) - ipcbuf_get_read_count(data_block);
+    }
+    LOG("Stopping on signal %i: finishing and closing the output files\n", stop_signal);
   }
 
-  dada_hdu_unlock_read(ringbuffer);
-  dada_hdu_disconnect(ringbuffer);
+  if (input_file) {
+    dada_file_close();
+  } else {
+    if (ipcbuf_eod(data_block)) {
+      LOG("End of data received\n");
+    }
+
+    if (view_mode) {
+      dada_hdu_close_view(ringbuffer);
+    } else {
+      dada_hdu_unlock_read(ringbuffer);
+    }
+    dada_hdu_disconnect(ringbuffer);
+    partition_close();
+  }
 
   LOG("Read %li pages\n", page_count);
+  if (view_mode) {
+    LOG("Viewer skipped %li pages, %li pages possibly overwritten while processing\n", view_skipped, view_overwritten);
+  }
 
-  close_fits();
+  write_qos_report();
+  pipeline_report();
+  perf_report();
+  monitor_close();
+  fold_close();
+  close_output();
+  migrate_finish();
+  workers_close();
+
+  if (stop_signal) {
+    if (input_file || view_mode) {
+      LOG("Stopped on signal %i: processed %li pages, last page %li\n", stop_signal, pages_processed, page_count - 1);
+    } else {
+      LOG("Stopped on signal %i: processed %li pages, last page %li; dropped %li pages left in the ringbuffer\n",
+          stop_signal, pages_processed, page_count - 1, pages_dropped);
+    }
+  }
 }
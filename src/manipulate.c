@@ -1,110 +1,57 @@
-#include <fenv.h>
-#include <errno.h>
 #include <math.h>
 #include <string.h>
 
 #include "dadafits_internal.h"
+#include "kernels.h"
 
 /**
  * Pack series of 8-bit StokesI to 1-bit
+ * Template for dadafits_pack and dadafits_pack_monitor; without monitor the monitoring code is compiled out
  *
+ *   @param {dadafits_context_t *} ctx  Context, offset and scale are set for each channel
  *   @param {uint[]}  downsampled[NCHANNELS_LOW * NTIMES_LOW]
  *   @param {uchar[]} packed[NCHANNELS_LOW * NTIMES_LOW / 8]
+ *   @param {dadafits_monitor_t *} monitor  Optional, set to the monitoring data
+ *   @returns {int} Number of channels without variance
  */
-void pack_sc34(unsigned int downsampled[NCHANNELS_LOW * NTIMES_LOW], unsigned char packed[NCHANNELS_LOW * NTIMES_LOW/8]) {
-  unsigned int *temp1;
-  unsigned char *temp2;
+DADAFITS_INLINE int pack_page(const dadafits_context_t *ctx, unsigned int *downsampled, unsigned char *packed, dadafits_monitor_t *monitor) {
+  unsigned long long power[DADAFITS_MONITOR_NPOWER] = {0};
+  unsigned long ones = 0;
 
-  // DEBUG NaNs:
-  errno = 0;
-  feclearexcept(FE_ALL_EXCEPT);
+  int flat = pack_statistics(ctx, downsampled, 0, NCHANNELS_LOW, monitor, power, &ones);
 
-  int dc;
-  for (dc = 0; dc < NCHANNELS_LOW; dc++) {
-
-    // First pass: calculate average(=offset) and stdev(=scale)
-    temp1 = &downsampled[dc * NTIMES_LOW];
-
-    // Sum:
-    // total sum is over 12500 samples times 4 frequencies is 50,000 samples (50,000 for sc3)
-    // maxium value is 50000 * 255 = 2,750,000
-    // an unsigned int should hold 4,294,967,295, so no overflow here
-    //
-    // Sos:
-    // maxium value of a downsampled sample is 255 * 50 * 4 = 51,000
-    // of these, we are summing 500 squares, so maximum value is
-    //             51000 * 51000 * 500 = 1,300,500,000,000
-    // unsigned long long holds 18,446,744,073,709,551,615, so ok.
-    //
-    unsigned int sum = 0;
-    unsigned long long sos = 0;
-
-    int dt;
-    for (dt=0; dt < NTIMES_LOW; dt++) {
-      sos += (*temp1) * (*temp1);
-      sum += *temp1++;
-    }
-    float avg = sum / (1.0 * NTIMES_LOW);
-    float std = sqrtf(sos / (1.0 * NTIMES_LOW) - avg * avg);
-
-    // Second pass: convert to 1 bit
-    // 0: below average, represented by nummerical value avg-std
-    // 1: above average, represented by nummerical value avg+std
-    // Take care of high-to-low frequency order in packed array
-    fits_offset[NCHANNELS_LOW-dc] = avg - std;
-    fits_scale[NCHANNELS_LOW-dc]  = 2.0 * std;
+  if (monitor) {
+    pack_monitor_totals(monitor, power, ones);
+  }
 
-    unsigned int cutoff = avg;
+  pack_bits(downsampled, packed, 0, NTIMES_LOW);
 
-    temp1 = &downsampled[dc * NTIMES_LOW];
-    for (dt=0; dt < NTIMES_LOW; dt++) {
-      *temp1 = *temp1 > cutoff ? 1 : 0;
-      temp1++;
-    }
-  }
+  return flat;
+}
 
-  // Third pass: pack bits in bytes, transpose to time-frequency order, order frequencies from high to low
-  // packing requires NCHANNELS_LOW is divisible by 8
-  int dt;
-  for (dt=0; dt < NTIMES_LOW; dt++) {
-    for (dc=0; dc < NCHANNELS_LOW; dc+=8) {
-      // position in (transposed) packed array 
-      temp2 = &packed[(dt * NCHANNELS_LOW + (dc)) / 8];
-      // start point in downsampled array
-      // this array is transposed and has frequencies high-to-low
-      temp1 = &downsampled[(NCHANNELS_LOW - 1 - dc) * NTIMES_LOW + dt];
-      // do the packing; jump to next channel in input array after each step
-      // LSB is lowest channel to comply with high->low frequency order in output
-      *temp2  = *temp1 ? 1     : 0;
-      temp1 += NTIMES_LOW;
-      *temp2 += *temp1 ? 1 << 1: 0;
-      temp1 += NTIMES_LOW;
-      *temp2 += *temp1 ? 1 << 2: 0;
-      temp1 += NTIMES_LOW;
-      *temp2 += *temp1 ? 1 << 3: 0;
-      temp1 += NTIMES_LOW;
-      *temp2 += *temp1 ? 1 << 4: 0;
-      temp1 += NTIMES_LOW;
-      *temp2 += *temp1 ? 1 << 5: 0;
-      temp1 += NTIMES_LOW;
-      *temp2 += *temp1 ? 1 << 6: 0;
-      temp1 += NTIMES_LOW;
-      *temp2 += *temp1 ? 1 << 7: 0;
-    }
-  }
+/**
+ * Pack series of 8-bit StokesI to 1-bit
+ *
+ *   @param {dadafits_context_t *} ctx  Context, offset and scale are set for each channel
+ *   @param {uint[]}  downsampled[NCHANNELS_LOW * NTIMES_LOW]
+ *   @param {uchar[]} packed[NCHANNELS_LOW * NTIMES_LOW / 8]
+ *   @returns {int} Number of channels without variance
+ */
+int dadafits_pack(const dadafits_context_t *ctx, unsigned int *downsampled, unsigned char *packed) {
+  return pack_page(ctx, downsampled, packed, NULL);
+}
 
-  // DEBUG NaNs:
-  int except = fetestexcept(FE_INVALID | FE_DIVBYZERO | FE_OVERFLOW | FE_UNDERFLOW);
-  if (errno || except) {
-    LOG("Error: floating point exception in packing data: errno=%i (%s), fetestexcept=%i", errno, strerror(errno), except);
-    switch (except) {
-      case FE_INVALID: LOG("(FE_INVALID)\n"); break;
-      case FE_DIVBYZERO: LOG("(FE_DIVBYZERO)\n"); break;
-      case FE_OVERFLOW: LOG("(FE_OVERFLOW)\n"); break;
-      case FE_UNDERFLOW: LOG("(FE_UNDERFLOW)\n"); break;
-      default: LOG("-\n");
-    }
-  }
+/**
+ * Pack series of 8-bit StokesI to 1-bit, and collect monitoring data in the same pass
+ *
+ *   @param {dadafits_context_t *} ctx  Context, offset and scale are set for each channel
+ *   @param {uint[]}  downsampled[NCHANNELS_LOW * NTIMES_LOW]
+ *   @param {uchar[]} packed[NCHANNELS_LOW * NTIMES_LOW / 8]
+ *   @param {dadafits_monitor_t *} monitor  Bandpass, total power, and fraction of bits set
+ *   @returns {int} Number of channels without variance
+ */
+int dadafits_pack_monitor(const dadafits_context_t *ctx, unsigned int *downsampled, unsigned char *packed, dadafits_monitor_t *monitor) {
+  return pack_page(ctx, downsampled, packed, monitor);
 }
 
 /**
@@ -114,13 +61,11 @@ void pack_sc34(unsigned int downsampled[NCHANNELS_LOW * NTIMES_LOW], unsigned ch
  *   1. realtime: ringbuffer -> [trigger] -> dada_dbdisk
  *   2. offline: dada_dbdisk -> ringbuffer -> dadafits
  *
+ *  @param {dadafits_context_t *} ctx          Context, provides ntimes and ntabs
  *  @param {const uchar[]} page                 Ringbuffer page with interleaved data
- *  @param {int}           ntimes               Number of time samples per page
- *  @param {int}           ntabs                Number of tabs
- *  @param {int}           sequence_length      Number of packets per
  *  @param {uchar[]}       transposed           Output buffer to hold deinterleaved data. Size: ntabs*NCHANNELS*NPOLS*ntimes
  */
-void deinterleave (const unsigned char *page, const int ntimes, const int ntabs, const int sequence_length, unsigned char *transposed) {
+void dadafits_deinterleave (const dadafits_context_t *ctx, const unsigned char *page, unsigned char *transposed) {
   // ring buffer page contains matrix:
   //   [tab][channel_offset][sequence_number][8000]
   //
@@ -142,31 +87,20 @@ void deinterleave (const unsigned char *page, const int ntimes, const int ntabs,
   // as indicated by the negative bandwidth in the header
   // lastly, polarisations must be writen as IQUV, but pages contain VUQI
 
-  // Tranpose by linearly processing original packets from the page
-  const unsigned char *packet = page;
+  deinterleave_page(page, transposed, ctx->ntabs, ctx->ntimes, DEINTERLEAVE_BLOCK_DEFAULT, DEINTERLEAVE_PREFETCH_DEFAULT);
+}
 
-  // and find the matching address in the transposed buffer
-  int tab = 0;
-  for (tab = 0; tab < ntabs; tab++) {
-    int channel_offset = 0;
-    for (channel_offset = 0; channel_offset < NCHANNELS; channel_offset+=4) {
-      int sequence_number = 0;
-      for (sequence_number = 0; sequence_number < sequence_length; sequence_number++) {
-        // process packet
-        int tn,cn,pn;
-        for (tn = 0; tn < 500; tn++) { // 500 samples per packet
-          for (cn = 0; cn < 4; cn++) { // 4 channels per packet
-            for (pn = 0; pn < NPOLS; pn++) {
-              transposed[
-              (tab * ntimes + 
-               sequence_number * 500 + tn) * NPOLS * NCHANNELS + 
-              (NPOLS - 1 - pn) * NCHANNELS +
-              NCHANNELS - 1 - (channel_offset + cn)
-              ] = *packet++;
-            }
-          }
-        }
-      }
-    }
-  }
+/**
+ * Assemble a synthesized beam from subbands of the deinterleaved TABs
+ *
+ * Input: transposed buffer   [TABS, TIMES, POLS, CHANNELS]
+ * Output: synthesized buffer [TIMES, POLS, CHANNELS]
+ *
+ *  @param {dadafits_context_t *} ctx          Context, provides ntimes
+ *  @param {const uchar[]} transposed           Deinterleaved TABs
+ *  @param {const int[]}   subband_tabs         For each subband the TAB to use, must be valid
+ *  @param {uchar[]}       synthesized          Output buffer for one beam. Size: NCHANNELS*NPOLS*ntimes
+ */
+void dadafits_synthesize(const dadafits_context_t *ctx, const unsigned char *transposed, const int *subband_tabs, unsigned char *synthesized) {
+  synthesize_beam(transposed, subband_tabs, synthesized, ctx->ntimes, SYNTHESIZE_TIME_OUTER_DEFAULT);
 }
@@ -0,0 +1,344 @@
+/**
+ * Background migration of finished output files from a (fast, local) staging
+ * directory to the final output directory.
+ *
+ * Files are handed over by close_fits, copied by a single background thread
+ * using copy_file_range, throttled to a bandwidth budget, verified using the
+ * FITS checksums, and only then removed from the staging area.
+ */
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <libgen.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <fitsio.h>
+
+#include "dadafits_internal.h"
+
+// copy in chunks of 8 MB, so we can throttle at a reasonable granularity
+#define MIGRATE_CHUNK (8 * 1024 * 1024)
+
+typedef struct migrate_job {
+  char *fname;
+  struct migrate_job *next;
+} migrate_job_t;
+
+static int migrate_enabled = 0;
+static char *migrate_destination = NULL;
+static double migrate_rate = 0; // bytes per second, 0 for unlimited
+
+static pthread_t migrate_thread;
+static pthread_mutex_t migrate_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t migrate_cond = PTHREAD_COND_INITIALIZER;
+static migrate_job_t *migrate_head = NULL;
+static migrate_job_t *migrate_tail = NULL;
+static int migrate_closing = 0;
+static int migrate_discard = 0; // files are still being closed by a non-reentrant cfitsio, do not touch the queue
+
+// statistics, only touched by the migration thread until joined
+static int migrate_files_ok = 0;
+static int migrate_files_failed = 0;
+static long long migrate_bytes = 0;
+
+static double now() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + 1e-9 * ts.tv_nsec;
+}
+
+/**
+ * Copy a file from src to dst, sleeping as needed to stay within the bandwidth budget
+ * Falls back to plain read/write when copy_file_range is not supported between the two filesystems
+ *
+ * @returns {int} 0 on success, -1 on failure
+ */
+static int migrate_copy(const char *src, const char *dst) {
+  struct stat st;
+  int in = open(src, O_RDONLY);
+  if (in < 0) {
+    LOG("Migrate: cannot open '%s': %s\n", src, strerror(errno));
+    return -1;
+  }
+  if (fstat(in, &st) < 0) {
+    LOG("Migrate: cannot stat '%s': %s\n", src, strerror(errno));
+    close(in);
+    return -1;
+  }
+  int out = open(dst, O_WRONLY | O_CREAT | O_TRUNC, st.st_mode & 0777);
+  if (out < 0) {
+    LOG("Migrate: cannot create '%s': %s\n", dst, strerror(errno));
+    close(in);
+    return -1;
+  }
+
+  char *bounce = NULL; // only allocated for the read/write fallback
+  int use_copy_file_range = 1;
+  long long done = 0;
+  double start = now();
+
+  while (done < st.st_size) {
+    size_t len = st.st_size - done < MIGRATE_CHUNK ? st.st_size - done : MIGRATE_CHUNK;
+    ssize_t n = -1;
+
+    if (use_copy_file_range) {
+      n = copy_file_range(in, NULL, out, NULL, len, 0);
+      if (n < 0 && (errno == EXDEV || errno == ENOSYS || errno == EOPNOTSUPP || errno == EINVAL)) {
+        LOG("Migrate: copy_file_range not available (%s), falling back to read/write\n", strerror(errno));
+        use_copy_file_range = 0;
+      }
+    }
+    if (! use_copy_file_range) {
+      if (! bounce && ! (bounce = malloc(MIGRATE_CHUNK))) {
+        LOG("Migrate: cannot allocate copy buffer\n");
+        break;
+      }
+      n = pread(in, bounce, len, done);
+      if (n > 0) {
+        ssize_t w = 0;
+        while (w < n) {
+          ssize_t r = pwrite(out, &bounce[w], n - w, done + w);
+          if (r < 0) {
+            n = -1;
+            break;
+          }
+          w += r;
+        }
+      }
+    }
+    if (n <= 0) {
+      LOG("Migrate: copy of '%s' failed after %lli bytes: %s\n", src, done, n < 0 ? strerror(errno) : "unexpected end of file");
+      break;
+    }
+    done += n;
+
+    // throttle: sleep until we are back within the budget
+    if (migrate_rate > 0) {
+      double ahead = done / migrate_rate - (now() - start);
+      if (ahead > 0) {
+        struct timespec ts;
+        ts.tv_sec = (time_t) ahead;
+        ts.tv_nsec = (long) ((ahead - ts.tv_sec) * 1e9);
+        nanosleep(&ts, NULL);
+      }
+    }
+  }
+
+  free(bounce);
+  close(in);
+  // always close, also when flushing failed
+  int failed = 0;
+  if (fsync(out) < 0) {
+    LOG("Migrate: cannot flush '%s': %s\n", dst, strerror(errno));
+    failed = 1;
+  }
+  if (close(out) < 0) {
+    LOG("Migrate: cannot close '%s': %s\n", dst, strerror(errno));
+    failed = 1;
+  }
+  if (failed) {
+    return -1;
+  }
+
+  migrate_bytes += done;
+  return done == st.st_size ? 0 : -1;
+}
+
+/**
+ * Verify the checksums of all HDUs in a (partially copied) FITS file
+ *
+ * @returns {int} 0 when all checksums present are correct, -1 otherwise
+ */
+static int migrate_verify(const char *fname) {
+  fitsfile *fptr;
+  int status = 0;
+  int nhdus, hdu;
+
+  // only FITS files carry checksums, others are checked by size only
+  const char *extension = rindex(fname, '.');
+  if (! extension || strcmp(extension, ".part")) {
+    return 0;
+  }
+  if (extension - fname < 5 || strncmp(extension - 5, ".fits", 5)) {
+    return 0;
+  }
+
+  if (fits_open_file(&fptr, fname, READONLY, &status)) {
+    if (runlog) fits_report_error(runlog, status);
+    return -1;
+  }
+  fits_get_num_hdus(fptr, &nhdus, &status);
+
+  for (hdu = 1; hdu <= nhdus && status == 0; hdu++) {
+    int dataok, hduok;
+    if (fits_movabs_hdu(fptr, hdu, NULL, &status)) break;
+    if (fits_verify_chksum(fptr, &dataok, &hduok, &status)) break;
+
+    // 1: correct, 0: keyword not present, -1: incorrect
+    if (dataok < 0 || hduok < 0) {
+      LOG("Migrate: checksum mismatch in HDU %i of '%s'\n", hdu, fname);
+      status = -1;
+    }
+  }
+
+  int result = status ? -1 : 0;
+  if (status > 0 && runlog) fits_report_error(runlog, status);
+
+  status = 0;
+  fits_close_file(fptr, &status);
+  return result;
+}
+
+static void migrate_one(const char *fname) {
+  char *copy = strdup(fname);
+  char *base = basename(copy);
+  char final[1024];
+  char part[1024];
+
+  snprintf(final, 1024, "%s/%s", migrate_destination, base);
+  snprintf(part, 1024, "%s/.%s.part", migrate_destination, base);
+  free(copy);
+
+  double start = now();
+  if (migrate_copy(fname, part) || migrate_verify(part)) {
+    LOG("Migrate: leaving '%s' in the staging directory\n", fname);
+    unlink(part);
+    migrate_files_failed++;
+    return;
+  }
+
+  if (rename(part, final) < 0) {
+    LOG("Migrate: cannot rename '%s' to '%s': %s\n", part, final, strerror(errno));
+    migrate_files_failed++;
+    return;
+  }
+  unlink(fname);
+  migrate_files_ok++;
+  LOG("Migrated '%s' to '%s' in %.1f s\n", fname, final, now() - start);
+}
+
+static void *migrate_main(void *arg) {
+  // A non-reentrant cfitsio must not be used concurrently with the writer;
+  // in that case only start when all files have been closed
+  int reentrant = fits_is_reentrant();
+
+  while (1) {
+    pthread_mutex_lock(&migrate_lock);
+    while ((! migrate_head || (! reentrant && ! migrate_closing)) && ! (migrate_closing && ! migrate_head)) {
+      pthread_cond_wait(&migrate_cond, &migrate_lock);
+    }
+    migrate_job_t *job = migrate_head;
+    if (job) {
+      migrate_head = job->next;
+      if (! migrate_head) migrate_tail = NULL;
+    }
+    pthread_mutex_unlock(&migrate_lock);
+
+    if (! job) {
+      // closing, and nothing left to do
+      break;
+    }
+
+    if (migrate_discard) {
+      LOG("Migrate: leaving '%s' in the staging directory\n", job->fname);
+      migrate_files_failed++;
+    } else {
+      migrate_one(job->fname);
+    }
+    free(job->fname);
+    free(job);
+  }
+  return NULL;
+}
+
+/**
+ * Start the background migration thread
+ *
+ * @param {const char *} destination  Final output directory
+ * @param {float} rate                Bandwidth budget in MB/s, 0 for unlimited
+ */
+void migrate_init(const char *destination, const float rate) {
+  migrate_destination = strdup(destination ? destination : ".");
+  migrate_rate = rate * 1e6;
+  migrate_enabled = 1;
+
+  LOG("Migrating finished files to '%s' at %s%.1f MB/s\n", migrate_destination, rate > 0 ? "" : "unlimited ", rate);
+  if (pthread_create(&migrate_thread, NULL, migrate_main, NULL)) {
+    LOG("Error: cannot start migration thread\n");
+    exit(EXIT_FAILURE);
+  }
+}
+
+/**
+ * Is migration active, ie. are we writing to a staging directory
+ */
+int migrate_active() {
+  return migrate_enabled;
+}
+
+/**
+ * Queue a closed file for migration, returns immediately
+ * Does nothing when migration is not enabled
+ */
+void migrate_file(const char *fname) {
+  if (! migrate_enabled) {
+    return;
+  }
+
+  migrate_job_t *job = malloc(sizeof(migrate_job_t));
+  job->fname = strdup(fname);
+  job->next = NULL;
+
+  pthread_mutex_lock(&migrate_lock);
+  if (migrate_closing) {
+    // closed after the close timeout, the migration thread may be gone
+    pthread_mutex_unlock(&migrate_lock);
+    free(job->fname);
+    free(job);
+    return;
+  }
+  if (migrate_tail) {
+    migrate_tail->next = job;
+  } else {
+    migrate_head = job;
+  }
+  migrate_tail = job;
+  pthread_cond_signal(&migrate_cond);
+  pthread_mutex_unlock(&migrate_lock);
+}
+
+/**
+ * Wait for all queued files to be migrated, and stop the migration thread
+ *
+ * Files still being closed after the close timeout (see close_pool.c) are not migrated.
+ * Without a reentrant cfitsio, reading the queued files would run concurrently with those closes,
+ * so then the queued files are left in the staging directory as well.
+ */
+void migrate_finish() {
+  if (! migrate_enabled) {
+    return;
+  }
+
+  int pending = close_pool_pending();
+  if (pending) {
+    LOG("Warning: %i files are still being closed, and are left in the staging directory\n", pending);
+  }
+
+  pthread_mutex_lock(&migrate_lock);
+  migrate_discard = pending && ! fits_is_reentrant();
+  if (migrate_discard) {
+    LOG("Warning: cfitsio is not reentrant, not migrating the closed files either\n");
+  }
+  migrate_closing = 1;
+  pthread_cond_signal(&migrate_cond);
+  pthread_mutex_unlock(&migrate_lock);
+
+  pthread_join(migrate_thread, NULL);
+  migrate_enabled = 0;
+
+  LOG("Migrated %i files (%lli bytes), %i failed\n", migrate_files_ok, migrate_bytes, migrate_files_failed);
+}
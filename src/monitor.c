@@ -0,0 +1,130 @@
+/**
+ * Monitoring stream: a small append-only binary file with the health of every TAB, for every page
+ *
+ * The values are computed while packing the Stokes I data, see dadafits_pack_monitor.
+ * The file starts with a header record, followed by one record per TAB per page.
+ * Later runs append records to an existing file with the same header:
+ *
+ * header:
+ *   char   magic[8]        "DADAMON1"
+ *   int32  ntabs
+ *   int32  nchannels       number of channels in the bandpass
+ *   int32  npower          number of total power samples per page
+ *   float  min_frequency   center of the lowest channel, MHz
+ *   float  channelwidth    MHz
+ *   float  page_duration   seconds
+ *
+ * record:
+ *   int64  page            page number since the start of the observation
+ *   int32  tab
+ *   float  bits_set        fraction of bits set in the packed data
+ *   float  bandpass[nchannels]   mean per channel, high to low frequency
+ *   float  rms[nchannels]        standard deviation per channel, high to low frequency
+ *   float  power[npower]         mean over all channels, in bins of 1/npower page
+ *
+ * All numbers are in the byte order of the host.
+ */
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+
+#include "dadafits_internal.h"
+
+static FILE *monitor_file = NULL;
+static long monitor_records = 0;
+
+/**
+ * Open the monitoring file, and write its header when the file is new
+ *
+ * @param {char *} fname            File to append to; created with a header when it does not exist or is empty
+ * @param {int} ntabs               Number of TABs
+ * @param {float} min_frequency     Center of the lowest channel, after downsampling
+ * @param {float} channelwidth      Width of a channel, after downsampling
+ */
+void monitor_init(const char *fname, const int ntabs, const float min_frequency, const float channelwidth) {
+  monitor_file = fopen(fname, "a+b");
+  if (! monitor_file || fseek(monitor_file, 0, SEEK_END) < 0) {
+    LOG("Error: cannot open monitoring file '%s': %s\n", fname, strerror(errno));
+    exit(EXIT_FAILURE);
+  }
+
+  int32_t geometry[3] = {ntabs, NCHANNELS_LOW, DADAFITS_MONITOR_NPOWER};
+  float frequencies[3] = {min_frequency, channelwidth, PAGE_DURATION};
+
+  if (ftell(monitor_file) > 0) {
+    // append to an existing file, which must have the same layout
+    char magic[8];
+    int32_t existing[3];
+
+    rewind(monitor_file);
+    if (fread(magic, 8, 1, monitor_file) != 1 || fread(existing, sizeof(existing), 1, monitor_file) != 1 ||
+        memcmp(magic, "DADAMON1", 8) != 0 || memcmp(existing, geometry, sizeof(geometry)) != 0) {
+      LOG("Error: monitoring file '%s' is not a monitoring file for %i TABs, %i channels\n", fname, ntabs, NCHANNELS_LOW);
+      exit(EXIT_FAILURE);
+    }
+    fseek(monitor_file, 0, SEEK_END);
+    LOG("Appending monitoring data to '%s'\n", fname);
+    return;
+  }
+
+  if (fwrite("DADAMON1", 8, 1, monitor_file) != 1 ||
+      fwrite(geometry, sizeof(geometry), 1, monitor_file) != 1 ||
+      fwrite(frequencies, sizeof(frequencies), 1, monitor_file) != 1) {
+    LOG("Error: cannot write to monitoring file '%s'\n", fname);
+    exit(EXIT_FAILURE);
+  }
+  fflush(monitor_file);
+
+  LOG("Writing monitoring data to '%s'\n", fname);
+}
+
+/**
+ * Is monitoring enabled
+ */
+int monitor_active() {
+  return monitor_file != NULL;
+}
+
+/**
+ * Append the record for one TAB; monitoring stops (with a warning) when the file cannot be written
+ *
+ * @param {long} page                     Page number since the start of the observation
+ * @param {int} tab                       TAB
+ * @param {dadafits_monitor_t *} monitor  Values from dadafits_pack_monitor
+ */
+void monitor_write(const long page, const int tab, const dadafits_monitor_t *monitor) {
+  if (! monitor_file) {
+    return;
+  }
+
+  int64_t record_page = page;
+  int32_t record_tab = tab;
+
+  if (fwrite(&record_page, sizeof(record_page), 1, monitor_file) != 1 ||
+      fwrite(&record_tab, sizeof(record_tab), 1, monitor_file) != 1 ||
+      fwrite(&monitor->bits_set, sizeof(float), 1, monitor_file) != 1 ||
+      fwrite(monitor->bandpass, sizeof(monitor->bandpass), 1, monitor_file) != 1 ||
+      fwrite(monitor->rms, sizeof(monitor->rms), 1, monitor_file) != 1 ||
+      fwrite(monitor->power, sizeof(monitor->power), 1, monitor_file) != 1 ||
+      fflush(monitor_file)) {
+    // monitoring must never stop the data from being written
+    LOG("Warning: cannot write monitoring data: %s, monitoring stopped\n", strerror(errno));
+    fclose(monitor_file);
+    monitor_file = NULL;
+    return;
+  }
+  monitor_records++;
+}
+
+/**
+ * Close the monitoring file
+ */
+void monitor_close() {
+  if (! monitor_file) {
+    return;
+  }
+  fclose(monitor_file);
+  monitor_file = NULL;
+  LOG("Wrote %li monitoring records\n", monitor_records);
+}
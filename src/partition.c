@@ -0,0 +1,289 @@
+/**
+ * Share the synthesized beams of one ringbuffer between cooperating processes on a node
+ *
+ * Each of the N processes takes a fixed part of the selected synthesized beams.
+ * Partition 0 is the primary reader of the ringbuffer, the others attach as viewers.
+ * A small shared memory segment, named after the ringbuffer key, holds for every partition
+ * the number of pages it has finished. The primary releases a page only when all partitions
+ * are done with it, so the writer never reuses a page that is still being read by a viewer.
+ */
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "dadafits_internal.h"
+
+// give up on a partition that did not finish a page for this long (seconds)
+#define PARTITION_TIMEOUT 30.0
+
+typedef struct {
+  int nparts;
+  int attached[PARTITIONS_MAX];    // set by a partition to its process id
+  int accepted[PARTITIONS_MAX];    // set by the primary to the process id it saw attach
+  int finished[PARTITIONS_MAX];
+  long done[PARTITIONS_MAX];       // pages finished, ie. index of the last page + 1
+} partition_shm_t;
+
+static partition_shm_t *shared = NULL;
+static char shm_name[64];
+static ino_t shm_inode = 0;
+static int partition = 0;
+static int partitions = 1;
+
+static int dropped[PARTITIONS_MAX];        // primary only: partitions we stopped waiting for
+static long partition_waits = 0;           // primary only: pages we had to wait for
+static double partition_wait_time = 0;     // primary only: total time spent waiting
+
+static double now() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + 1e-9 * ts.tv_nsec;
+}
+
+static void pause_briefly() {
+  struct timespec ts = {0, 200000}; // 0.2 ms, short compared to a page
+  nanosleep(&ts, NULL);
+}
+
+/**
+ * Parse a partition specification
+ *
+ * @param {char *} spec     Partition as "i/N"
+ * @param {int *} part      Set to i
+ * @param {int *} nparts    Set to N
+ * @returns {int}           0 on success, -1 for an invalid specification
+ */
+int partition_parse(const char *spec, int *part, int *nparts) {
+  if (sscanf(spec, "%i/%i", part, nparts) != 2) {
+    return -1;
+  }
+  if (*nparts < 1 || *nparts > PARTITIONS_MAX || *part < 0 || *part >= *nparts) {
+    return -1;
+  }
+  return 0;
+}
+
+/**
+ * Has the segment we mapped been replaced by a newer one with the same name
+ */
+static int partition_replaced() {
+  struct stat st;
+  int replaced = 0;
+
+  int fd = shm_open(shm_name, O_RDWR, 0);
+  if (fd >= 0) {
+    replaced = fstat(fd, &st) == 0 && st.st_ino != shm_inode;
+    close(fd);
+  }
+  return replaced;
+}
+
+/**
+ * Map the segment, waiting for the primary to create it
+ */
+static void partition_map() {
+  struct stat st;
+  int fd;
+
+  if (partition == 0) {
+    // remove a segment left behind by an earlier run
+    shm_unlink(shm_name);
+    fd = shm_open(shm_name, O_CREAT | O_EXCL | O_RDWR, 0660);
+    if (fd < 0 || ftruncate(fd, sizeof(partition_shm_t)) < 0) {
+      LOG("Error: cannot create shared memory '%s': %s\n", shm_name, strerror(errno));
+      exit(EXIT_FAILURE);
+    }
+  } else {
+    while ((fd = shm_open(shm_name, O_RDWR, 0)) < 0) {
+      if (errno != ENOENT) {
+        LOG("Error: cannot open shared memory '%s': %s\n", shm_name, strerror(errno));
+        exit(EXIT_FAILURE);
+      }
+      sleep(1);
+    }
+    // the primary may not have sized the segment yet
+    while (fstat(fd, &st) == 0 && st.st_size < sizeof(partition_shm_t)) {
+      pause_briefly();
+    }
+  }
+  if (fstat(fd, &st) < 0) {
+    LOG("Error: cannot stat shared memory '%s': %s\n", shm_name, strerror(errno));
+    exit(EXIT_FAILURE);
+  }
+  shm_inode = st.st_ino;
+
+  shared = mmap(NULL, sizeof(partition_shm_t), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  close(fd);
+  if (shared == MAP_FAILED) {
+    LOG("Error: cannot map shared memory '%s': %s\n", shm_name, strerror(errno));
+    exit(EXIT_FAILURE);
+  }
+}
+
+/**
+ * Attach to the shared memory segment of the ringbuffer
+ * The primary (partition 0) creates the segment, and waits for the other partitions to attach,
+ * so that no viewer misses the first page.
+ *
+ * A segment left behind by a run that did not finish can still be there when a viewer starts.
+ * A viewer therefore only continues when the primary accepted its process id; until then,
+ * it checks whether the primary replaced the segment, and maps the new one.
+ *
+ * @param {char *} key    Hexadecimal key of the input ringbuffer
+ * @param {int} part      This partition
+ * @param {int} nparts    Number of partitions
+ */
+void partition_init(const char *key, const int part, const int nparts) {
+  int p;
+
+  partition = part;
+  partitions = nparts;
+  snprintf(shm_name, 64, "/dadafits_%s", key);
+
+  if (partition == 0) {
+    partition_map();
+    __atomic_store_n(&shared->nparts, partitions, __ATOMIC_RELEASE);
+    LOG("Partition 0/%i: waiting for the other partitions to attach\n", partitions);
+    for (p = 1; p < partitions; p++) {
+      int id;
+      while (! (id = __atomic_load_n(&shared->attached[p], __ATOMIC_ACQUIRE))) {
+        pause_briefly();
+      }
+      __atomic_store_n(&shared->accepted[p], id, __ATOMIC_RELEASE);
+      LOG("Partition %i/%i attached\n", p, partitions);
+    }
+    return;
+  }
+
+  const int id = getpid();
+  LOG("Waiting for partition 0 to create '%s'\n", shm_name);
+  partition_map();
+
+  double checked = now();
+  while (__atomic_load_n(&shared->accepted[partition], __ATOMIC_ACQUIRE) != id) {
+    if (__atomic_load_n(&shared->nparts, __ATOMIC_ACQUIRE) != 0) {
+      __atomic_store_n(&shared->attached[partition], id, __ATOMIC_RELEASE);
+    }
+    pause_briefly();
+
+    if (now() - checked > 1.0) {
+      checked = now();
+      if (partition_replaced()) {
+        LOG("Shared memory '%s' was replaced, attaching again\n", shm_name);
+        munmap(shared, sizeof(partition_shm_t));
+        partition_map();
+      }
+    }
+  }
+
+  if (shared->nparts != partitions) {
+    LOG("Error: partition 0 uses %i partitions, not %i\n", shared->nparts, partitions);
+    exit(EXIT_FAILURE);
+  }
+  LOG("Attached as partition %i/%i\n", partition, partitions);
+}
+
+/**
+ * Are we one of a set of cooperating processes
+ */
+int partition_active() {
+  return shared != NULL;
+}
+
+/**
+ * Deselect the synthesized beams that belong to other partitions
+ * The selected beams are split in consecutive blocks of (almost) equal size, in order of beam number.
+ */
+void partition_select_beams() {
+  int index;
+  const int nselected = synthesized_beam_nselected;
+
+  int first = (partition * nselected) / partitions;
+  int last = ((partition + 1) * nselected) / partitions; // exclusive
+
+  LOG("Partition %i/%i synthesized beams:", partition, partitions);
+  for (index = 0; index < nselected; index++) {
+    const int sb = synthesized_beam_list[index];
+    if (index < first || index >= last) {
+      synthesized_beam_deselect(sb);
+    } else {
+      LOG(" %i", sb);
+    }
+  }
+  LOG("\n");
+  synthesized_beam_update_list();
+
+  if (first == last) {
+    LOG("Warning: no synthesized beams left for partition %i\n", partition);
+  }
+}
+
+/**
+ * Finish with a page
+ * The other partitions report it to the primary, the primary waits until all partitions reported it.
+ *
+ * @param {long} page   Absolute index of the page
+ */
+void partition_release(const long page) {
+  int p;
+
+  if (! shared) {
+    return;
+  }
+
+  if (partition != 0) {
+    __atomic_store_n(&shared->done[partition], page + 1, __ATOMIC_RELEASE);
+    return;
+  }
+
+  double start = now();
+  int waited = 0;
+  for (p = 1; p < partitions; p++) {
+    long seen = __atomic_load_n(&shared->done[p], __ATOMIC_ACQUIRE);
+    double progress = start;
+
+    while (! dropped[p] && seen <= page && ! __atomic_load_n(&shared->finished[p], __ATOMIC_ACQUIRE)) {
+      waited = 1;
+      pause_briefly();
+
+      long current = __atomic_load_n(&shared->done[p], __ATOMIC_ACQUIRE);
+      if (current != seen) {
+        seen = current;
+        progress = now();
+      } else if (now() - progress > PARTITION_TIMEOUT) {
+        LOG("Warning: partition %i made no progress for %.0f s, no longer waiting for it\n", p, PARTITION_TIMEOUT);
+        dropped[p] = 1;
+      }
+    }
+  }
+
+  if (waited) {
+    partition_waits++;
+    partition_wait_time += now() - start;
+  }
+}
+
+/**
+ * Detach from the shared memory segment
+ * The primary removes the segment, the others tell the primary not to wait for them any more.
+ */
+void partition_close() {
+  if (! shared) {
+    return;
+  }
+
+  if (partition == 0) {
+    LOG("Partition 0/%i waited for the other partitions on %li pages, %.1f s in total\n", partitions, partition_waits, partition_wait_time);
+    munmap(shared, sizeof(partition_shm_t));
+    shm_unlink(shm_name);
+  } else {
+    __atomic_store_n(&shared->finished[partition], 1, __ATOMIC_RELEASE);
+    munmap(shared, sizeof(partition_shm_t));
+  }
+  shared = NULL;
+}
@@ -0,0 +1,303 @@
+/**
+ * Hardware performance counters per pipeline stage and worker thread
+ *
+ * Every stage run on a worker thread (see run_workers) is counted with a group of counters
+ * of that thread: cycles, instructions, last level cache misses, and data TLB misses.
+ * The group of a thread is opened by the thread itself on its first stage, and stays open;
+ * a stage only enables and disables it. Work that is started while the thread is already
+ * counting (run_workers from within write_row) is counted once, in the outer stage.
+ * The totals are kept per stage and thread, logged at exit, and optionally written to a file:
+ * one line per stage and thread, with the columns
+ *
+ *   <stage> <thread> <runs> <cycles> <instructions> <llc misses> <dtlb misses>
+ *
+ * Counters the machine does not support are written as -1. When counters cannot be opened at all
+ * (no permission, see /proc/sys/kernel/perf_event_paranoid), counting is disabled with a warning.
+ */
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+
+#include "dadafits_internal.h"
+
+static const char *perf_stage_names[PERF_NSTAGES] = {
+  "downsample", "correct", "statistics", "pack", "fold", "deinterleave", "synthesize", "write"
+};
+
+static const char *perf_counter_names[PERF_NCOUNTERS] = {
+  "cycles", "instructions", "llc-misses", "dtlb-misses"
+};
+
+static const struct {
+  unsigned int type;
+  unsigned long long config;
+} perf_events[PERF_NCOUNTERS] = {
+  {PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES},
+  {PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS},
+  {PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES},
+  {PERF_TYPE_HW_CACHE, PERF_COUNT_HW_CACHE_DTLB | (PERF_COUNT_HW_CACHE_OP_READ << 8) | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16)}
+};
+
+static int perf_enabled = 0;
+static char *perf_file = NULL;
+static int perf_supported[PERF_NCOUNTERS];
+static int perf_nthreads = 0;
+static int perf_current = PERF_DOWNSAMPLE;
+
+// per thread: the group, leader first (-1 when not counting, -2 before it is opened),
+// the nesting depth, the stage being counted, and the values of the last read
+typedef struct {
+  int fd[PERF_NCOUNTERS];
+  int depth;
+  int stage;
+  unsigned long long last[3 + PERF_NCOUNTERS];
+} perf_thread_t;
+static perf_thread_t *perf_threads = NULL;
+
+// totals, [stage][thread][counter], and runs per [stage][thread]
+static unsigned long long *perf_counts = NULL;
+static long *perf_runs = NULL;
+
+static int perf_open(const int counter, const int group) {
+  struct perf_event_attr attr;
+
+  memset(&attr, 0, sizeof(attr));
+  attr.size = sizeof(attr);
+  attr.type = perf_events[counter].type;
+  attr.config = perf_events[counter].config;
+  attr.disabled = group < 0 ? 1 : 0; // the leader starts the group
+  attr.exclude_kernel = 1;
+  attr.exclude_hv = 1;
+  attr.read_format = PERF_FORMAT_GROUP | PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+
+  // this thread, any cpu
+  return syscall(__NR_perf_event_open, &attr, 0, -1, group, 0);
+}
+
+/**
+ * Enable counting, and check which counters this machine supports
+ *
+ * @param {char *} fname    File to write the totals to at exit, NULL to only log them
+ */
+void perf_init(const char *fname) {
+  int c, nsupported = 0;
+
+  int leader = perf_open(0, -1);
+  if (leader < 0) {
+    LOG("Warning: hardware performance counters are not available: %s\n", strerror(errno));
+    return;
+  }
+  perf_supported[0] = 1;
+  for (c = 1; c < PERF_NCOUNTERS; c++) {
+    int fd = perf_open(c, leader);
+    perf_supported[c] = fd >= 0;
+    if (fd >= 0) {
+      close(fd);
+    }
+  }
+  close(leader);
+
+  perf_nthreads = worker_threads;
+  perf_counts = calloc(PERF_NSTAGES * perf_nthreads * PERF_NCOUNTERS, sizeof(unsigned long long));
+  perf_runs = calloc(PERF_NSTAGES * perf_nthreads, sizeof(long));
+  perf_threads = calloc(perf_nthreads, sizeof(perf_thread_t));
+  if (! perf_counts || ! perf_runs || ! perf_threads) {
+    LOG("Error: cannot allocate performance counter totals\n");
+    exit(EXIT_FAILURE);
+  }
+  for (c = 0; c < perf_nthreads; c++) {
+    perf_threads[c].fd[0] = -2;
+  }
+  perf_file = fname ? strdup(fname) : NULL;
+  perf_enabled = 1;
+
+  LOG("Counting per stage:");
+  for (c = 0; c < PERF_NCOUNTERS; c++) {
+    if (perf_supported[c]) {
+      LOG(" %s", perf_counter_names[c]);
+      nsupported++;
+    }
+  }
+  LOG(" (%i of %i counters supported)\n", nsupported, PERF_NCOUNTERS);
+}
+
+/**
+ * Is counting enabled
+ */
+int perf_active() {
+  return perf_enabled;
+}
+
+/**
+ * Set the stage of the work that follows, until the next call
+ *
+ * @param {int} stage   One of PERF_*
+ */
+void perf_stage(const int stage) {
+  perf_current = stage;
+}
+
+/**
+ * Open the group of the calling thread
+ */
+static void perf_open_group(perf_thread_t *counting) {
+  int c;
+
+  counting->fd[0] = perf_open(0, -1);
+  for (c = 1; c < PERF_NCOUNTERS; c++) {
+    counting->fd[c] = counting->fd[0] >= 0 && perf_supported[c] ? perf_open(c, counting->fd[0]) : -1;
+  }
+}
+
+/**
+ * Start counting on the calling thread, for the current stage
+ * Does nothing when the thread is already counting
+ *
+ * @param {int} thread    Worker thread index, the calling thread must always have the same index
+ */
+void perf_begin(const int thread) {
+  if (! perf_enabled || thread >= perf_nthreads) {
+    return;
+  }
+  perf_thread_t *counting = &perf_threads[thread];
+
+  if (counting->depth++ > 0) {
+    return;
+  }
+  if (counting->fd[0] == -2) {
+    perf_open_group(counting);
+  }
+  if (counting->fd[0] >= 0) {
+    counting->stage = perf_current;
+    ioctl(counting->fd[0], PERF_EVENT_IOC_ENABLE, PERF_IOC_FLAG_GROUP);
+  }
+}
+
+/**
+ * Stop counting on the calling thread, and add the counts to the stage
+ *
+ * @param {int} thread    Worker thread index, as passed to perf_begin
+ */
+void perf_end(const int thread) {
+  // nr, time enabled, time running, and a value per counter in the group
+  unsigned long long values[3 + PERF_NCOUNTERS];
+  int c, n;
+
+  if (! perf_enabled || thread >= perf_nthreads) {
+    return;
+  }
+  perf_thread_t *counting = &perf_threads[thread];
+
+  if (--counting->depth > 0 || counting->fd[0] < 0) {
+    return;
+  }
+  ioctl(counting->fd[0], PERF_EVENT_IOC_DISABLE, PERF_IOC_FLAG_GROUP);
+
+  memset(values, 0, sizeof(values));
+  if (read(counting->fd[0], values, sizeof(values)) <= 0) {
+    return;
+  }
+
+  // the counters keep running totals, count the difference with the last read;
+  // scale up when the group was multiplexed with other users of the counters
+  const unsigned long long enabled = values[1] - counting->last[1];
+  const unsigned long long running = values[2] - counting->last[2];
+  const double scale = running > 0 ? (double) enabled / running : 1.0;
+  unsigned long long *counts = &perf_counts[(counting->stage * perf_nthreads + thread) * PERF_NCOUNTERS];
+
+  // the values are in the order the counters were added to the group
+  for (c = 0, n = 0; c < PERF_NCOUNTERS && n < values[0]; c++) {
+    if (c == 0 || counting->fd[c] >= 0) {
+      counts[c] += (values[3 + n] - counting->last[3 + n]) * scale;
+      n++;
+    }
+  }
+  memcpy(counting->last, values, sizeof(values));
+  perf_runs[counting->stage * perf_nthreads + thread]++;
+}
+
+/**
+ * Log the totals per stage, and write the totals per stage and thread to the file
+ */
+void perf_report() {
+  int s, t, c;
+
+  if (! perf_enabled) {
+    return;
+  }
+
+  FILE *file = NULL;
+  if (perf_file) {
+    file = fopen(perf_file, "w");
+    if (! file) {
+      LOG("Warning: cannot write performance counters to '%s': %s\n", perf_file, strerror(errno));
+    } else {
+      fprintf(file, "# stage thread runs");
+      for (c = 0; c < PERF_NCOUNTERS; c++) {
+        fprintf(file, " %s", perf_counter_names[c]);
+      }
+      fprintf(file, "\n");
+    }
+  }
+
+  LOG("Performance counters per stage (all threads): cycles, instructions per cycle, LLC and dTLB misses per 1000 instructions\n");
+  for (s = 0; s < PERF_NSTAGES; s++) {
+    unsigned long long total[PERF_NCOUNTERS] = {0};
+    long runs = 0;
+
+    for (t = 0; t < perf_nthreads; t++) {
+      const unsigned long long *counts = &perf_counts[(s * perf_nthreads + t) * PERF_NCOUNTERS];
+      const long thread_runs = perf_runs[s * perf_nthreads + t];
+      if (thread_runs == 0) {
+        continue;
+      }
+      runs += thread_runs;
+      for (c = 0; c < PERF_NCOUNTERS; c++) {
+        total[c] += counts[c];
+      }
+
+      if (file) {
+        fprintf(file, "%s %i %li", perf_stage_names[s], t, thread_runs);
+        for (c = 0; c < PERF_NCOUNTERS; c++) {
+          if (perf_supported[c]) {
+            fprintf(file, " %llu", counts[c]);
+          } else {
+            fprintf(file, " -1");
+          }
+        }
+        fprintf(file, "\n");
+      }
+    }
+    if (runs == 0 || total[1] == 0) {
+      continue;
+    }
+
+    LOG("  %-12s %14llu cycles, IPC %.2f", perf_stage_names[s], total[0], (double) total[1] / (total[0] ? total[0] : 1));
+    if (perf_supported[2]) {
+      LOG(", LLC %.2f", 1e3 * total[2] / total[1]);
+    }
+    if (perf_supported[3]) {
+      LOG(", dTLB %.2f", 1e3 * total[3] / total[1]);
+    }
+    LOG("\n");
+  }
+
+  if (file) {
+    fclose(file);
+    LOG("Wrote performance counters per stage and thread to '%s'\n", perf_file);
+  }
+
+  // the worker threads are stopped or idle, close their groups
+  perf_enabled = 0;
+  for (t = 0; t < perf_nthreads; t++) {
+    for (c = PERF_NCOUNTERS - 1; c >= 0; c--) {
+      if (perf_threads[t].fd[c] >= 0) {
+        close(perf_threads[t].fd[c]);
+      }
+    }
+  }
+}
@@ -0,0 +1,509 @@
+/**
+ * Processing of a single page, specialized for every combination of science case and mode
+ *
+ * The variants are generated from the list in DADAFITS_PIPELINES, so within a variant the number
+ * of TABs and samples are compile-time constants, and the compiler can unroll and vectorize the
+ * inlined kernels (see kernels.h). The variant is chosen once at startup by pipeline_init.
+ *
+ * Within a beam, the work is split over the worker threads: downsampling, the corrections, the statistics for packing,
+ * and deinterleaving by channel, the packing itself and the zero-DM levels by time. So also the single beam (IAB) modes use all cores.
+ */
+#include <stdlib.h>
+#include <string.h>
+
+#include "dadafits_internal.h"
+#include "kernels.h"
+
+// Supported combinations: science case, science mode, number of TABs, samples per page, and the processing
+#define DADAFITS_PIPELINES(X) \
+  X(3, 0,  9, SC3_NTIMES, stokes_i) \
+  X(3, 1,  9, SC3_NTIMES, stokes_iquv) \
+  X(3, 2,  1, SC3_NTIMES, stokes_i) \
+  X(3, 3,  1, SC3_NTIMES, stokes_iquv) \
+  X(4, 0, 12, SC4_NTIMES, stokes_i) \
+  X(4, 1, 12, SC4_NTIMES, stokes_iquv) \
+  X(4, 2,  1, SC4_NTIMES, stokes_i) \
+  X(4, 3,  1, SC4_NTIMES, stokes_iquv)
+
+static const dadafits_context_t *context = NULL;
+static int synthesize = 0; // write synthesized beams instead of TABs
+
+// Memory buffers
+static unsigned int downsampled[NCHANNELS_LOW * NTIMES_LOW];
+static unsigned char packed[NCHANNELS_LOW * NTIMES_LOW / 8];
+static unsigned char *transposed = NULL; // Stokes IQUV buffer of approx 2 GB, allocated only when necessary
+static unsigned char *synthesized = NULL; // Stokes IQUV for a single synthesized beam
+static dadafits_monitor_t monitor;
+static unsigned long long *monitor_power = NULL; // partial sums per worker thread, [worker_threads][DADAFITS_MONITOR_NPOWER]
+static unsigned long *monitor_ones = NULL;       // partial sums per worker thread, [worker_threads]
+
+// Packing statistics, for the report at the end
+static long *flat_channels = NULL; // channels without variance, per worker thread
+static long packed_rows = 0;
+
+// Running statistics over pages, per TAB and channel (low to high frequency); see ewma_worker
+static double ewma_alpha = 0; // weight of the newest page, 0 to normalize every page by itself
+static double ewma_mean[NTABS_MAX][NCHANNELS_LOW];
+static double ewma_variance[NTABS_MAX][NCHANNELS_LOW];
+static int ewma_started[NTABS_MAX];
+static unsigned int ewma_cutoff[NCHANNELS_LOW];
+static unsigned long long ewma_sum[NCHANNELS_LOW];
+static unsigned long long ewma_sos[NCHANNELS_LOW];
+
+// Zero-DM: sum over channels per sample, and its average over the page
+static unsigned long long zero_dm_level[NTIMES_LOW];
+static unsigned long long zero_dm_average = 0;
+
+// Work on one beam, shared by the worker threads; the geometry is compiled into the workers of every variant
+typedef struct {
+  const unsigned char *buffer; // Stokes I: one TAB of the page, Stokes IQUV: the page
+  int tab;                     // Stokes I: the TAB, Stokes IQUV: the synthesized beam
+  int fused;                   // Stokes I with running statistics: downsample and threshold in one pass
+} beam_work_t;
+
+// Workers that depend on the geometry, generated for every variant with PIPELINE_WORKERS
+typedef struct {
+  worker_func_t downsample;
+  worker_func_t ewma;
+  worker_func_t deinterleave;
+  worker_func_t synthesize;
+} variant_workers_t;
+
+/**
+ * Worker: downsample a range of channels
+ */
+DADAFITS_INLINE void downsample_worker(void *arg, const int thread, const int nthreads, const int science_case) {
+  const beam_work_t *work = (beam_work_t *) arg;
+  const int first = thread * NCHANNELS_LOW / nthreads;
+  const int last = (thread + 1) * NCHANNELS_LOW / nthreads;
+
+  downsample_channels(work->buffer, context->padded_size, downsampled, first, last,
+      science_case == 3 ? SC3_DOWNSAMPLE_TIME : SC4_DOWNSAMPLE_TIME, kernel_tuning.downsample_prefetch);
+}
+
+/**
+ * Worker: flatten the bandpass for a range of channels
+ */
+static void flatten_worker(void *arg, const int thread, const int nthreads) {
+  const int first = thread * NCHANNELS_LOW / nthreads;
+  const int last = (thread + 1) * NCHANNELS_LOW / nthreads;
+
+  flatten_channels(downsampled, first, last);
+}
+
+/**
+ * Worker: zero-DM levels for a range of samples
+ */
+static void zero_dm_level_worker(void *arg, const int thread, const int nthreads) {
+  const int first = thread * NTIMES_LOW / nthreads;
+  const int last = (thread + 1) * NTIMES_LOW / nthreads;
+
+  zero_dm_levels(downsampled, first, last, zero_dm_level);
+}
+
+/**
+ * Worker: subtract the zero-DM levels from a range of channels
+ */
+static void zero_dm_worker(void *arg, const int thread, const int nthreads) {
+  const int first = thread * NCHANNELS_LOW / nthreads;
+  const int last = (thread + 1) * NCHANNELS_LOW / nthreads;
+
+  zero_dm_channels(downsampled, first, last, zero_dm_level, zero_dm_average);
+}
+
+/**
+ * Worker: offset, scale, and threshold for a range of channels, with the monitoring data when enabled
+ */
+static void statistics_worker(void *arg, const int thread, const int nthreads) {
+  const int first = thread * NCHANNELS_LOW / nthreads;
+  const int last = (thread + 1) * NCHANNELS_LOW / nthreads;
+
+  if (monitor_active()) {
+    flat_channels[thread] += pack_statistics(context, downsampled, first, last, &monitor, &monitor_power[thread * DADAFITS_MONITOR_NPOWER], &monitor_ones[thread]);
+  } else {
+    flat_channels[thread] += pack_statistics(context, downsampled, first, last, NULL, NULL, NULL);
+  }
+}
+
+/**
+ * Worker: threshold a range of channels with the running statistics, and update those with this page
+ *
+ * Offset and scale are those of the statistics used for the threshold. The statistics are updated
+ * as an exponentially weighted mixture: with weight alpha for the page, and page mean m and variance v,
+ *   mean' = mean + alpha (m - mean)
+ *   variance' = (1 - alpha) (variance + alpha (m - mean)^2) + alpha v
+ */
+DADAFITS_INLINE void ewma_worker(void *arg, const int thread, const int nthreads, const int science_case) {
+  const beam_work_t *work = (beam_work_t *) arg;
+  const int first = thread * NCHANNELS_LOW / nthreads;
+  const int last = (thread + 1) * NCHANNELS_LOW / nthreads;
+  double *mean = ewma_mean[work->tab];
+  double *variance = ewma_variance[work->tab];
+  int dc, dt;
+
+  if (! ewma_started[work->tab]) {
+    // first page: start from the statistics of the page itself
+    for (dc = first; dc < last; dc++) {
+      const unsigned int *temp1 = &downsampled[dc * NTIMES_LOW];
+      unsigned long long sum = 0;
+      unsigned long long sos = 0;
+      for (dt = 0; dt < NTIMES_LOW; dt++) {
+        sos += (*temp1) * (*temp1);
+        sum += *temp1++;
+      }
+      mean[dc] = sum / (double) NTIMES_LOW;
+      variance[dc] = (NTIMES_LOW * sos - sum * sum) / ((double) NTIMES_LOW * NTIMES_LOW);
+    }
+  }
+
+  // Take care of high-to-low frequency order in packed array
+  for (dc = first; dc < last; dc++) {
+    const float std = sqrt(variance[dc]);
+    ewma_cutoff[dc] = mean[dc];
+    context->offset[NCHANNELS_LOW-1-dc] = mean[dc] - std;
+    context->scale[NCHANNELS_LOW-1-dc] = 2.0 * std;
+  }
+
+  if (work->fused) {
+    downsample_threshold_channels(work->buffer, context->padded_size, downsampled, first, last,
+        science_case == 3 ? SC3_DOWNSAMPLE_TIME : SC4_DOWNSAMPLE_TIME, kernel_tuning.downsample_prefetch,
+        ewma_cutoff, ewma_sum, ewma_sos);
+  } else {
+    threshold_channels(downsampled, first, last, ewma_cutoff, ewma_sum, ewma_sos);
+  }
+
+  for (dc = first; dc < last; dc++) {
+    const unsigned long long page_variance = NTIMES_LOW * ewma_sos[dc] - ewma_sum[dc] * ewma_sum[dc];
+    if (page_variance == 0) {
+      flat_channels[thread]++;
+    }
+
+    const double delta = ewma_sum[dc] / (double) NTIMES_LOW - mean[dc];
+    mean[dc] += ewma_alpha * delta;
+    variance[dc] = (1.0 - ewma_alpha) * (variance[dc] + ewma_alpha * delta * delta) +
+      ewma_alpha * page_variance / ((double) NTIMES_LOW * NTIMES_LOW);
+  }
+}
+
+/**
+ * Worker: pack a range of samples to bits
+ */
+static void bits_worker(void *arg, const int thread, const int nthreads) {
+  const int first = thread * NTIMES_LOW / nthreads;
+  const int last = (thread + 1) * NTIMES_LOW / nthreads;
+
+  pack_bits(downsampled, packed, first, last);
+}
+
+/**
+ * Worker: deinterleave a range of channels, in whole blocks of packets
+ */
+DADAFITS_INLINE void deinterleave_worker(void *arg, const int thread, const int nthreads, const int ntabs, const int ntimes) {
+  const beam_work_t *work = (beam_work_t *) arg;
+  const int block = kernel_tuning.deinterleave_block;
+  const int nblocks = NCHANNELS / (4 * block);
+  const int first = thread * nblocks / nthreads * 4 * block;
+  const int last = (thread + 1) * nblocks / nthreads * 4 * block;
+
+  deinterleave_channels(work->buffer, transposed, ntabs, ntimes, first, last, block, kernel_tuning.deinterleave_prefetch);
+}
+
+/**
+ * Worker: assemble a range of samples of a weighted synthesized beam
+ */
+DADAFITS_INLINE void synthesize_worker(void *arg, const int thread, const int nthreads, const int ntimes) {
+  const beam_work_t *work = (beam_work_t *) arg;
+  const int first = thread * ntimes / nthreads;
+  const int last = (thread + 1) * ntimes / nthreads;
+
+  synthesize_weighted_beam(transposed, synthesized_beam_terms[work->tab], synthesized, ntimes, first, last);
+}
+
+/**
+ * Set the scale of every channel to the sum of the weights of its subband, or to 1
+ */
+static void set_synthesized_scale(const int sb) {
+  int pn, band, f;
+
+  for (pn = 0; pn < NPOLS; pn++) {
+    for (band = 0; band < NSUBBANDS; band++) {
+      const float scale = sb < 0 ? 1.0 : synthesized_beam_terms[sb][band].scale;
+      float *channels = &context->scale[pn * NCHANNELS + (NSUBBANDS - 1 - band) * FREQS_PER_SUBBAND];
+      for (f = 0; f < FREQS_PER_SUBBAND; f++) {
+        channels[f] = scale;
+      }
+    }
+  }
+}
+
+/**
+ * Stokes I data to compress, downsample, and write
+ */
+DADAFITS_INLINE void stokes_i(const unsigned char *page, const long page_index, const float telaz, const float telza,
+    const int science_case, const int ntabs, const int ntimes, const variant_workers_t *workers) {
+  const int padded_size = context->padded_size;
+  beam_work_t work = {NULL, 0, 0};
+  int tab, t, bin;
+  unsigned long long total;
+
+  for (tab = 0; tab < ntabs && ! drain_expired; tab++) {
+    work.buffer = &page[tab * NCHANNELS * padded_size];
+    work.tab = tab;
+
+    // with running statistics the thresholds are known, and downsampling and thresholding are a single pass;
+    // unless the downsampled data itself is needed first
+    work.fused = ewma_alpha > 0 && ewma_started[tab] && ! fold_active() && ! zero_dm && ! flatten_bandpass;
+
+    // move data from the page to the downsampled array
+    perf_stage(PERF_DOWNSAMPLE);
+    if (! work.fused) {
+      run_workers(workers->downsample, &work, worker_threads);
+    }
+
+    // corrections on the downsampled data, in place
+    perf_stage(PERF_CORRECT);
+    if (flatten_bandpass) {
+      run_workers(flatten_worker, &work, worker_threads);
+    }
+    if (zero_dm) {
+      run_workers(zero_dm_level_worker, &work, worker_threads);
+      total = 0;
+      for (t = 0; t < NTIMES_LOW; t++) {
+        total += zero_dm_level[t];
+      }
+      zero_dm_average = total / NTIMES_LOW;
+      run_workers(zero_dm_worker, &work, worker_threads);
+    }
+
+    // fold before packing, as packing overwrites the downsampled array
+    if (fold_active()) {
+      perf_stage(PERF_FOLD);
+      fold_page(tab, page_index, downsampled);
+    }
+
+    // pack data from the downsampled array to the packed array,
+    // and set scale and offset arrays with used values
+    perf_stage(PERF_STATISTICS);
+    if (ewma_alpha > 0) {
+      run_workers(workers->ewma, &work, worker_threads);
+      ewma_started[tab] = 1;
+    } else {
+      if (monitor_active()) {
+        memset(monitor_power, 0, worker_threads * DADAFITS_MONITOR_NPOWER * sizeof(unsigned long long));
+        memset(monitor_ones, 0, worker_threads * sizeof(unsigned long));
+      }
+      run_workers(statistics_worker, &work, worker_threads);
+    }
+    perf_stage(PERF_PACK);
+    run_workers(bits_worker, &work, worker_threads);
+    packed_rows++;
+
+    if (monitor_active()) {
+      // combine the partial sums of the threads
+      unsigned long long power[DADAFITS_MONITOR_NPOWER] = {0};
+      unsigned long ones = 0;
+      for (t = 0; t < worker_threads; t++) {
+        for (bin = 0; bin < DADAFITS_MONITOR_NPOWER; bin++) {
+          power[bin] += monitor_power[t * DADAFITS_MONITOR_NPOWER + bin];
+        }
+        ones += monitor_ones[t];
+      }
+      pack_monitor_totals(&monitor, power, ones);
+      monitor_write(page_index, tab, &monitor);
+    }
+
+    // write data from the packed array to file, also uses scale, weights, and offset arrays
+    write_row(tab, NCHANNELS_LOW, 1, page_index, NCHANNELS_LOW * NTIMES_LOW / 8, packed, telaz, telza);
+  }
+}
+
+/**
+ * Stokes IQUV data to (optionally synthesize) and write
+ */
+DADAFITS_INLINE void stokes_iquv(const unsigned char *page, const long page_index, const float telaz, const float telza,
+    const int science_case, const int ntabs, const int ntimes, const variant_workers_t *workers) {
+  beam_work_t work = {page, 0, 0};
+  int tab, sb, index;
+  int scaled = 0; // the scale array holds the weights of a synthesized beam
+
+  LOG("Page: %li\n", page_index);
+
+  // transpose data from page to transposed buffer
+  perf_stage(PERF_DEINTERLEAVE);
+  run_workers(workers->deinterleave, &work, worker_threads);
+
+  if (! synthesize) {
+    // do not synthesize, but use TABs
+    for (tab = 0; tab < ntabs && ! drain_expired; tab++) {
+      // write data from transposed buffer, also uses scale, weights, and offset arrays (but set to neutral values)
+      write_row(tab, NCHANNELS, NPOLS, page_index, NCHANNELS * NPOLS * ntimes, &transposed[tab * NCHANNELS * NPOLS * ntimes], telaz, telza);
+    }
+    return;
+  }
+
+  // Input: transposed buffer   [TABS, TIMES, POLS, CHANNELS]
+  // Output: synthesized buffer [TIMES, POLS, CHANNELS]
+  for (index = 0; index < synthesized_beam_nselected && ! drain_expired; index++) {
+    sb = synthesized_beam_list[index];
+    if (synthesized_beam_weighted[sb]) {
+      work.tab = sb;
+      perf_stage(PERF_SYNTHESIZE);
+      run_workers(workers->synthesize, &work, worker_threads);
+      set_synthesized_scale(sb);
+      scaled = 1;
+
+      write_row(sb, NCHANNELS, NPOLS, page_index, NCHANNELS * NPOLS * ntimes, synthesized, telaz, telza);
+    } else {
+      perf_stage(PERF_SYNTHESIZE);
+      perf_begin(0);
+      synthesize_beam(transposed, synthesized_beam_table[sb], synthesized, ntimes, kernel_tuning.synthesize_time_outer);
+      perf_end(0);
+      if (scaled) {
+        set_synthesized_scale(-1);
+        scaled = 0;
+      }
+
+      // write data from synthesized buffer
+      write_row(sb, NCHANNELS, NPOLS, page_index, NCHANNELS * NPOLS * ntimes, synthesized, telaz, telza);
+    }
+  }
+
+  if (scaled) {
+    set_synthesized_scale(-1);
+  }
+}
+
+// Workers for every variant, with the geometry as constants
+#define PIPELINE_WORKERS(CASE, MODE, NTABS, NTIMES, KIND) \
+static void downsample_case##CASE##_mode##MODE(void *arg, const int thread, const int nthreads) { \
+  downsample_worker(arg, thread, nthreads, CASE); \
+} \
+static void ewma_case##CASE##_mode##MODE(void *arg, const int thread, const int nthreads) { \
+  ewma_worker(arg, thread, nthreads, CASE); \
+} \
+static void deinterleave_case##CASE##_mode##MODE(void *arg, const int thread, const int nthreads) { \
+  deinterleave_worker(arg, thread, nthreads, NTABS, NTIMES); \
+} \
+static void synthesize_case##CASE##_mode##MODE(void *arg, const int thread, const int nthreads) { \
+  synthesize_worker(arg, thread, nthreads, NTIMES); \
+} \
+static const variant_workers_t workers_case##CASE##_mode##MODE = { \
+  downsample_case##CASE##_mode##MODE, ewma_case##CASE##_mode##MODE, \
+  deinterleave_case##CASE##_mode##MODE, synthesize_case##CASE##_mode##MODE \
+};
+DADAFITS_PIPELINES(PIPELINE_WORKERS)
+#undef PIPELINE_WORKERS
+
+// One function per variant, with all geometry as constants
+#define PIPELINE_VARIANT(CASE, MODE, NTABS, NTIMES, KIND) \
+static void pipeline_case##CASE##_mode##MODE(const unsigned char *page, const long page_index, const float telaz, const float telza) { \
+  KIND(page, page_index, telaz, telza, CASE, NTABS, NTIMES, &workers_case##CASE##_mode##MODE); \
+}
+DADAFITS_PIPELINES(PIPELINE_VARIANT)
+#undef PIPELINE_VARIANT
+
+#define PIPELINE_ENTRY(CASE, MODE, NTABS, NTIMES, KIND) {CASE, MODE, NTABS, NTIMES, pipeline_case##CASE##_mode##MODE},
+static const struct {
+  int science_case;
+  int science_mode;
+  int ntabs;
+  int ntimes;
+  pipeline_func_t run;
+} pipelines[] = {
+  DADAFITS_PIPELINES(PIPELINE_ENTRY)
+};
+#undef PIPELINE_ENTRY
+
+/**
+ * Choose the pipeline for the science case and mode, and allocate its buffers
+ *
+ * @param {dadafits_context_t *} ctx        Kernel context, must stay valid while the pipeline is used
+ * @param {int} make_synthesized_beams      Write the selected synthesized beams instead of the TABs
+ * @param {float} running_alpha             Stokes I: weight of a new page in the running statistics, 0 to normalize every page by itself
+ * @returns {pipeline_func_t}               Function to process a page
+ */
+pipeline_func_t pipeline_init(const dadafits_context_t *ctx, const int make_synthesized_beams, const float running_alpha) {
+  int p, sb, band, k, index;
+
+  context = ctx;
+  synthesize = make_synthesized_beams;
+  ewma_alpha = running_alpha;
+
+  for (p = 0; p < sizeof(pipelines) / sizeof(pipelines[0]); p++) {
+    if (pipelines[p].science_case == ctx->science_case && pipelines[p].science_mode == ctx->science_mode) {
+      break;
+    }
+  }
+  if (p == sizeof(pipelines) / sizeof(pipelines[0]) || pipelines[p].ntabs != ctx->ntabs || pipelines[p].ntimes != ctx->ntimes) {
+    LOG("Error: no pipeline for science case %i, mode %i\n", ctx->science_case, ctx->science_mode);
+    exit(EXIT_FAILURE);
+  }
+
+  // partial sums of the monitoring data
+  monitor_power = calloc(worker_threads * DADAFITS_MONITOR_NPOWER, sizeof(unsigned long long));
+  monitor_ones = calloc(worker_threads, sizeof(unsigned long));
+  flat_channels = calloc(worker_threads, sizeof(long));
+  if (monitor_power == NULL || monitor_ones == NULL || flat_channels == NULL) {
+    LOG("Could not allocate monitoring buffers\n");
+    exit(EXIT_FAILURE);
+  }
+
+  if (ctx->science_mode == 1 || ctx->science_mode == 3) {
+    LOG("Allocating Stokes IQUV transpose buffer (%i,%i,%i,%i)\n", ctx->ntabs, ctx->ntimes, NPOLS, NCHANNELS);
+    transposed = malloc(ctx->ntabs * NCHANNELS * NPOLS * ctx->ntimes * sizeof(char));
+    if (transposed == NULL) {
+      LOG("Could not allocate stokes IQUV transpose matrix\n");
+      exit(EXIT_FAILURE);
+    }
+  }
+
+  if (synthesize) {
+    // the table does not change, so check the TABs of the selected beams once
+    for (index = 0; index < synthesized_beam_nselected; index++) {
+      sb = synthesized_beam_list[index];
+      for (band = 0; band < NSUBBANDS; band++) {
+        for (k = 0; k < synthesized_beam_terms[sb][band].nterms; k++) {
+          if (synthesized_beam_terms[sb][band].tabs[k] >= ctx->ntabs) {
+            LOG("Error: illegal subband index %i in synthesized beam %i\n", synthesized_beam_terms[sb][band].tabs[k], sb);
+            exit(EXIT_FAILURE);
+          }
+        }
+      }
+    }
+
+    LOG("Allocating Stokes IQUV synthesized beam buffer (1,%i,%i,%i)\n", ctx->ntimes, NPOLS, NCHANNELS);
+    synthesized = malloc(1 * NCHANNELS * NPOLS * ctx->ntimes * sizeof(char));
+    if (synthesized == NULL) {
+      LOG("Could not allocate stokes IQUV synthesized beam buffer\n");
+      exit(EXIT_FAILURE);
+    }
+  }
+
+  if (flatten_bandpass) {
+    LOG("Flattening the bandpass\n");
+  }
+  if (zero_dm) {
+    LOG("Subtracting the zero-DM signal\n");
+  }
+  if (ewma_alpha > 0) {
+    LOG("Using running statistics over pages, weight of a new page %g\n", ewma_alpha);
+  }
+  LOG("Using pipeline for science case %i, mode %i\n", ctx->science_case, ctx->science_mode);
+  return pipelines[p].run;
+}
+
+/**
+ * Log the statistics of the 1-bit packing
+ */
+void pipeline_report() {
+  long flat = 0;
+  int t;
+
+  if (packed_rows == 0) {
+    return;
+  }
+  for (t = 0; t < worker_threads; t++) {
+    flat += flat_channels[t];
+  }
+  LOG("Packed %li rows; %li of %li channels without variance\n", packed_rows, flat, packed_rows * NCHANNELS_LOW);
+}
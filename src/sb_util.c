@@ -2,15 +2,162 @@
  * Functions to:
  *  parse a Synthesized Beam table
  *  parse a selection string
+ *
+ * An entry of the table is the TAB to use for that subband, or a weighted sum of TABs:
+ * terms separated by '+', each a TAB optionally followed by '*' and a positive weight (default 1),
+ * for instance 3*0.5+4. The TABs are combined as their weighted mean, and the sum of the
+ * weights is written as the scale (DAT_SCL) of the subband.
+ *
+ * The table grows as it is read, so its size is only limited by memory. The selection is kept
+ * as a bitmap over the table, and as a dense list of the selected beams for the processing.
  */
 #include <stdlib.h>
 #include <string.h>
+#include <ctype.h>
+#include <math.h>
 
 #include "dadafits_internal.h"
 
-int synthesized_beam_table[NSYNS_MAX][NSUBBANDS];
-int synthesized_beam_selected[NSYNS_MAX];
-int synthesized_beam_count; // number of SBs in the table
+int (*synthesized_beam_table)[NSUBBANDS] = NULL; // first TAB of every subband
+subband_terms_t (*synthesized_beam_terms)[NSUBBANDS] = NULL;
+char *synthesized_beam_weighted = NULL;
+int synthesized_beam_count = 0; // number of SBs in the table
+int *synthesized_beam_list = NULL; // the selected SBs, in increasing order
+int synthesized_beam_nselected = 0;
+
+static int table_capacity = 0;
+static unsigned long *selected_bitmap = NULL;
+
+#define BITMAP_WORD (8 * sizeof(unsigned long))
+
+/**
+ * Make room for at least count beams in the table
+ */
+static void grow_table(const int count) {
+  if (count <= table_capacity) {
+    return;
+  }
+
+  int capacity = table_capacity ? 2 * table_capacity : 64;
+  while (capacity < count) {
+    capacity *= 2;
+  }
+
+  synthesized_beam_table = realloc(synthesized_beam_table, capacity * sizeof(synthesized_beam_table[0]));
+  synthesized_beam_terms = realloc(synthesized_beam_terms, capacity * sizeof(synthesized_beam_terms[0]));
+  synthesized_beam_weighted = realloc(synthesized_beam_weighted, capacity * sizeof(char));
+  if (! synthesized_beam_table || ! synthesized_beam_terms || ! synthesized_beam_weighted) {
+    LOG("Error: cannot allocate a synthesized beam table of %i beams\n", capacity);
+    exit(EXIT_FAILURE);
+  }
+  memset(&synthesized_beam_weighted[table_capacity], 0, capacity - table_capacity);
+  table_capacity = capacity;
+}
+
+/**
+ * Is the synthesized beam selected for processing
+ */
+int synthesized_beam_is_selected(const int sb) {
+  if (sb < 0 || sb >= synthesized_beam_count) {
+    return 0;
+  }
+  return (selected_bitmap[sb / BITMAP_WORD] >> (sb % BITMAP_WORD)) & 1;
+}
+
+static void select_beam(const int sb) {
+  selected_bitmap[sb / BITMAP_WORD] |= 1UL << (sb % BITMAP_WORD);
+}
+
+/**
+ * Remove a synthesized beam from the selection; call synthesized_beam_update_list afterwards
+ */
+void synthesized_beam_deselect(const int sb) {
+  if (sb >= 0 && sb < synthesized_beam_count) {
+    selected_bitmap[sb / BITMAP_WORD] &= ~(1UL << (sb % BITMAP_WORD));
+  }
+}
+
+/**
+ * Rebuild the list of selected synthesized beams from the bitmap
+ */
+void synthesized_beam_update_list() {
+  int word, bit;
+
+  synthesized_beam_nselected = 0;
+  for (word = 0; word * BITMAP_WORD < synthesized_beam_count; word++) {
+    unsigned long bits = selected_bitmap[word];
+    while (bits) {
+      bit = __builtin_ctzl(bits);
+      synthesized_beam_list[synthesized_beam_nselected++] = word * BITMAP_WORD + bit;
+      bits &= bits - 1;
+    }
+  }
+}
+
+/**
+ * Parse a subband entry of the table: a TAB, or a weighted sum of TABs
+ *
+ * @param {char *} key                  The entry
+ * @param {subband_terms_t *} terms     Output: the TABs, the weights relative to the largest, and the sum of the weights
+ * @returns {int}                       0 on success, 1 for an illegal entry
+ */
+static int parse_subband_terms(const char *key, subband_terms_t *terms) {
+  double weights[SUBBAND_TERMS_MAX];
+  double largest = 0;
+  const char *p = key;
+  char *end;
+  int k;
+
+  terms->nterms = 0;
+  terms->scale = 0;
+
+  while (1) {
+    if (terms->nterms == SUBBAND_TERMS_MAX || ! isdigit(*p)) {
+      return 1;
+    }
+    long tab = strtol(p, &end, 10);
+    if (tab >= NTABS_MAX) {
+      return 1;
+    }
+    p = end;
+
+    double weight = 1.0;
+    if (*p == '*') {
+      p++;
+      weight = strtod(p, &end);
+      if (end == p || ! isfinite(weight) || weight <= 0) {
+        return 1;
+      }
+      p = end;
+    }
+
+    terms->tabs[terms->nterms] = tab;
+    weights[terms->nterms] = weight;
+    terms->nterms++;
+    terms->scale += weight;
+    if (weight > largest) {
+      largest = weight;
+    }
+
+    if (*p == '\0') {
+      break;
+    }
+    if (*p != '+') {
+      return 1;
+    }
+    p++;
+  }
+
+  for (k = 0; k < terms->nterms; k++) {
+    long weight = lround(weights[k] / largest * SUBBAND_WEIGHT_ONE);
+    if (weight < 1) {
+      // too small compared to the other weights
+      return 1;
+    }
+    terms->weights[k] = weight;
+  }
+  return 0;
+}
 
 /**
  * Read the synthesized beam table
@@ -34,8 +181,9 @@ int read_synthesized_beam_table(char *fname) {
   }
 
   syn_index = 0;
+  int weighted = 0;
 
-#define LINELENGTH 512
+#define LINELENGTH 4096 // weighted entries make long lines
   char line[LINELENGTH];
   while (fgets(line,LINELENGTH,table)) {
     // remove comments
@@ -45,6 +193,7 @@ int read_synthesized_beam_table(char *fname) {
     }
 
     subband_index = 0;
+    grow_table(syn_index + 1);
 
     char *saveptr;
     char *key = strtok_r(line, delim, &saveptr);
@@ -54,13 +203,15 @@ int read_synthesized_beam_table(char *fname) {
         exit(EXIT_FAILURE);
       }
 
-      synthesized_beam_table[syn_index][subband_index] = atoi(key);
-
-      if (synthesized_beam_table[syn_index][subband_index] < 0 || synthesized_beam_table[syn_index][subband_index] >= NTABS_MAX) {
+      subband_terms_t *terms = &synthesized_beam_terms[syn_index][subband_index];
+      if (parse_subband_terms(key, terms)) {
         LOG("Error: illegal TAB entry '%s' at %i for synthesized beam %i\n", key, subband_index, syn_index);
         exit(EXIT_FAILURE);
       }
-
+      synthesized_beam_table[syn_index][subband_index] = terms->tabs[0];
+      if (terms->nterms > 1 || terms->scale != 1.0) {
+        synthesized_beam_weighted[syn_index] = 1;
+      }
 
       key = strtok_r(NULL, delim, &saveptr); // next token
       subband_index++;
@@ -73,25 +224,25 @@ int read_synthesized_beam_table(char *fname) {
       }
 
       // go to the next row
+      weighted += synthesized_beam_weighted[syn_index];
       syn_index++;
-      if (syn_index == NSYNS_MAX) {
-        LOG("Too many synthesized beams (more than %i), increase NSYNS_MAX\n", NSYNS_MAX);
-        exit(EXIT_FAILURE);
-      }
     }
   }
+  fclose(table);
 
   synthesized_beam_count = syn_index;
-  LOG("Read %i synthesized beams\n", synthesized_beam_count);
+  LOG("Read %i synthesized beams, %i weighted\n", synthesized_beam_count, weighted);
 
-  // clear the remaining rows of the table
-  while (syn_index < NSYNS_MAX) {
-    subband_index = 0;
-    while (subband_index < NSUBBANDS) {
-      synthesized_beam_table[syn_index][subband_index++] = SUBBAND_UNSET;
-    }
-    syn_index++;
+  // nothing selected yet, see parse_synthesized_beam_selection
+  selected_bitmap = calloc((synthesized_beam_count + BITMAP_WORD - 1) / BITMAP_WORD + 1, sizeof(unsigned long));
+  synthesized_beam_list = malloc((synthesized_beam_count + 1) * sizeof(int));
+  if (! selected_bitmap || ! synthesized_beam_list) {
+    LOG("Error: cannot allocate the synthesized beam selection\n");
+    exit(EXIT_FAILURE);
   }
+  synthesized_beam_nselected = 0;
+
+  return 0;
 }
 
 /**
@@ -116,17 +267,15 @@ int read_synthesized_beam_table(char *fname) {
 void parse_synthesized_beam_selection (char *selection) {
   int sb;
 
-  for (sb=0; sb<synthesized_beam_count; sb++) {
-    if (! selection) {
-      // without selection, process all
-      synthesized_beam_selected[sb] = 1;
-    } else {
-      // by default, do not process
-      synthesized_beam_selected[sb] = 0;
-    }
-  }
+  // by default, do not process
+  memset(selected_bitmap, 0, ((synthesized_beam_count + BITMAP_WORD - 1) / BITMAP_WORD) * sizeof(unsigned long));
 
   if (! selection) {
+    // without selection, process all
+    for (sb=0; sb<synthesized_beam_count; sb++) {
+      select_beam(sb);
+    }
+    synthesized_beam_update_list();
     LOG("Processing all synthesized beams\n");
     return;
   }
@@ -156,7 +305,7 @@ void parse_synthesized_beam_selection (char *selection) {
         exit(EXIT_FAILURE);
       }
       for (sb = s; sb <= e; sb++) {
-        synthesized_beam_selected[sb] = 1;
+        select_beam(sb);
         LOG(" %i", sb);
       }
     } else {
@@ -164,10 +313,12 @@ void parse_synthesized_beam_selection (char *selection) {
         LOG("Error: Invalid beam: '%s'\n", key);
         exit(EXIT_FAILURE);
       }
-      synthesized_beam_selected[s] = 1;
+      select_beam(s);
       LOG(" %i", s);
     }
     key = strtok_r(NULL, delim, &saveptr); // next token
   }
   LOG("\n");
+
+  synthesized_beam_update_list();
 }
@@ -0,0 +1,97 @@
+/**
+ * program: template2c
+ *
+ * Purpose: build step that compiles the ASCII FITS templates into the dadafits executable
+ *
+ * Every template is turned into a FITS file by cfitsio, exactly as dadafits would at run time,
+ * and the bytes of that file are written out as a C array. The generated source defines
+ * dadafits_templates[], see dadafits_internal.h.
+ *
+ * usage: template2c <output.c> <template.txt> [<template.txt> ...]
+ */
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <libgen.h>
+#include "fitsio.h"
+
+/**
+ * Create a FITS file from the template, and write its contents as a C array
+ *
+ * @returns {long} Size of the FITS file in bytes, -1 on error
+ */
+long write_template(FILE *out, const char *template, const char *scratch, const int index) {
+  char fname[1024];
+  fitsfile *fptr;
+  int status = 0;
+
+  // create the file on disk, as cfitsio does not report the size of a memory file
+  snprintf(fname, 1024, "!%s(%s)", scratch, template);
+  if (fits_create_file(&fptr, fname, &status) || fits_close_file(fptr, &status)) {
+    fits_report_error(stderr, status);
+    return -1;
+  }
+
+  FILE *fits = fopen(scratch, "rb");
+  if (! fits) {
+    fprintf(stderr, "Cannot read back '%s'\n", scratch);
+    return -1;
+  }
+
+  long size = 0;
+  int c;
+  fprintf(out, "static const unsigned char template_%i[] = {", index);
+  while ((c = fgetc(fits)) != EOF) {
+    fprintf(out, "%s%s0x%02x", size ? "," : "", size % 16 ? "" : "\n  ", c);
+    size++;
+  }
+  fprintf(out, "\n};\n\n");
+
+  fclose(fits);
+  unlink(scratch);
+  return size;
+}
+
+int main(int argc, char *argv[]) {
+  char scratch[1024];
+  int t;
+
+  if (argc < 3) {
+    fprintf(stderr, "usage: template2c <output.c> <template.txt> [<template.txt> ...]\n");
+    exit(EXIT_FAILURE);
+  }
+
+  FILE *out = fopen(argv[1], "w");
+  if (! out) {
+    fprintf(stderr, "Cannot write '%s'\n", argv[1]);
+    exit(EXIT_FAILURE);
+  }
+  snprintf(scratch, 1024, "%s.fits", argv[1]);
+
+  fprintf(out, "/* Generated by template2c, do not edit */\n");
+  fprintf(out, "#include \"dadafits_internal.h\"\n\n");
+
+  long sizes[argc];
+  for (t = 2; t < argc; t++) {
+    sizes[t] = write_template(out, argv[t], scratch, t - 2);
+    if (sizes[t] < 0) {
+      fprintf(stderr, "Cannot convert template '%s'\n", argv[t]);
+      fclose(out);
+      unlink(argv[1]);
+      exit(EXIT_FAILURE);
+    }
+  }
+
+  // templates are looked up by their file name
+  fprintf(out, "const dadafits_template_t dadafits_templates[] = {\n");
+  for (t = 2; t < argc; t++) {
+    char *copy = strdup(argv[t]);
+    fprintf(out, "  {\"%s\", template_%i, %li},\n", basename(copy), t - 2, sizes[t]);
+    free(copy);
+  }
+  fprintf(out, "  {NULL, NULL, 0}\n};\n");
+
+  fclose(out);
+  return 0;
+}
@@ -0,0 +1,154 @@
+/**
+ * Run a function on a number of worker threads, and wait for all of them to finish
+ *
+ * The work is split by the function itself, using its thread index and the number of threads.
+ * The calling thread takes part as thread 0; the other threads are started once by workers_init,
+ * wait for the next job, and are stopped by workers_close.
+ * Jobs are handed out from a single thread (the main loop), one at a time.
+ * When enabled, every thread counts its work for the current stage, see perf.c.
+ */
+#include <stdlib.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include "dadafits_internal.h"
+
+int worker_threads = 1;
+
+static pthread_t *pool_threads = NULL;
+static int pool_size = 0; // started threads, excluding the caller
+
+static pthread_mutex_t pool_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t pool_start = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t pool_done = PTHREAD_COND_INITIALIZER;
+
+// the current job, protected by pool_lock
+static worker_func_t job_func = NULL;
+static void *job_arg = NULL;
+static int job_nthreads = 0;
+static long job_generation = 0; // incremented for every job
+static int job_pending = 0;     // threads (besides the caller) still working on the job
+static int pool_exit = 0;
+
+static void run_counted(worker_func_t func, void *arg, const int thread, const int nthreads) {
+  perf_begin(thread);
+  func(arg, thread, nthreads);
+  perf_end(thread);
+}
+
+static void *worker_main(void *arg) {
+  const int thread = (int) (intptr_t) arg;
+  long seen = 0;
+
+  pthread_mutex_lock(&pool_lock);
+  while (1) {
+    while (! pool_exit && job_generation == seen) {
+      pthread_cond_wait(&pool_start, &pool_lock);
+    }
+    if (pool_exit) {
+      break;
+    }
+    seen = job_generation;
+
+    // threads beyond the number asked for sit this job out
+    if (thread < job_nthreads) {
+      worker_func_t func = job_func;
+      void *func_arg = job_arg;
+      const int nthreads = job_nthreads;
+      pthread_mutex_unlock(&pool_lock);
+
+      run_counted(func, func_arg, thread, nthreads);
+
+      pthread_mutex_lock(&pool_lock);
+      if (--job_pending == 0) {
+        pthread_cond_signal(&pool_done);
+      }
+    }
+  }
+  pthread_mutex_unlock(&pool_lock);
+  return NULL;
+}
+
+/**
+ * Set the number of worker threads, and start them
+ *
+ * @param {int} nthreads  Number of threads, 0 to use all online processors
+ */
+void workers_init(int nthreads) {
+  int t;
+
+  if (nthreads <= 0) {
+    nthreads = sysconf(_SC_NPROCESSORS_ONLN);
+  }
+  worker_threads = nthreads < 1 ? 1 : nthreads;
+
+  if (worker_threads > 1) {
+    pool_threads = malloc((worker_threads - 1) * sizeof(pthread_t));
+    if (! pool_threads) {
+      LOG("Error: cannot allocate worker threads\n");
+      exit(EXIT_FAILURE);
+    }
+    for (t = 1; t < worker_threads; t++) {
+      if (pthread_create(&pool_threads[t - 1], NULL, worker_main, (void *) (intptr_t) t)) {
+        LOG("Error: cannot start worker thread\n");
+        exit(EXIT_FAILURE);
+      }
+      pool_size++;
+    }
+  }
+  LOG("Using %i worker threads\n", worker_threads);
+}
+
+/**
+ * Stop the worker threads
+ */
+void workers_close() {
+  int t;
+
+  pthread_mutex_lock(&pool_lock);
+  pool_exit = 1;
+  pthread_cond_broadcast(&pool_start);
+  pthread_mutex_unlock(&pool_lock);
+
+  for (t = 0; t < pool_size; t++) {
+    pthread_join(pool_threads[t], NULL);
+  }
+  free(pool_threads);
+  pool_threads = NULL;
+  pool_size = 0;
+}
+
+/**
+ * Run func(arg, thread, nthreads) on the worker threads
+ *
+ * @param {worker_func_t} func  Function to run
+ * @param {void *} arg          Argument passed to every thread
+ * @param {int} nthreads        Number of threads to use, at most worker_threads
+ */
+void run_workers(worker_func_t func, void *arg, int nthreads) {
+  if (nthreads > pool_size + 1) {
+    nthreads = pool_size + 1;
+  }
+  if (nthreads <= 1) {
+    run_counted(func, arg, 0, 1);
+    return;
+  }
+
+  pthread_mutex_lock(&pool_lock);
+  job_func = func;
+  job_arg = arg;
+  job_nthreads = nthreads;
+  job_pending = nthreads - 1;
+  job_generation++;
+  pthread_cond_broadcast(&pool_start);
+  pthread_mutex_unlock(&pool_lock);
+
+  run_counted(func, arg, 0, nthreads);
+
+  pthread_mutex_lock(&pool_lock);
+  while (job_pending > 0) {
+    pthread_cond_wait(&pool_done, &pool_lock);
+  }
+  pthread_mutex_unlock(&pool_lock);
+}
@@ -0,0 +1,139 @@
+/**
+ * Write bandwidth budget (I/O quality of service)
+ *
+ * A token bucket shared by all beams: writes take tokens (bytes) from the bucket,
+ * which is refilled at the configured rate. When the bucket is empty, writers sleep
+ * until enough tokens are available. This turns the burst of writes at the end of
+ * every page into a smooth stream of at most the configured rate.
+ *
+ * Beams with priority are never delayed, but still take their tokens, so the
+ * other beams absorb the throttling.
+ */
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "dadafits_internal.h"
+
+// Bucket depth in seconds of the write rate: small, to keep the stream smooth
+#define QOS_BURST 0.05
+
+static int qos_enabled = 0;
+static double qos_rate = 0;      // bytes per second
+static double qos_capacity = 0;  // bytes
+static double qos_tokens = 0;    // bytes, negative when priority beams are in debt
+static double qos_last = 0;      // time of last refill
+static char *qos_priority = NULL; // per beam
+static int qos_beams = 0;
+
+// statistics
+static double qos_waited = 0;    // total time spent sleeping
+
+static double now() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + 1e-9 * ts.tv_nsec;
+}
+
+static void refill() {
+  double t = now();
+  qos_tokens += (t - qos_last) * qos_rate;
+  if (qos_tokens > qos_capacity) {
+    qos_tokens = qos_capacity;
+  }
+  qos_last = t;
+}
+
+/**
+ * Set up the write budget
+ *
+ * @param {float} rate          Maximum write rate in MB/s, 0 disables the budget
+ * @param {char *} priorities   Optional comma separated list of beams that are never delayed
+ * @param {int} nbeams          Number of beams: TABs, or synthesized beams in the table
+ */
+void write_qos_init(const float rate, char *priorities, const int nbeams) {
+  qos_beams = nbeams;
+  qos_priority = calloc(nbeams + 1, sizeof(char));
+  if (! qos_priority) {
+    LOG("Error: cannot allocate the write priorities\n");
+    exit(EXIT_FAILURE);
+  }
+
+  if (rate <= 0) {
+    qos_enabled = 0;
+    return;
+  }
+
+  qos_rate = rate * 1e6;
+  qos_capacity = qos_rate * QOS_BURST;
+  if (qos_capacity < QOS_CHUNK) {
+    qos_capacity = QOS_CHUNK;
+  }
+  qos_tokens = qos_capacity;
+  qos_last = now();
+  qos_enabled = 1;
+
+  LOG("Write budget: %.1f MB/s\n", rate);
+
+  if (priorities) {
+    char delim[2] = ",";
+    char *saveptr;
+    char *key = strtok_r(priorities, delim, &saveptr);
+
+    LOG("Write priority for beams:");
+    while (key) {
+      int beam = atoi(key);
+      if (beam < 0 || beam >= nbeams) {
+        LOG("\nError: Invalid beam for write priority: '%s'\n", key);
+        exit(EXIT_FAILURE);
+      }
+      qos_priority[beam] = 1;
+      LOG(" %i", beam);
+      key = strtok_r(NULL, delim, &saveptr);
+    }
+    LOG("\n");
+  }
+}
+
+/**
+ * Is the write budget enabled
+ */
+int write_qos_active() {
+  return qos_enabled;
+}
+
+/**
+ * Take tokens for writing bytes for the given beam, sleeping when over budget
+ *
+ * @param {int} beam      Beam (TAB or SB) index
+ * @param {long} bytes    Number of bytes about to be written
+ */
+void write_qos_acquire(const int beam, const long bytes) {
+  if (! qos_enabled) {
+    return;
+  }
+
+  refill();
+
+  if (! qos_priority[beam] && qos_tokens < bytes) {
+    double wait = (bytes - qos_tokens) / qos_rate;
+    struct timespec ts;
+    ts.tv_sec = (time_t) wait;
+    ts.tv_nsec = (long) ((wait - ts.tv_sec) * 1e9);
+    nanosleep(&ts, NULL);
+
+    qos_waited += wait;
+    refill();
+  }
+
+  qos_tokens -= bytes;
+}
+
+/**
+ * Log the time spent waiting for the write budget
+ */
+void write_qos_report() {
+  if (qos_enabled) {
+    LOG("Write budget: waited %.1f seconds in total\n", qos_waited);
+  }
+}